@@ -0,0 +1,969 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <algorithm>
+#include <random>
+
+#ifdef RT_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "Scene.h"
+#include "Object.h"
+#include "Material.h"
+#include "Simd.h"
+#include "SphereSoA.h"
+#include "DemoScenes.h"
+#include "ImageWriter.h"
+
+// Renders a fixed set of deterministic scenes and reports throughput as JSON, so runs from
+// different builds can be diffed. Progress and warnings go to std::clog, the report to
+// stdout or the file given with --output.
+
+#ifndef RT_BUILD_TYPE
+#define RT_BUILD_TYPE "unknown"
+#endif
+
+class BenchScene {
+public:
+    const char* name;
+    void (*build)(Scene&);
+};
+
+static const BenchScene bench_scenes[] = {
+    { "spheres", BuildSpheresScene },
+    { "glass", BuildGlassScene },
+    { "many_lights", BuildManyLightsScene },
+    { "sphere_grid", BuildSphereGridScene },
+    { "million_spheres", BuildMillionSpheresScene },
+    { "mesh", BuildMeshScene },
+};
+
+class BenchSettings {
+public:
+    int width = 320;
+    int height = 0;                 // 0 keeps 16:9
+    int samples_per_pixel = 16;
+    int max_bounces = 16;
+    int repeats = 3;                // Best of this many renders per thread count
+    double adaptive_threshold = 0;  // Adaptive sampling with this threshold, 0 for fixed spp
+    uint64_t seed = 1;
+    int shading_hits = 1000000;     // Hits shaded by the shading benchmark, 0 to skip it
+    int warp_samples = 1000000;     // Samples drawn by the warp benchmark, 0 to skip it
+    int soa_rays = 200000;          // Rays of the flat sphere list benchmark, 0 to skip it
+    bool png_check = true;          // Encode test images and, with zlib, decode them again
+    int packet_size = 0;            // Scene::packet_size for the renders
+    int bvh_width = 8;              // Scene::bvh_width for the renders
+    std::vector<std::string> integrators;   // "megakernel" and/or "wavefront" (Scene::wavefront)
+    std::vector<unsigned int> thread_counts;
+    std::vector<std::string> scenes;
+    std::string output_path;
+};
+
+class PrimaryRun {
+public:
+    int packet_size;
+    double seconds;                 // Of the fastest repeat
+    uint64_t hits;
+};
+
+// Packet sizes the camera ray benchmark compares, 0 being rays traced one by one.
+static const int primary_packet_sizes[] = { 0, 4, 8, 16 };
+
+class WidthRun {
+public:
+    int width;
+    double build_seconds;           // BVH build, including the collapse to the wide form
+    size_t nodes;
+    size_t bytes;
+    double camera_seconds;          // Of the fastest repeat
+    uint64_t camera_hits;
+    RenderStats stats;              // Of the fastest repeat
+};
+
+// BVH widths the acceleration structure benchmark compares, 2 being the binary tree.
+static const int bvh_widths[] = { 2, 4, 8 };
+
+class BenchRun {
+public:
+    bool wavefront;
+    unsigned int threads;
+    RenderStats stats;              // Of the fastest repeat
+};
+
+static void PrintUsage() {
+    std::clog << "Usage: raytracer_bench [options]\n"
+        << "  --scene NAME[,NAME...]  scenes to run (default: all of";
+    for (const BenchScene& s : bench_scenes) std::clog << " " << s.name;
+    std::clog << ")\n"
+        << "  --width N               image width (default 320)\n"
+        << "  --height N              image height (default width * 9 / 16)\n"
+        << "  --spp N                 samples per pixel (default 16)\n"
+        << "  --max-bounces N         path length limit (default 16)\n"
+        << "  --threads N[,N...]      thread counts to measure (default 1, 2, 4, ... up to all cores)\n"
+        << "  --repeat N              renders per thread count, the fastest is reported (default 3)\n"
+        << "  --seed N                base seed of the pixel random streams (default 1)\n"
+        << "  --adaptive T            adaptive sampling with error threshold T, --spp is the budget\n"
+        << "  --shading-hits N        hits for the shading cost benchmark, 0 to skip it (default 1000000)\n"
+        << "  --warp-samples N        samples for the direction sampling benchmark, 0 to skip it (default 1000000)\n"
+        << "  --soa-rays N            rays for the flat sphere list benchmark, 0 to skip it (default 200000)\n"
+        << "  --png-check 0|1         encode test images as PNG and decode them again with zlib (default 1)\n"
+        << "  --packet-size N         camera rays traced per packet in the renders: 4, 8, 16 or 0 for none (default 0)\n"
+        << "  --integrator NAME[,NAME...]  megakernel (one path at a time) and/or wavefront (default both)\n"
+        << "  --bvh-width N           children per BVH node in the renders: 2, 4 or 8 (default 8)\n"
+        << "  --output FILE           write the JSON report to FILE instead of stdout\n";
+}
+
+static std::vector<std::string> SplitList(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream stream(list);
+    std::string item;
+    while (std::getline(stream, item, ','))
+        if (!item.empty()) items.push_back(item);
+    return items;
+}
+
+static bool ParseArgs(int argc, char** argv, BenchSettings& settings) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            PrintUsage();
+            std::exit(0);
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return false;
+        }
+        std::string value = argv[++i];
+        if (arg == "--scene") settings.scenes = SplitList(value);
+        else if (arg == "--width") settings.width = std::atoi(value.c_str());
+        else if (arg == "--height") settings.height = std::atoi(value.c_str());
+        else if (arg == "--spp") settings.samples_per_pixel = std::atoi(value.c_str());
+        else if (arg == "--max-bounces") settings.max_bounces = std::atoi(value.c_str());
+        else if (arg == "--repeat") settings.repeats = std::atoi(value.c_str());
+        else if (arg == "--seed") settings.seed = std::strtoull(value.c_str(), nullptr, 10);
+        else if (arg == "--output") settings.output_path = value;
+        else if (arg == "--adaptive") settings.adaptive_threshold = std::atof(value.c_str());
+        else if (arg == "--shading-hits") settings.shading_hits = std::atoi(value.c_str());
+        else if (arg == "--warp-samples") settings.warp_samples = std::atoi(value.c_str());
+        else if (arg == "--soa-rays") settings.soa_rays = std::atoi(value.c_str());
+        else if (arg == "--png-check") settings.png_check = std::atoi(value.c_str()) != 0;
+        else if (arg == "--packet-size") settings.packet_size = std::atoi(value.c_str());
+        else if (arg == "--integrator") settings.integrators = SplitList(value);
+        else if (arg == "--bvh-width") settings.bvh_width = std::atoi(value.c_str());
+        else if (arg == "--threads") {
+            settings.thread_counts.clear();
+            for (const std::string& item : SplitList(value))
+                settings.thread_counts.push_back(unsigned(std::atoi(item.c_str())));
+        }
+        else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return false;
+        }
+    }
+
+    if (settings.height <= 0) settings.height = std::max(1, settings.width * 9 / 16);
+    if (settings.width <= 0 || settings.samples_per_pixel <= 0 || settings.repeats <= 0) {
+        std::cerr << "Width, samples and repeats must be positive" << std::endl;
+        return false;
+    }
+    for (unsigned int threads : settings.thread_counts) {
+        if (threads == 0) {
+            std::cerr << "Thread counts must be positive" << std::endl;
+            return false;
+        }
+    }
+    if (settings.thread_counts.empty()) {
+        unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned int threads = 1; threads < cores; threads *= 2)
+            settings.thread_counts.push_back(threads);
+        settings.thread_counts.push_back(cores);
+    }
+    if (settings.bvh_width != 2 && settings.bvh_width != 4 && settings.bvh_width != 8) {
+        std::cerr << "BVH width must be 2, 4 or 8" << std::endl;
+        return false;
+    }
+    if (settings.integrators.empty())
+        settings.integrators = { "megakernel", "wavefront" };
+    for (const std::string& integrator : settings.integrators) {
+        if (integrator != "megakernel" && integrator != "wavefront") {
+            std::cerr << "Unknown integrator " << integrator << std::endl;
+            return false;
+        }
+    }
+    if (settings.scenes.empty()) {
+        for (const BenchScene& s : bench_scenes)
+            settings.scenes.push_back(s.name);
+    }
+    return true;
+}
+
+static const BenchScene* FindScene(const std::string& name) {
+    for (const BenchScene& s : bench_scenes)
+        if (name == s.name) return &s;
+    return nullptr;
+}
+
+// Shading cost per hit, apart from tracing: a fixed stream of hits on the four built-in
+// materials is shaded through the compact table the renderer uses, and through the virtual
+// Material interface that custom materials are reached by. Reports the best of repeats
+// passes in nanoseconds per hit.
+static void BenchShading(const BenchSettings& settings, double& compact_ns, double& virtual_ns) {
+    std::vector<std::shared_ptr<Material>> materials = {
+        MakeLambertian(Color(0.7, 0.5, 0.3)),
+        MakeMetal(Color(0.8, 0.8, 0.9), 0.2),
+        MakeDielectric(1.5),
+        MakeEmission(Color(1, 0.9, 0.8), 4),
+    };
+    std::vector<CompactMaterial> compact_table(materials.size());
+    std::vector<CompactMaterial> virtual_table(materials.size());
+    for (size_t m = 0; m < materials.size(); m++) {
+        materials[m]->Compact(compact_table[m]);
+        virtual_table[m].custom = materials[m].get();
+    }
+
+    // Random hits in a random material order, so the dispatch is not predictable.
+    seed_thread_rng(settings.seed, 0);
+    size_t count = size_t(settings.shading_hits);
+    std::vector<Ray> rays(count);
+    std::vector<HitRecord> hits(count);
+    for (size_t i = 0; i < count; i++) {
+        Vec3 normal = random_unit_vector();
+        Vec3 direction = random_unit_vector();
+        if (dot(direction, normal) > 0)
+            direction = -direction;
+        rays[i] = Ray(Point3(0, 0, 0), direction);
+        hits[i].hitPoint = Point3(random_double(), random_double(), random_double());
+        hits[i].normal = normal;
+        hits[i].t = 1;
+        hits[i].front_face = random_double() < 0.5;
+        hits[i].mat_id = std::min(int(random_double() * materials.size()), int(materials.size()) - 1);
+        hits[i].object_id = 0;
+    }
+
+    auto run = [&](const std::vector<CompactMaterial>& table) {
+        double best = 0;
+        for (int r = 0; r < settings.repeats; r++) {
+            seed_thread_rng(settings.seed, 1);
+            Color sum;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < count; i++) {
+                Scattering scattering;
+                double x = random_double();
+                double y = random_double();
+                table[hits[i].mat_id].Scatter(rays[i], hits[i], Vec3(x, y, random_double()), scattering);
+                sum = sum + scattering.attenuation + scattering.scattered.direction();
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (r == 0 || seconds < best)
+                best = seconds;
+            if (!(sum.x() == sum.x()))
+                std::clog << "Warning: shading produced NaN" << std::endl;
+        }
+        return count > 0 ? best * 1e9 / count : 0;
+    };
+    compact_ns = run(compact_table);
+    virtual_ns = run(virtual_table);
+    std::clog << "shading: " << std::fixed << std::setprecision(2) << compact_ns << " ns/hit compact, "
+        << virtual_ns << " ns/hit virtual" << std::endl;
+}
+
+// The sampling routines Warp.h replaced, kept here to measure against: rejection loops
+// and the closed forms through the library's sin and cos.
+static Vec3 RejectionUnitVector() {
+    while (true) {
+        auto p = Vec3::random(-1, 1);
+        auto lensq = p.length_squared();
+        if (1e-160 < lensq && lensq <= 1)
+            return p / std::sqrt(lensq);
+    }
+}
+
+static Vec3 RejectionUnitDisk() {
+    while (true) {
+        auto p = Vec3(random_double(-1, 1), random_double(-1, 1), 0);
+        if (p.length_squared() < 1)
+            return p;
+    }
+}
+
+static Vec3 TrigUnitVector(double u0, double u1) {
+    double z = 1 - 2 * u0;
+    double r = std::sqrt(std::fmax(0.0, 1 - z * z));
+    double phi = 2 * pi * u1;
+    return Vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+static Vec3 TrigUnitDisk(double u0, double u1) {
+    double a = 2 * u0 - 1;
+    double b = 2 * u1 - 1;
+    if (a == 0 && b == 0)
+        return Vec3(0, 0, 0);
+    double r, phi;
+    if (std::fabs(a) > std::fabs(b)) {
+        r = a;
+        phi = (pi / 4) * (b / a);
+    }
+    else {
+        r = b;
+        phi = pi / 2 - (pi / 4) * (a / b);
+    }
+    return Vec3(r * std::cos(phi), r * std::sin(phi), 0);
+}
+
+class WarpTimings {
+public:
+    const char* name;
+    double rejection_ns = 0;    // Rejection loop, drawing its own numbers
+    double trig_ns = 0;         // Closed form through std::sin and std::cos, 0 if there is none
+    double scalar_ns = 0;       // Warp.h, one sample per call
+    double batched_ns = 0;      // Warp.h, the whole array in one call
+};
+
+// Cost of drawing a direction or disk position, in nanoseconds per sample and including
+// the random numbers, so rejection loops pay for the draws they throw away.
+static std::vector<WarpTimings> BenchWarps(const BenchSettings& settings) {
+    size_t count = size_t(settings.warp_samples);
+    std::vector<double> u0(count), u1(count);
+    std::vector<real> nx(count), ny(count), nz(count), x(count), y(count), z(count);
+    seed_thread_rng(settings.seed, 2);
+    for (size_t i = 0; i < count; i++) {
+        Vec3 n = RejectionUnitVector();
+        nx[i] = n.x();
+        ny[i] = n.y();
+        nz[i] = n.z();
+    }
+
+    auto time = [&](auto&& body) {
+        double best = 0;
+        for (int r = 0; r < settings.repeats; r++) {
+            seed_thread_rng(settings.seed, 3);
+            auto start = std::chrono::steady_clock::now();
+            Vec3 sum = body();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (r == 0 || seconds < best)
+                best = seconds;
+            if (!(sum.x() == sum.x()))
+                std::clog << "Warning: warp produced NaN" << std::endl;
+        }
+        return count > 0 ? best * 1e9 / count : 0;
+    };
+    auto each = [&](auto&& sample) {
+        return [&, sample]() {
+            Vec3 sum;
+            for (size_t i = 0; i < count; i++)
+                sum = sum + sample(i);
+            return sum;
+        };
+    };
+    auto draw = [&]() {
+        for (size_t i = 0; i < count; i++) {
+            u0[i] = random_double();
+            u1[i] = random_double();
+        }
+    };
+    auto total = [&]() {
+        Vec3 sum;
+        for (size_t i = 0; i < count; i++)
+            sum = sum + Vec3(x[i], y[i], z[i]);
+        return sum;
+    };
+    auto uniform = [](size_t) {
+        double a = random_double();
+        return Vec3(a, random_double(), 0);
+    };
+
+    std::vector<WarpTimings> timings(3);
+    WarpTimings& sphere = timings[0];
+    sphere.name = "unit_vector";
+    sphere.rejection_ns = time(each([](size_t) { return RejectionUnitVector(); }));
+    sphere.trig_ns = time(each([&](size_t i) { Vec3 u = uniform(i); return TrigUnitVector(u.x(), u.y()); }));
+    sphere.scalar_ns = time(each([&](size_t i) { return sample_unit_vector(uniform(i)); }));
+    sphere.batched_ns = time([&]() {
+        draw();
+        SampleUnitVectors(count, u0.data(), u1.data(), x.data(), y.data(), z.data());
+        return total();
+    });
+
+    WarpTimings& disk = timings[1];
+    disk.name = "unit_disk";
+    std::fill(z.begin(), z.end(), real(0));
+    disk.rejection_ns = time(each([](size_t) { return RejectionUnitDisk(); }));
+    disk.trig_ns = time(each([&](size_t i) { Vec3 u = uniform(i); return TrigUnitDisk(u.x(), u.y()); }));
+    disk.scalar_ns = time(each([&](size_t i) { return sample_unit_disk(uniform(i)); }));
+    disk.batched_ns = time([&]() {
+        draw();
+        SampleUnitDisks(count, u0.data(), u1.data(), x.data(), y.data());
+        return total();
+    });
+
+    // Cosine-weighted around a normal; the rejection version is the normal plus a uniform
+    // unit vector the Lambertian material used before.
+    WarpTimings& cosine = timings[2];
+    cosine.name = "cosine_direction";
+    cosine.rejection_ns = time(each([&](size_t i) {
+        Vec3 n(nx[i], ny[i], nz[i]);
+        Vec3 d = n + RejectionUnitVector();
+        return d.near_zero() ? n : normalize(d);
+    }));
+    cosine.scalar_ns = time(each([&](size_t i) {
+        return sample_cosine_direction(Vec3(nx[i], ny[i], nz[i]), uniform(i));
+    }));
+    cosine.batched_ns = time([&]() {
+        draw();
+        SampleCosineDirections(count, nx.data(), ny.data(), nz.data(), u0.data(), u1.data(), x.data(), y.data(), z.data());
+        return total();
+    });
+
+    for (const WarpTimings& t : timings) {
+        std::clog << t.name << ": " << std::fixed << std::setprecision(2) << t.rejection_ns << " ns rejection, ";
+        if (t.trig_ns > 0)
+            std::clog << t.trig_ns << " ns sin/cos, ";
+        std::clog << t.scalar_ns << " ns scalar, " << t.batched_ns << " ns batched" << std::endl;
+    }
+    return timings;
+}
+
+class PngRun {
+public:
+    std::string name;
+    int width, height;
+    unsigned int threads;       // Passed to WritePNG; sets the strip count
+    size_t bytes = 0;
+    double seconds = 0;         // Of the fastest repeat
+    const char* round_trip = "unchecked";   // "ok", "failed", or "unchecked" without zlib
+};
+
+#ifdef RT_HAVE_ZLIB
+// Decodes an 8-bit RGB PNG as WritePNG writes it, independently of the encoder: zlib
+// checks the stream and its Adler-32, the chunk CRCs are checked here and the rows are
+// unfiltered. Returns false, with the reason in error, if anything does not hold.
+static bool DecodePNG(const std::vector<unsigned char>& file, int width, int height,
+    std::vector<unsigned char>& rgb, std::string& error) {
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    if (file.size() < 8 || std::memcmp(file.data(), signature, 8) != 0) {
+        error = "bad signature";
+        return false;
+    }
+    auto u32 = [&](size_t at) {
+        return (uint32_t(file[at]) << 24) | (uint32_t(file[at + 1]) << 16) | (uint32_t(file[at + 2]) << 8) | file[at + 3];
+    };
+    std::vector<unsigned char> idat;
+    bool header = false, end = false;
+    for (size_t at = 8; !end; ) {
+        if (at + 12 > file.size()) {
+            error = "truncated chunk";
+            return false;
+        }
+        size_t length = u32(at);
+        if (length > file.size() - at - 12) {
+            error = "truncated chunk";
+            return false;
+        }
+        const unsigned char* type = &file[at + 4];
+        const unsigned char* data = &file[at + 8];
+        if (uint32_t(crc32(crc32(0, type, 4), data, uInt(length))) != u32(at + 8 + length)) {
+            error = "bad chunk CRC";
+            return false;
+        }
+        if (std::memcmp(type, "IHDR", 4) == 0) {
+            static const unsigned char rgb8[5] = { 8, 2, 0, 0, 0 };
+            if (length != 13 || u32(at + 8) != uint32_t(width) || u32(at + 12) != uint32_t(height)
+                || std::memcmp(data + 8, rgb8, 5) != 0) {
+                error = "unexpected IHDR";
+                return false;
+            }
+            header = true;
+        }
+        else if (std::memcmp(type, "IDAT", 4) == 0) {
+            idat.insert(idat.end(), data, data + length);
+        }
+        else if (std::memcmp(type, "IEND", 4) == 0) {
+            end = true;
+        }
+        at += 12 + length;
+    }
+    if (!header) {
+        error = "no IHDR";
+        return false;
+    }
+
+    size_t row_size = 1 + size_t(width) * 3;
+    std::vector<unsigned char> filtered(row_size * height);
+    uLongf filtered_size = uLongf(filtered.size());
+    int status = uncompress(filtered.data(), &filtered_size, idat.data(), uLong(idat.size()));
+    if (status != Z_OK || filtered_size != filtered.size()) {
+        error = status != Z_OK ? std::string("zlib: ") + zError(status) : "short image data";
+        return false;
+    }
+
+    size_t stride = size_t(width) * 3;
+    rgb.assign(stride * height, 0);
+    for (int y = 0; y < height; y++) {
+        const unsigned char* in = &filtered[y * row_size + 1];
+        unsigned char* row = &rgb[y * stride];
+        const unsigned char* above = y > 0 ? row - stride : nullptr;
+        int filter = filtered[y * row_size];
+        for (size_t x = 0; x < stride; x++) {
+            int a = x >= 3 ? row[x - 3] : 0;
+            int b = above ? above[x] : 0;
+            int c = above && x >= 3 ? above[x - 3] : 0;
+            int predictor;
+            switch (filter) {
+            case 0: predictor = 0; break;
+            case 1: predictor = a; break;
+            case 2: predictor = b; break;
+            case 3: predictor = (a + b) / 2; break;
+            case 4: {
+                int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+                predictor = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+                break;
+            }
+            default:
+                error = "bad filter type " + std::to_string(filter);
+                return false;
+            }
+            row[x] = static_cast<unsigned char>(in[x] + predictor);
+        }
+    }
+    return true;
+}
+#endif
+
+// PNG encoding, timed and, with zlib, checked by decoding every file again. The images
+// cover the encoder's edge cases: a single row, fewer rows than one strip, noise that
+// leaves deflate nothing to match, and a smooth image long enough for many strips whose
+// matches reach back into the strip before. Each is written with one thread and with
+// eight, which changes where the strips fall.
+static std::vector<PngRun> BenchPng(const BenchSettings& settings, bool& all_ok) {
+    class PngImage {
+    public:
+        const char* name;
+        int width, height;
+        bool noise;
+        std::vector<unsigned char> rgb;
+    };
+    std::mt19937 noise(uint32_t(settings.seed));
+    auto smooth = [](int x, int y, int c) {
+        return static_cast<unsigned char>((x * (c + 1) + y * (3 - c) + ((x / 8 + y / 8) % 2) * 40) & 0xFF);
+    };
+    std::vector<PngImage> images = {
+        { "one_row", 333, 1, false, {} },
+        { "under_one_strip", 70, 9, false, {} },
+        { "noise", 300, 200, true, {} },
+        { "smooth", 640, 360, false, {} },
+    };
+    for (PngImage& image : images) {
+        image.rgb.resize(size_t(image.width) * image.height * 3);
+        for (int y = 0; y < image.height; y++)
+            for (int x = 0; x < image.width; x++)
+                for (int c = 0; c < 3; c++)
+                    image.rgb[(size_t(y) * image.width + x) * 3 + c] = image.noise ? static_cast<unsigned char>(noise() >> 24) : smooth(x, y, c);
+    }
+
+    fs::path path = fs::temp_directory_path() / "raytracer_bench_check.png";
+    std::vector<PngRun> runs;
+    all_ok = true;
+    for (const PngImage& image : images) {
+        for (unsigned int threads : { 1u, 8u }) {
+            PngRun run;
+            run.name = image.name;
+            run.width = image.width;
+            run.height = image.height;
+            run.threads = threads;
+            bool written = true;
+            for (int r = 0; r < settings.repeats && written; r++) {
+                auto start = std::chrono::steady_clock::now();
+                written = WritePNG(path, image.width, image.height, image.rgb.data(), threads);
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (r == 0 || seconds < run.seconds)
+                    run.seconds = seconds;
+            }
+            std::ifstream file(path, std::ios::binary);
+            std::vector<unsigned char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            run.bytes = bytes.size();
+            std::string error = written ? "" : "WritePNG failed";
+#ifdef RT_HAVE_ZLIB
+            std::vector<unsigned char> decoded;
+            if (written && DecodePNG(bytes, image.width, image.height, decoded, error) && decoded != image.rgb)
+                error = "decoded pixels differ";
+            run.round_trip = error.empty() ? "ok" : "failed";
+#endif
+            if (!error.empty()) {
+                std::clog << "Warning: PNG " << image.name << " with " << threads << " threads: " << error << std::endl;
+                all_ok = false;
+            }
+            std::clog << "PNG " << image.name << " (" << image.width << "x" << image.height << ", " << threads
+                << " threads): " << run.bytes << " bytes, " << std::fixed << std::setprecision(3)
+                << run.seconds * 1e3 << " ms, round trip " << run.round_trip << std::endl;
+            runs.push_back(run);
+        }
+    }
+    std::error_code ignored;
+    fs::remove(path, ignored);
+    return runs;
+}
+
+static const char* SimdLevelName(SimdLevel level) {
+    switch (level) {
+    case SimdLevel::AVX: return "avx";
+    case SimdLevel::SSE2: return "sse2";
+    default: return "scalar";
+    }
+}
+
+class SoARun {
+public:
+    const char* kernel;
+    double seconds = 0;         // Of the fastest repeat
+    bool same_hits = true;      // Found the nearest sphere the virtual loop found, for every ray
+};
+
+// Closest hit against a flat list of spheres, apart from any BVH: a loop over Sphere
+// objects through the virtual RayHit, as a list of objects is searched, against SphereSoA
+// at every SIMD level the CPU has, selected through simd_level(). Counts ray-sphere tests,
+// rays times spheres, per second.
+static const int soa_sphere_count = 490;
+
+static std::vector<SoARun> BenchSoASpheres(const BenchSettings& settings) {
+    seed_thread_rng(settings.seed, 4);
+    auto material = MakeLambertian(Color(0.5, 0.5, 0.5));
+    std::vector<std::shared_ptr<Object>> objects;
+    SphereSoA soa;
+    soa.reserve(soa_sphere_count);
+    for (int i = 0; i < soa_sphere_count; i++) {
+        Point3 center(random_double(-10, 10), random_double(-10, 10), random_double(-10, 10));
+        real radius = real(random_double(0.1, 0.6));
+        objects.push_back(std::make_shared<Sphere>(center, radius, material));
+        soa.Add(center, radius);
+    }
+    size_t count = size_t(settings.soa_rays);
+    std::vector<Ray> rays(count);
+    for (size_t i = 0; i < count; i++) {
+        Point3 origin(random_double(-12, 12), random_double(-12, 12), random_double(-12, 12));
+        rays[i] = Ray(origin, random_unit_vector());
+    }
+
+    std::vector<int> reference(count), found(count);
+    auto time = [&](auto&& nearest) {
+        double best = 0;
+        for (int r = 0; r < settings.repeats; r++) {
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < count; i++)
+                found[i] = nearest(rays[i]);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (r == 0 || seconds < best)
+                best = seconds;
+        }
+        return best;
+    };
+
+    std::vector<SoARun> runs;
+    SoARun loop;
+    loop.kernel = "virtual";
+    loop.seconds = time([&](const Ray& r) {
+        HitRecord hit;
+        Interval ray_t(0.001, infinity);
+        int nearest = -1;
+        for (int s = 0; s < soa_sphere_count; s++) {
+            if (objects[s]->RayHit(r, hit, ray_t)) {
+                ray_t.max = hit.t;
+                nearest = s;
+            }
+        }
+        return nearest;
+    });
+    reference = found;
+    runs.push_back(loop);
+
+    SimdLevel saved = simd_level();
+    for (SimdLevel level : { SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::AVX }) {
+        if (level > DetectSimdLevel())
+            break;
+        simd_level() = level;
+        SoARun run;
+        run.kernel = SimdLevelName(level);
+        run.seconds = time([&](const Ray& r) {
+            real t;
+            return soa.Intersect(r, Interval(0.001, infinity), 0, soa.size(), t);
+        });
+        run.same_hits = found == reference;
+        if (!run.same_hits)
+            std::clog << "Warning: SphereSoA " << run.kernel << " found other nearest spheres than Sphere::RayHit" << std::endl;
+        runs.push_back(run);
+    }
+    simd_level() = saved;
+
+    double tests = double(count) * soa_sphere_count;
+    for (const SoARun& run : runs) {
+        std::clog << "Flat sphere list, " << run.kernel << ": " << std::fixed << std::setprecision(1)
+            << (run.seconds > 0 ? tests / run.seconds / 1e6 : 0) << " M ray-sphere tests/s ("
+            << std::setprecision(2) << (run.seconds > 0 ? runs[0].seconds / run.seconds : 0) << "x)" << std::endl;
+    }
+    return runs;
+}
+
+int main(int argc, char** argv) {
+    BenchSettings settings;
+    if (!ParseArgs(argc, argv, settings)) {
+        PrintUsage();
+        return 1;
+    }
+    for (const std::string& name : settings.scenes) {
+        if (!FindScene(name)) {
+            std::cerr << "Unknown scene " << name << std::endl;
+            return 1;
+        }
+    }
+
+    double compact_ns = 0, virtual_ns = 0;
+    if (settings.shading_hits > 0)
+        BenchShading(settings, compact_ns, virtual_ns);
+    std::vector<WarpTimings> warps;
+    if (settings.warp_samples > 0)
+        warps = BenchWarps(settings);
+    std::vector<SoARun> soa_runs;
+    if (settings.soa_rays > 0)
+        soa_runs = BenchSoASpheres(settings);
+    std::vector<PngRun> pngs;
+    bool png_ok = true;
+    if (settings.png_check)
+        pngs = BenchPng(settings, png_ok);
+
+    std::ostringstream json;
+    json << std::setprecision(6);
+    json << "{\n"
+        << "  \"schema_version\": 1,\n"
+        << "  \"build\": { \"type\": \"" << RT_BUILD_TYPE << "\", \"compiler\": \""
+#if defined(__clang__)
+        << "clang " << __clang_major__ << "." << __clang_minor__ << "." << __clang_patchlevel__
+#elif defined(__GNUC__)
+        << "gcc " << __GNUC__ << "." << __GNUC_MINOR__ << "." << __GNUC_PATCHLEVEL__
+#elif defined(_MSC_VER)
+        << "msvc " << _MSC_VER
+#else
+        << "unknown"
+#endif
+        << "\", \"simd\": \"" << SimdLevelName(simd_level())
+        << "\", \"precision\": \"" << (sizeof(real) == sizeof(float) ? "float" : "double") << "\" },\n"
+        << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n"
+        << "  \"settings\": { \"width\": " << settings.width << ", \"height\": " << settings.height
+        << ", \"samples_per_pixel\": " << settings.samples_per_pixel
+        << ", \"max_bounces\": " << settings.max_bounces
+        << ", \"repeats\": " << settings.repeats << ", \"seed\": " << settings.seed
+        << ", \"adaptive_threshold\": " << settings.adaptive_threshold
+        << ", \"packet_size\": " << settings.packet_size
+        << ", \"bvh_width\": " << settings.bvh_width << " },\n"
+        << "  \"shading\": { \"hits\": " << settings.shading_hits << ", \"compact_ns_per_hit\": " << compact_ns
+        << ", \"virtual_ns_per_hit\": " << virtual_ns << " },\n"
+        << "  \"warps\": { \"samples\": " << settings.warp_samples << ", \"ns_per_sample\": [";
+    for (size_t w = 0; w < warps.size(); w++) {
+        const WarpTimings& t = warps[w];
+        json << (w > 0 ? "," : "") << "\n    { \"name\": \"" << t.name << "\", \"rejection\": " << t.rejection_ns;
+        if (t.trig_ns > 0)
+            json << ", \"sin_cos\": " << t.trig_ns;
+        json << ", \"scalar\": " << t.scalar_ns << ", \"batched\": " << t.batched_ns << " }";
+    }
+    json << (warps.empty() ? "" : "\n  ") << "] },\n"
+        << "  \"soa_spheres\": { \"spheres\": " << soa_sphere_count << ", \"rays\": " << settings.soa_rays
+        << ", \"kernels\": [";
+    for (size_t k = 0; k < soa_runs.size(); k++) {
+        const SoARun& run = soa_runs[k];
+        double tests = double(settings.soa_rays) * soa_sphere_count;
+        json << (k > 0 ? "," : "") << "\n    { \"kernel\": \"" << run.kernel << "\", \"seconds\": " << run.seconds
+            << ", \"tests_per_second\": " << (run.seconds > 0 ? tests / run.seconds : 0)
+            << ", \"speedup\": " << (run.seconds > 0 ? soa_runs[0].seconds / run.seconds : 0)
+            << ", \"same_hits\": " << (run.same_hits ? "true" : "false") << " }";
+    }
+    json << (soa_runs.empty() ? "" : "\n  ") << "] },\n"
+        << "  \"png\": [";
+    for (size_t p = 0; p < pngs.size(); p++) {
+        const PngRun& run = pngs[p];
+        json << (p > 0 ? "," : "") << "\n    { \"image\": \"" << run.name << "\", \"width\": " << run.width
+            << ", \"height\": " << run.height << ", \"threads\": " << run.threads << ", \"bytes\": " << run.bytes
+            << ", \"seconds\": " << run.seconds << ", \"round_trip\": \"" << run.round_trip << "\" }";
+    }
+    json << (pngs.empty() ? "" : "\n  ") << "],\n"
+        << "  \"scenes\": [\n";
+
+    for (size_t s = 0; s < settings.scenes.size(); s++) {
+        const BenchScene& bench_scene = *FindScene(settings.scenes[s]);
+
+        Scene scene;
+        scene.canvas_width = settings.width;
+        scene.canvas_height = settings.height;
+        scene.samples_per_pixel = settings.samples_per_pixel;
+        scene.max_bouces = settings.max_bounces;
+        scene.seed = settings.seed;
+        scene.show_progress = false;
+        scene.adaptive_sampling = settings.adaptive_threshold > 0;
+        scene.adaptive_threshold = settings.adaptive_threshold;
+        scene.packet_size = settings.packet_size;
+        bench_scene.build(scene);
+        scene.Init();
+
+        // Every BVH width, by its build, camera rays alone and a render on the first thread
+        // count with the per-path integrator
+        std::vector<WidthRun> width_runs;
+        scene.thread_count = settings.thread_counts[0];
+        for (int width : bvh_widths) {
+            WidthRun run = { width, 0, 0, 0, 0, 0, RenderStats() };
+            scene.bvh_width = width;
+            auto width_start = std::chrono::steady_clock::now();
+            scene.BuildBVH();
+            run.build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - width_start).count();
+            scene.BuildLightList();
+            run.nodes = scene.bvh_node_count();
+            run.bytes = scene.bvh_memory_usage();
+            for (int r = 0; r < settings.repeats; r++) {
+                auto start = std::chrono::steady_clock::now();
+                run.camera_hits = scene.TraceCameraRays(0);
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (r == 0 || seconds < run.camera_seconds)
+                    run.camera_seconds = seconds;
+                scene.Render();
+                const RenderStats& stats = scene.get_render_stats();
+                if (r == 0 || stats.seconds < run.stats.seconds)
+                    run.stats = stats;
+            }
+            // Every width must find the same closest hits.
+            if (!width_runs.empty() && (run.camera_hits != width_runs[0].camera_hits || run.stats.rays != width_runs[0].stats.rays)) {
+                std::clog << "Warning: " << bench_scene.name << " with BVH width " << width << " hit " << run.camera_hits
+                    << " camera rays and traced " << run.stats.rays << " rays, but " << width_runs[0].camera_hits
+                    << " and " << width_runs[0].stats.rays << " with width " << width_runs[0].width << std::endl;
+            }
+            double pixels = double(settings.width) * settings.height;
+            std::clog << bench_scene.name << ", BVH width " << width << ": " << std::fixed << std::setprecision(3)
+                << run.build_seconds << " s build, " << (run.camera_seconds > 0 ? pixels / run.camera_seconds / 1e6 : 0)
+                << " Mrays/s camera, " << run.stats.rays_per_second() / 1e6 << " Mrays/s rendering" << std::endl;
+            width_runs.push_back(run);
+        }
+
+        scene.bvh_width = settings.bvh_width;
+        auto build_start = std::chrono::steady_clock::now();
+        scene.BuildBVH();
+        scene.BuildLightList();
+        double build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - build_start).count();
+
+        // Camera rays alone, one per pixel on one thread, traced singly and in packets
+        std::vector<PrimaryRun> primary_runs;
+        for (int packet_size : primary_packet_sizes) {
+            PrimaryRun run = { packet_size, 0, 0 };
+            for (int r = 0; r < settings.repeats; r++) {
+                auto start = std::chrono::steady_clock::now();
+                run.hits = scene.TraceCameraRays(packet_size);
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (r == 0 || seconds < run.seconds)
+                    run.seconds = seconds;
+            }
+            // Packets must find exactly the hits the single rays do.
+            if (!primary_runs.empty() && run.hits != primary_runs[0].hits) {
+                std::clog << "Warning: " << bench_scene.name << " camera rays hit " << run.hits << " times in packets of "
+                    << packet_size << " but " << primary_runs[0].hits << " times alone" << std::endl;
+            }
+            double pixels = double(settings.width) * settings.height;
+            std::clog << bench_scene.name << ", camera rays, packets of " << packet_size << ": " << std::fixed
+                << std::setprecision(3) << (run.seconds > 0 ? pixels / run.seconds / 1e6 : 0) << " Mrays/s" << std::endl;
+            primary_runs.push_back(run);
+        }
+
+        // Every thread count with each integrator; both trace the same rays.
+        std::vector<BenchRun> runs;
+        for (const std::string& integrator : settings.integrators) {
+            scene.wavefront = integrator == "wavefront";
+            for (unsigned int threads : settings.thread_counts) {
+                scene.thread_count = threads;
+                BenchRun run = { scene.wavefront, threads, RenderStats() };
+                for (int r = 0; r < settings.repeats; r++) {
+                    scene.Render();
+                    const RenderStats& stats = scene.get_render_stats();
+                    if (r == 0 || stats.seconds < run.stats.seconds)
+                        run.stats = stats;
+                }
+                // Pixels seed their own random streams, so the work must not depend on threads.
+                if (!runs.empty() && run.stats.rays != runs[0].stats.rays) {
+                    std::clog << "Warning: " << bench_scene.name << " traced " << run.stats.rays << " rays with "
+                        << integrator << " on " << threads << " threads but " << runs[0].stats.rays << " with "
+                        << settings.integrators[0] << " on " << runs[0].threads << std::endl;
+                }
+                std::clog << bench_scene.name << ", " << integrator << ", " << threads << " threads: " << std::fixed
+                    << std::setprecision(3) << run.stats.seconds << " s, " << run.stats.rays_per_second() / 1e6
+                    << " Mrays/s" << std::endl;
+                runs.push_back(run);
+            }
+        }
+
+        const RenderStats& base = runs[0].stats;
+        json << "    {\n"
+            << "      \"name\": \"" << bench_scene.name << "\",\n"
+            << "      \"objects\": " << scene.object_count() << ",\n"
+            << "      \"lights\": " << scene.light_count() << ",\n"
+            << "      \"build_seconds\": " << build_seconds << ",\n"
+            << "      \"paths\": " << base.paths << ",\n"
+            << "      \"rays\": " << base.rays << ",\n"
+            << "      \"shadow_rays\": " << base.shadow_rays << ",\n"
+            << "      \"average_path_length\": " << base.average_path_length() << ",\n"
+            << "      \"camera_rays\": [\n";
+        for (size_t r = 0; r < primary_runs.size(); r++) {
+            const PrimaryRun& run = primary_runs[r];
+            double pixels = double(settings.width) * settings.height;
+            json << "        { \"packet_size\": " << run.packet_size << ", \"seconds\": " << run.seconds
+                << ", \"rays_per_second\": " << (run.seconds > 0 ? pixels / run.seconds : 0)
+                << ", \"hits\": " << run.hits << " }" << (r + 1 < primary_runs.size() ? "," : "") << "\n";
+        }
+        json << "      ],\n"
+            << "      \"bvh_widths\": [\n";
+        for (size_t r = 0; r < width_runs.size(); r++) {
+            const WidthRun& run = width_runs[r];
+            double pixels = double(settings.width) * settings.height;
+            json << "        { \"width\": " << run.width << ", \"build_seconds\": " << run.build_seconds
+                << ", \"nodes\": " << run.nodes << ", \"bytes\": " << run.bytes
+                << ", \"camera_rays_per_second\": " << (run.camera_seconds > 0 ? pixels / run.camera_seconds : 0)
+                << ", \"threads\": " << settings.thread_counts[0]
+                << ", \"seconds\": " << run.stats.seconds
+                << ", \"rays_per_second\": " << run.stats.rays_per_second()
+                << ", \"speedup\": " << (run.stats.seconds > 0 ? width_runs[0].stats.seconds / run.stats.seconds : 0)
+                << " }" << (r + 1 < width_runs.size() ? "," : "") << "\n";
+        }
+        json << "      ],\n"
+            << "      \"runs\": [\n";
+        for (size_t r = 0; r < runs.size(); r++) {
+            const RenderStats& stats = runs[r].stats;
+            double seconds = stats.seconds;
+            // Speedup over the first thread count of the same integrator
+            const RenderStats& first = runs[r - r % settings.thread_counts.size()].stats;
+            json << "        { \"integrator\": \"" << (runs[r].wavefront ? "wavefront" : "megakernel")
+                << "\", \"threads\": " << runs[r].threads
+                << ", \"seconds\": " << seconds
+                << ", \"seconds_per_sample_pass\": " << seconds / settings.samples_per_pixel
+                << ", \"primary_rays_per_second\": " << (seconds > 0 ? stats.paths / seconds : 0)
+                << ", \"rays_per_second\": " << stats.rays_per_second()
+                << ", \"speedup\": " << (seconds > 0 ? first.seconds / seconds : 0)
+                << " }" << (r + 1 < runs.size() ? "," : "") << "\n";
+        }
+        json << "      ]\n"
+            << "    }" << (s + 1 < settings.scenes.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n}\n";
+
+    if (settings.output_path.empty()) {
+        std::cout << json.str();
+    }
+    else {
+        std::ofstream file(settings.output_path);
+        if (!file || !(file << json.str())) {
+            std::cerr << "Failed to write " << settings.output_path << std::endl;
+            return 1;
+        }
+        std::clog << "Saved " << settings.output_path << std::endl;
+    }
+    // A PNG that does not decode to its pixels fails the run, so CI can rely on the exit code.
+    return png_ok ? 0 : 1;
+}
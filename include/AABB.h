@@ -0,0 +1,84 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include <utility>
+
+#include "Vec3.h"
+#include "Ray.h"
+#include "Interval.h"
+#include "Utils.h"
+
+class AABB {
+public:
+    Point3 min;
+    Point3 max;
+
+    // The default box is empty, so expanding it by anything yields that thing.
+    AABB() : min(infinity, infinity, infinity), max(-infinity, -infinity, -infinity) {}
+    AABB(const Point3& a, const Point3& b)
+        : min(std::fmin(a.x(), b.x()), std::fmin(a.y(), b.y()), std::fmin(a.z(), b.z())),
+          max(std::fmax(a.x(), b.x()), std::fmax(a.y(), b.y()), std::fmax(a.z(), b.z())) {}
+
+    bool empty() const {
+        return min.x() > max.x() || min.y() > max.y() || min.z() > max.z();
+    }
+
+    void expand(const Point3& p) {
+        for (int axis = 0; axis < 3; axis++) {
+            min[axis] = std::fmin(min[axis], p[axis]);
+            max[axis] = std::fmax(max[axis], p[axis]);
+        }
+    }
+
+    void expand(const AABB& box) {
+        for (int axis = 0; axis < 3; axis++) {
+            min[axis] = std::fmin(min[axis], box.min[axis]);
+            max[axis] = std::fmax(max[axis], box.max[axis]);
+        }
+    }
+
+    Point3 centroid() const {
+        return 0.5 * (min + max);
+    }
+
+    Vec3 extent() const {
+        return max - min;
+    }
+
+    double surface_area() const {
+        if (empty()) return 0;
+        Vec3 d = extent();
+        return 2 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+    }
+
+    int longest_axis() const {
+        Vec3 d = extent();
+        if (d.x() > d.y() && d.x() > d.z()) return 0;
+        return d.y() > d.z() ? 1 : 2;
+    }
+
+    // Slab test. inv_dir is 1 / r.direction(), computed once per ray by the caller.
+    // On a hit, ray_t is narrowed to the overlap of the ray and the box.
+    bool RayHit(const Point3& origin, const Vec3& inv_dir, Interval& ray_t) const {
+        for (int axis = 0; axis < 3; axis++) {
+            real t0 = (min[axis] - origin[axis]) * inv_dir[axis];
+            real t1 = (max[axis] - origin[axis]) * inv_dir[axis];
+            if (inv_dir[axis] < 0.0) std::swap(t0, t1);
+
+            // Written so that a NaN (0 * inf on a slab boundary) keeps the old bound.
+            ray_t.min = t0 > ray_t.min ? t0 : ray_t.min;
+            ray_t.max = t1 < ray_t.max ? t1 : ray_t.max;
+            if (ray_t.max < ray_t.min)
+                return false;
+        }
+        return true;
+    }
+};
+
+inline AABB surrounding_box(const AABB& a, const AABB& b) {
+    AABB box = a;
+    box.expand(b);
+    return box;
+}
+
+#endif
\ No newline at end of file
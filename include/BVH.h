@@ -0,0 +1,726 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <iostream>
+
+#include "AABB.h"
+#include "Ray.h"
+#include "Interval.h"
+#include "RayPacket.h"
+#include "Simd.h"
+
+class BVHNode {
+public:
+    AABB bounds;
+    // Interior node: index of the second child, the first child is always the next node.
+    // Leaf node: position of the first primitive in primitive_order().
+    int offset = 0;
+    // Number of primitives in a leaf, 0 for interior nodes.
+    int count = 0;
+    // Split axis of an interior node, used to visit the nearer child first.
+    int axis = 0;
+
+    bool is_leaf() const { return count > 0; }
+};
+
+// A node of the wide form of the tree, with up to N children. The child boxes are stored
+// one array per bound and axis, so a ray is tested against several of them per
+// instruction. Slots past the last child keep an empty box, which no ray hits.
+template <int N>
+class WideBVHNode {
+public:
+    alignas(32) real min[3][N];
+    alignas(32) real max[3][N];
+    // Interior child: index of its node. Leaf child: position of its first primitive in
+    // primitive_order().
+    int child[N];
+    // Number of primitives in a leaf child, 0 for interior children.
+    int count[N];
+
+    WideBVHNode() {
+        for (int axis = 0; axis < 3; axis++) {
+            for (int i = 0; i < N; i++) {
+                min[axis][i] = std::numeric_limits<real>::infinity();
+                max[axis][i] = -std::numeric_limits<real>::infinity();
+            }
+        }
+        for (int i = 0; i < N; i++) {
+            child[i] = 0;
+            count[i] = 0;
+        }
+    }
+};
+
+namespace bvh_detail {
+    // A ray as the wide node tests take it. dir_is_neg[axis] is set where the ray points
+    // down the axis and so meets a box's max plane first.
+    class WideRay {
+    public:
+        real origin[3];
+        real inv_dir[3];
+        bool dir_is_neg[3];
+    };
+
+    // Bit i set for every child i the ray hits within [t_min, t_max], and near_t[i] the
+    // distance at which it enters that child's box. The slab test of AABB::RayHit, with the
+    // maximum and minimum taken in the operand order that keeps the old bound on a NaN.
+    template <int N>
+    uint32_t child_hits_scalar(const WideBVHNode<N>& node, const WideRay& ray, real t_min, real t_max, real* near_t) {
+        uint32_t mask = 0;
+        for (int i = 0; i < N; i++) {
+            real near_i = t_min;
+            real far_i = t_max;
+            for (int axis = 0; axis < 3; axis++) {
+                const real* near_plane = ray.dir_is_neg[axis] ? node.max[axis] : node.min[axis];
+                const real* far_plane = ray.dir_is_neg[axis] ? node.min[axis] : node.max[axis];
+                real t0 = (near_plane[i] - ray.origin[axis]) * ray.inv_dir[axis];
+                real t1 = (far_plane[i] - ray.origin[axis]) * ray.inv_dir[axis];
+                near_i = t0 > near_i ? t0 : near_i;
+                far_i = t1 < far_i ? t1 : far_i;
+            }
+            near_t[i] = near_i;
+            if (!(far_i < near_i))
+                mask |= uint32_t(1) << i;
+        }
+        return mask;
+    }
+
+#if RT_SIMD_X86
+#ifndef RT_SINGLE_PRECISION
+    template <int N>
+    uint32_t child_hits_sse2(const WideBVHNode<N>& node, const WideRay& ray, real t_min, real t_max, real* near_t) {
+        uint32_t mask = 0;
+        for (int k = 0; k < N; k += 2) {
+            __m128d near_k = _mm_set1_pd(t_min);
+            __m128d far_k = _mm_set1_pd(t_max);
+            for (int axis = 0; axis < 3; axis++) {
+                const real* near_plane = ray.dir_is_neg[axis] ? node.max[axis] : node.min[axis];
+                const real* far_plane = ray.dir_is_neg[axis] ? node.min[axis] : node.max[axis];
+                __m128d o = _mm_set1_pd(ray.origin[axis]);
+                __m128d inv = _mm_set1_pd(ray.inv_dir[axis]);
+                __m128d t0 = _mm_mul_pd(_mm_sub_pd(_mm_load_pd(near_plane + k), o), inv);
+                __m128d t1 = _mm_mul_pd(_mm_sub_pd(_mm_load_pd(far_plane + k), o), inv);
+                near_k = _mm_max_pd(t0, near_k);
+                far_k = _mm_min_pd(t1, far_k);
+            }
+            _mm_store_pd(near_t + k, near_k);
+            mask |= uint32_t(_mm_movemask_pd(_mm_cmpge_pd(far_k, near_k))) << k;
+        }
+        return mask;
+    }
+
+    template <int N>
+    RT_TARGET_AVX uint32_t child_hits_avx(const WideBVHNode<N>& node, const WideRay& ray, real t_min, real t_max, real* near_t) {
+        uint32_t mask = 0;
+        for (int k = 0; k < N; k += 4) {
+            __m256d near_k = _mm256_set1_pd(t_min);
+            __m256d far_k = _mm256_set1_pd(t_max);
+            for (int axis = 0; axis < 3; axis++) {
+                const real* near_plane = ray.dir_is_neg[axis] ? node.max[axis] : node.min[axis];
+                const real* far_plane = ray.dir_is_neg[axis] ? node.min[axis] : node.max[axis];
+                __m256d o = _mm256_set1_pd(ray.origin[axis]);
+                __m256d inv = _mm256_set1_pd(ray.inv_dir[axis]);
+                __m256d t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(near_plane + k), o), inv);
+                __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_load_pd(far_plane + k), o), inv);
+                near_k = _mm256_max_pd(t0, near_k);
+                far_k = _mm256_min_pd(t1, far_k);
+            }
+            _mm256_store_pd(near_t + k, near_k);
+            mask |= uint32_t(_mm256_movemask_pd(_mm256_cmp_pd(far_k, near_k, _CMP_GE_OQ))) << k;
+        }
+        return mask;
+    }
+
+    constexpr int avx_lanes = 4;
+#else
+    template <int N>
+    uint32_t child_hits_sse2(const WideBVHNode<N>& node, const WideRay& ray, real t_min, real t_max, real* near_t) {
+        uint32_t mask = 0;
+        for (int k = 0; k < N; k += 4) {
+            __m128 near_k = _mm_set1_ps(t_min);
+            __m128 far_k = _mm_set1_ps(t_max);
+            for (int axis = 0; axis < 3; axis++) {
+                const real* near_plane = ray.dir_is_neg[axis] ? node.max[axis] : node.min[axis];
+                const real* far_plane = ray.dir_is_neg[axis] ? node.min[axis] : node.max[axis];
+                __m128 o = _mm_set1_ps(ray.origin[axis]);
+                __m128 inv = _mm_set1_ps(ray.inv_dir[axis]);
+                __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near_plane + k), o), inv);
+                __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far_plane + k), o), inv);
+                near_k = _mm_max_ps(t0, near_k);
+                far_k = _mm_min_ps(t1, far_k);
+            }
+            _mm_store_ps(near_t + k, near_k);
+            mask |= uint32_t(_mm_movemask_ps(_mm_cmpge_ps(far_k, near_k))) << k;
+        }
+        return mask;
+    }
+
+    template <int N>
+    RT_TARGET_AVX uint32_t child_hits_avx(const WideBVHNode<N>& node, const WideRay& ray, real t_min, real t_max, real* near_t) {
+        uint32_t mask = 0;
+        for (int k = 0; k < N; k += 8) {
+            __m256 near_k = _mm256_set1_ps(t_min);
+            __m256 far_k = _mm256_set1_ps(t_max);
+            for (int axis = 0; axis < 3; axis++) {
+                const real* near_plane = ray.dir_is_neg[axis] ? node.max[axis] : node.min[axis];
+                const real* far_plane = ray.dir_is_neg[axis] ? node.min[axis] : node.max[axis];
+                __m256 o = _mm256_set1_ps(ray.origin[axis]);
+                __m256 inv = _mm256_set1_ps(ray.inv_dir[axis]);
+                __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_plane + k), o), inv);
+                __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_plane + k), o), inv);
+                near_k = _mm256_max_ps(t0, near_k);
+                far_k = _mm256_min_ps(t1, far_k);
+            }
+            _mm256_store_ps(near_t + k, near_k);
+            mask |= uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(far_k, near_k, _CMP_GE_OQ))) << k;
+        }
+        return mask;
+    }
+
+    constexpr int avx_lanes = 8;
+#endif
+#endif
+
+    template <int N>
+    uint32_t child_hits(const WideBVHNode<N>& node, const WideRay& ray, real t_min, real t_max, real* near_t) {
+        switch (simd_level()) {
+#if RT_SIMD_X86
+        case SimdLevel::AVX:
+            // A node narrower than an AVX register takes the SSE2 kernel.
+            if constexpr (N % avx_lanes == 0)
+                return child_hits_avx(node, ray, t_min, t_max, near_t);
+            else
+                return child_hits_sse2(node, ray, t_min, t_max, near_t);
+        case SimdLevel::SSE2:
+            return child_hits_sse2(node, ray, t_min, t_max, near_t);
+#endif
+        default:
+            return child_hits_scalar(node, ray, t_min, t_max, near_t);
+        }
+    }
+}
+
+// Bounding volume hierarchy over an arbitrary list of primitive bounds.
+// The tree is built with a binned surface area heuristic and stored depth-first
+// in a flat node array. Leaves reference contiguous ranges of primitive_order(),
+// so the owner is expected to reorder its primitives to match after Build.
+//
+// With width 4 or 8, Build then collapses the binary tree into one whose nodes have up to
+// that many children and drops the binary nodes. Every traversal walks the wide tree: a
+// node visit tests all its child boxes at once and goes on into the children by
+// increasing entry distance.
+class BVH {
+public:
+    int max_leaf_size = 4;
+    double traversal_cost = 1.0;  // Relative to the cost of one primitive intersection
+    int leaf_batch_size = 1;      // Primitives the owner intersects for the cost of one (SIMD width)
+    int width = 2;                // Children per node: 2, or 4 or 8 for the wide form; nothing else
+
+    static constexpr int bin_count = 16;
+    static constexpr int max_depth = 64;
+
+    // Fails, leaving the tree empty, unless width is 2, 4 or 8; the wide node kernels
+    // exist for those alone.
+    bool Build(const std::vector<AABB>& prim_bounds) {
+        // Assigned rather than cleared, so a rebuild at another width frees the old form.
+        nodes.clear();
+        wide4 = std::vector<WideBVHNode<4>>();
+        wide8 = std::vector<WideBVHNode<8>>();
+        prim_order.clear();
+        root_bounds = AABB();
+        if (width != 2 && width != 4 && width != 8) {
+            std::cerr << "BVH width must be 2, 4 or 8, not " << width << std::endl;
+            return false;
+        }
+        if (prim_bounds.empty())
+            return true;
+
+        std::vector<BuildPrim> prims(prim_bounds.size());
+        for (size_t i = 0; i < prim_bounds.size(); i++) {
+            prims[i].bounds = prim_bounds[i];
+            prims[i].centroid = prim_bounds[i].centroid();
+            prims[i].index = int(i);
+        }
+
+        nodes.reserve(2 * prims.size());
+        buildRecursive(prims, 0, int(prims.size()), 0);
+
+        prim_order.resize(prims.size());
+        for (size_t i = 0; i < prims.size(); i++)
+            prim_order[i] = prims[i].index;
+
+        // The reservation above is for the worst case; give the rest back.
+        prims = std::vector<BuildPrim>();
+        nodes.shrink_to_fit();
+        root_bounds = nodes[0].bounds;
+
+        // Nothing reads the binary nodes once the wide ones exist.
+        if (width == 4) {
+            collapse(wide4, 0);
+            wide4.shrink_to_fit();
+            nodes = std::vector<BVHNode>();
+        }
+        else if (width == 8) {
+            collapse(wide8, 0);
+            wide8.shrink_to_fit();
+            nodes = std::vector<BVHNode>();
+        }
+        return true;
+    }
+
+    bool empty() const {
+        return prim_order.empty();
+    }
+
+    AABB bounds() const {
+        return root_bounds;
+    }
+
+    // primitive_order()[i] is the index, in the list given to Build, of the i-th leaf primitive.
+    const std::vector<int>& primitive_order() const {
+        return prim_order;
+    }
+
+    // The binary nodes; empty once Build has collapsed them into wide ones.
+    const std::vector<BVHNode>& get_nodes() const {
+        return nodes;
+    }
+
+    // Nodes of the tree Traverse walks: the wide one if there is one.
+    size_t node_count() const {
+        return !wide4.empty() ? wide4.size() : !wide8.empty() ? wide8.size() : nodes.size();
+    }
+
+    // Bytes held by the nodes and the primitive order.
+    size_t memory_usage() const {
+        return nodes.capacity() * sizeof(BVHNode) + wide4.capacity() * sizeof(WideBVHNode<4>)
+            + wide8.capacity() * sizeof(WideBVHNode<8>) + prim_order.capacity() * sizeof(int);
+    }
+
+    // Closest-hit traversal. hit_primitive(i, ray_t) is called with the position i of a
+    // leaf primitive and must return true on a hit, shrinking ray_t.max to the hit distance
+    // so the remaining nodes are pruned against it.
+    template <typename PrimitiveHit>
+    bool Traverse(const Ray& r, Interval ray_t, PrimitiveHit&& hit_primitive) const {
+        return TraverseLeaves(r, ray_t, [&](int first, int count, Interval& t) {
+            bool hit = false;
+            for (int i = first; i < first + count; i++) {
+                if (hit_primitive(i, t))
+                    hit = true;
+            }
+            return hit;
+            });
+    }
+
+    // Same as Traverse, but hands whole leaves to hit_leaf(first, count, ray_t), for
+    // owners that intersect several primitives at once.
+    template <typename LeafHit>
+    bool TraverseLeaves(const Ray& r, Interval ray_t, LeafHit&& hit_leaf) const {
+        if (!wide4.empty())
+            return traverseWide(wide4, r, ray_t, hit_leaf);
+        if (!wide8.empty())
+            return traverseWide(wide8, r, ray_t, hit_leaf);
+        if (nodes.empty())
+            return false;
+
+        const Point3& origin = r.origin();
+        const Vec3& dir = r.direction();
+        Vec3 inv_dir(1.0 / dir.x(), 1.0 / dir.y(), 1.0 / dir.z());
+        bool dir_is_neg[3] = { inv_dir.x() < 0, inv_dir.y() < 0, inv_dir.z() < 0 };
+
+        int stack[max_depth];
+        int stack_size = 0;
+        int current = 0;
+        bool hit_anything = false;
+
+        while (true) {
+            const BVHNode& node = nodes[current];
+            Interval box_t = ray_t;
+            if (node.bounds.RayHit(origin, inv_dir, box_t)) {
+                if (node.is_leaf()) {
+                    if (hit_leaf(node.offset, node.count, ray_t))
+                        hit_anything = true;
+                    if (stack_size == 0) break;
+                    current = stack[--stack_size];
+                }
+                else if (dir_is_neg[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                }
+                else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+            }
+            else {
+                if (stack_size == 0) break;
+                current = stack[--stack_size];
+            }
+        }
+        return hit_anything;
+    }
+
+    // Closest-hit traversal of a finished, single-octant packet: each node is visited once
+    // for all rays that hit it. A node the packet's bounds miss as a whole is skipped
+    // without looking at its rays; otherwise rays before the first one that hits the box
+    // are left out of the subtree. hit_leaf(lane, first, count, ray_t) is called for every
+    // ray that reaches a leaf and, as in TraverseLeaves, shrinks ray_t.max on a hit, which
+    // is kept in packet.t_max. On the binary tree each ray meets its leaves in the order
+    // TraverseLeaves would give it; on either tree it ends up with its closest hit.
+    template <typename LeafHit>
+    void TraversePacket(RayPacket& packet, real t_min, LeafHit&& hit_leaf) const {
+        if (packet.size == 0)
+            return;
+        if (!wide4.empty()) {
+            traversePacketWide(wide4, packet, t_min, hit_leaf);
+            return;
+        }
+        if (!wide8.empty()) {
+            traversePacketWide(wide8, packet, t_min, hit_leaf);
+            return;
+        }
+        if (nodes.empty())
+            return;
+
+        int stack[max_depth];
+        int stack_first[max_depth];
+        int stack_size = 0;
+        int current = 0;
+        int first = 0;      // Lowest ray that may still hit something in this subtree
+
+        while (true) {
+            const BVHNode& node = nodes[current];
+            uint32_t mask = packet.CanMiss(node.bounds, t_min) ? 0 : packet.HitMask(node.bounds, t_min, first);
+            if (mask != 0) {
+                first = lowest_set_bit(mask);
+                if (node.is_leaf()) {
+                    for (; mask != 0; mask &= mask - 1) {
+                        int lane = lowest_set_bit(mask);
+                        Interval ray_t(t_min, packet.t_max[lane]);
+                        hit_leaf(lane, node.offset, node.count, ray_t);
+                        packet.t_max[lane] = ray_t.max;
+                    }
+                }
+                else {
+                    stack_first[stack_size] = first;
+                    if (packet.dir_is_neg[node.axis]) {
+                        stack[stack_size++] = current + 1;
+                        current = node.offset;
+                    }
+                    else {
+                        stack[stack_size++] = node.offset;
+                        current = current + 1;
+                    }
+                    continue;
+                }
+            }
+            if (stack_size == 0) break;
+            stack_size--;
+            current = stack[stack_size];
+            first = stack_first[stack_size];
+        }
+    }
+
+private:
+    class BuildPrim {
+    public:
+        AABB bounds;
+        Point3 centroid;
+        int index;
+    };
+
+    class Bin {
+    public:
+        AABB bounds;
+        int count = 0;
+    };
+
+    std::vector<BVHNode> nodes;
+    std::vector<WideBVHNode<4>> wide4;     // The wide form, if width is 4
+    std::vector<WideBVHNode<8>> wide8;     // The wide form, if width is 8
+    std::vector<int> prim_order;
+    AABB root_bounds;
+
+    // A node or leaf waiting on the traversal stack, with the distance at which the ray
+    // enters its box.
+    class WideEntry {
+    public:
+        int index;      // Node index, or first primitive of a leaf
+        int count;      // Primitives of a leaf, 0 for a node
+        real t;
+    };
+
+    template <int N, typename LeafHit>
+    bool traverseWide(const std::vector<WideBVHNode<N>>& wide, const Ray& r, Interval ray_t, LeafHit&& hit_leaf) const {
+        bvh_detail::WideRay ray;
+        for (int axis = 0; axis < 3; axis++) {
+            ray.origin[axis] = r.origin()[axis];
+            ray.inv_dir[axis] = real(1.0 / r.direction()[axis]);
+            ray.dir_is_neg[axis] = ray.inv_dir[axis] < 0;
+        }
+
+        // Each node visit takes one entry and adds at most N, once per level.
+        WideEntry stack[max_depth * N];
+        int stack_size = 0;
+        stack[stack_size++] = { 0, 0, ray_t.min };
+        alignas(32) real near_t[N];
+        bool hit_anything = false;
+
+        while (stack_size > 0) {
+            WideEntry entry = stack[--stack_size];
+            // Entered past the closest hit found since it was pushed
+            if (entry.t > ray_t.max)
+                continue;
+            if (entry.count > 0) {
+                if (hit_leaf(entry.index, entry.count, ray_t))
+                    hit_anything = true;
+                continue;
+            }
+
+            const WideBVHNode<N>& node = wide[entry.index];
+            uint32_t mask = bvh_detail::child_hits(node, ray, ray_t.min, ray_t.max, near_t);
+            int first = stack_size;
+            for (; mask != 0; mask &= mask - 1) {
+                int i = lowest_set_bit(mask);
+                stack[stack_size++] = { node.child[i], node.count[i], near_t[i] };
+            }
+            // Farthest at the bottom, so the nearest child is visited next
+            for (int a = first + 1; a < stack_size; a++) {
+                WideEntry moving = stack[a];
+                int b = a;
+                for (; b > first && stack[b - 1].t < moving.t; b--)
+                    stack[b] = stack[b - 1];
+                stack[b] = moving;
+            }
+        }
+        return hit_anything;
+    }
+
+    // A node or leaf waiting on the packet traversal stack, with the rays that hit its box
+    // when it was pushed and the distance at which the lowest of them enters it.
+    class WidePacketEntry {
+    public:
+        int index;      // Node index, or first primitive of a leaf
+        int count;      // Primitives of a leaf, 0 for a node
+        uint32_t mask;
+        real t;
+    };
+
+    // As traverseWide, for the rays of a packet. The packet is tested against each child
+    // box with the same culls TraversePacket uses on the binary tree, and the children are
+    // visited in the order the lowest ray that hits them enters them.
+    template <int N, typename LeafHit>
+    void traversePacketWide(const std::vector<WideBVHNode<N>>& wide, RayPacket& packet, real t_min, LeafHit&& hit_leaf) const {
+        WidePacketEntry stack[max_depth * N];
+        int stack_size = 0;
+        stack[stack_size++] = { 0, 0, (uint32_t(1) << packet.size) - 1, t_min };
+
+        while (stack_size > 0) {
+            WidePacketEntry entry = stack[--stack_size];
+            if (entry.count > 0) {
+                for (uint32_t mask = entry.mask; mask != 0; mask &= mask - 1) {
+                    int lane = lowest_set_bit(mask);
+                    Interval ray_t(t_min, packet.t_max[lane]);
+                    hit_leaf(lane, entry.index, entry.count, ray_t);
+                    packet.t_max[lane] = ray_t.max;
+                }
+                continue;
+            }
+
+            const WideBVHNode<N>& node = wide[entry.index];
+            int first = lowest_set_bit(entry.mask);
+            int pushed = stack_size;
+            for (int i = 0; i < N; i++) {
+                if (node.min[0][i] > node.max[0][i])
+                    continue;   // Unused slot
+                AABB box;
+                for (int axis = 0; axis < 3; axis++) {
+                    box.min[axis] = node.min[axis][i];
+                    box.max[axis] = node.max[axis][i];
+                }
+                if (packet.CanMiss(box, t_min))
+                    continue;
+                uint32_t mask = packet.HitMask(box, t_min, first);
+                if (mask == 0)
+                    continue;
+                int lane = lowest_set_bit(mask);
+                real near_t = t_min;
+                for (int axis = 0; axis < 3; axis++) {
+                    real plane = packet.dir_is_neg[axis] ? box.max[axis] : box.min[axis];
+                    real t0 = (plane - packet.origin[axis][lane]) * packet.inv_dir[axis][lane];
+                    near_t = t0 > near_t ? t0 : near_t;
+                }
+                stack[stack_size++] = { node.child[i], node.count[i], mask, near_t };
+            }
+            // Farthest at the bottom, so the nearest child is visited next
+            for (int a = pushed + 1; a < stack_size; a++) {
+                WidePacketEntry moving = stack[a];
+                int b = a;
+                for (; b > pushed && stack[b - 1].t < moving.t; b--)
+                    stack[b] = stack[b - 1];
+                stack[b] = moving;
+            }
+        }
+    }
+
+    // Builds the wide node for the binary node binary_index: its children are those of the
+    // binary node, with the interior child of largest surface area replaced by its own two
+    // children until there are N or only leaves. Returns the node's index in wide.
+    template <int N>
+    int collapse(std::vector<WideBVHNode<N>>& wide, int binary_index) {
+        int children[N];
+        int child_count = 0;
+        const BVHNode& node = nodes[binary_index];
+        if (node.is_leaf()) {
+            children[child_count++] = binary_index;
+        }
+        else {
+            children[child_count++] = binary_index + 1;
+            children[child_count++] = node.offset;
+        }
+        while (child_count < N) {
+            int open = -1;
+            double open_area = -1;
+            for (int i = 0; i < child_count; i++) {
+                const BVHNode& c = nodes[children[i]];
+                if (!c.is_leaf() && c.bounds.surface_area() > open_area) {
+                    open = i;
+                    open_area = c.bounds.surface_area();
+                }
+            }
+            if (open < 0)
+                break;
+            int opened = children[open];
+            children[open] = opened + 1;
+            children[child_count++] = nodes[opened].offset;
+        }
+
+        int wide_index = int(wide.size());
+        wide.emplace_back();
+        for (int i = 0; i < child_count; i++) {
+            const BVHNode& c = nodes[children[i]];
+            int child, count;
+            if (c.is_leaf()) {
+                child = c.offset;
+                count = c.count;
+            }
+            else {
+                child = collapse(wide, children[i]);
+                count = 0;
+            }
+            // collapse may have moved the nodes, so index afresh.
+            WideBVHNode<N>& w = wide[wide_index];
+            for (int axis = 0; axis < 3; axis++) {
+                w.min[axis][i] = c.bounds.min[axis];
+                w.max[axis][i] = c.bounds.max[axis];
+            }
+            w.child[i] = child;
+            w.count[i] = count;
+        }
+        return wide_index;
+    }
+
+    int buildRecursive(std::vector<BuildPrim>& prims, int begin, int end, int depth) {
+        int node_index = int(nodes.size());
+        nodes.emplace_back();
+
+        AABB bounds, centroid_bounds;
+        for (int i = begin; i < end; i++) {
+            bounds.expand(prims[i].bounds);
+            centroid_bounds.expand(prims[i].centroid);
+        }
+        nodes[node_index].bounds = bounds;
+
+        int count = end - begin;
+        int axis = centroid_bounds.longest_axis();
+        double axis_min = centroid_bounds.min[axis];
+        double axis_extent = centroid_bounds.max[axis] - axis_min;
+
+        // All centroids coincide (or we ran out of stack depth): nothing left to split on.
+        if (count == 1 || axis_extent <= 0 || depth >= max_depth - 1)
+            return makeLeaf(node_index, begin, count);
+
+        auto bin_of = [&](const BuildPrim& prim) {
+            int b = int(bin_count * ((prim.centroid[axis] - axis_min) / axis_extent));
+            return std::clamp(b, 0, bin_count - 1);
+        };
+
+        Bin bins[bin_count];
+        for (int i = begin; i < end; i++) {
+            Bin& bin = bins[bin_of(prims[i])];
+            bin.count++;
+            bin.bounds.expand(prims[i].bounds);
+        }
+
+        // Sweep from the right to get the area and count of every right-hand side,
+        // then from the left to evaluate the SAH cost of splitting after each bin.
+        double right_area[bin_count - 1];
+        int right_count[bin_count - 1];
+        AABB right_box;
+        int right_sum = 0;
+        for (int b = bin_count - 1; b > 0; b--) {
+            right_box.expand(bins[b].bounds);
+            right_sum += bins[b].count;
+            right_area[b - 1] = right_box.surface_area();
+            right_count[b - 1] = right_sum;
+        }
+
+        int best_split = -1;
+        double best_cost = infinity;
+        AABB left_box;
+        int left_sum = 0;
+        for (int b = 0; b < bin_count - 1; b++) {
+            left_box.expand(bins[b].bounds);
+            left_sum += bins[b].count;
+            if (left_sum == 0 || right_count[b] == 0)
+                continue;
+            double cost = batches(left_sum) * left_box.surface_area() + batches(right_count[b]) * right_area[b];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_split = b;
+            }
+        }
+
+        double parent_area = bounds.surface_area();
+        best_cost = traversal_cost + (parent_area > 0 ? best_cost / parent_area : 0);
+        double leaf_cost = batches(count);
+
+        if (count <= max_leaf_size && leaf_cost <= best_cost)
+            return makeLeaf(node_index, begin, count);
+
+        int mid;
+        if (best_split >= 0) {
+            auto split = std::partition(prims.begin() + begin, prims.begin() + end,
+                [&](const BuildPrim& prim) { return bin_of(prim) <= best_split; });
+            mid = int(split - prims.begin());
+        }
+        else {
+            mid = begin + count / 2;
+            std::nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end,
+                [axis](const BuildPrim& a, const BuildPrim& b) { return a.centroid[axis] < b.centroid[axis]; });
+        }
+
+        buildRecursive(prims, begin, mid, depth + 1);
+        int second_child = buildRecursive(prims, mid, end, depth + 1);
+
+        nodes[node_index].offset = second_child;
+        nodes[node_index].count = 0;
+        nodes[node_index].axis = axis;
+        return node_index;
+    }
+
+    double batches(int count) const {
+        return double((count + leaf_batch_size - 1) / leaf_batch_size);
+    }
+
+    int makeLeaf(int node_index, int begin, int count) {
+        nodes[node_index].offset = begin;
+        nodes[node_index].count = count;
+        return node_index;
+    }
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,182 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <algorithm>
+
+namespace fs = std::filesystem;
+
+// Everything needed to continue an unfinished render: the per-pixel sums, the sample count
+// each pixel is to reach in the current pass, and the counters. No generator state is
+// stored, because a pixel's random stream is fully determined by the seed, the pixel and
+// its sample count.
+//
+// File layout (native byte order, checked on load):
+//   header   magic, byte order mark, version, width, height, pass, settings fingerprint,
+//            paths, rays, shadow rays, passes, seconds
+//   pixels   width * height records of 12 doubles (colour, albedo, normal, depth and the
+//            two luminance moments) followed by the sample count and pass target
+class RenderCheckpoint {
+public:
+    static constexpr uint32_t version = 1;
+
+    int width = 0;
+    int height = 0;
+    int pass = 0;                   // Pass that was being rendered
+    uint64_t fingerprint = 0;       // Of the settings that decide which samples are taken
+    uint64_t paths = 0;
+    uint64_t rays = 0;
+    uint64_t shadow_rays = 0;
+    int passes = 0;
+    double seconds = 0;
+
+    // Per pixel: 12 sums, then samples and target.
+    static constexpr int sums_per_pixel = 12;
+    std::vector<double> sums;
+    std::vector<int32_t> samples;
+    std::vector<int32_t> targets;
+
+    void Resize(int w, int h) {
+        width = w;
+        height = h;
+        size_t count = size_t(w) * h;
+        sums.resize(count * sums_per_pixel);
+        samples.resize(count);
+        targets.resize(count);
+    }
+
+    // Writes to a temporary file and renames it over path, so a crash while writing never
+    // leaves a truncated checkpoint behind.
+    bool Write(const fs::path& path) const {
+        fs::path temp_path = path;
+        temp_path += ".tmp";
+        {
+            std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+            if (!file) {
+                std::cerr << "Failed to create checkpoint " << temp_path.string() << std::endl;
+                return false;
+            }
+            writeHeader(file);
+
+            // One record per pixel, assembled in blocks to keep the number of writes small.
+            const size_t record_size = sums_per_pixel * sizeof(double) + 2 * sizeof(int32_t);
+            const size_t block_pixels = 4096;
+            std::vector<char> block(block_pixels * record_size);
+            size_t count = samples.size();
+            for (size_t begin = 0; begin < count; begin += block_pixels) {
+                size_t end = std::min(count, begin + block_pixels);
+                char* out = block.data();
+                for (size_t p = begin; p < end; p++) {
+                    std::memcpy(out, &sums[p * sums_per_pixel], sums_per_pixel * sizeof(double));
+                    out += sums_per_pixel * sizeof(double);
+                    std::memcpy(out, &samples[p], sizeof(int32_t));
+                    out += sizeof(int32_t);
+                    std::memcpy(out, &targets[p], sizeof(int32_t));
+                    out += sizeof(int32_t);
+                }
+                file.write(block.data(), std::streamsize(out - block.data()));
+            }
+            if (!file.flush()) {
+                std::cerr << "Failed to write checkpoint " << temp_path.string() << std::endl;
+                return false;
+            }
+        }
+
+        std::error_code error;
+        fs::rename(temp_path, path, error);
+        if (error) {
+            std::cerr << "Failed to replace checkpoint " << path.string() << ": " << error.message() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool Read(const fs::path& path) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            std::cerr << "Failed to open checkpoint " << path.string() << std::endl;
+            return false;
+        }
+        if (!readHeader(file)) {
+            std::cerr << path.string() << " is not a checkpoint of this build" << std::endl;
+            return false;
+        }
+        if (width <= 0 || height <= 0) {
+            std::cerr << path.string() << ": bad image size" << std::endl;
+            return false;
+        }
+        Resize(width, height);
+
+        const size_t record_size = sums_per_pixel * sizeof(double) + 2 * sizeof(int32_t);
+        std::vector<char> record(record_size);
+        for (size_t p = 0; p < samples.size(); p++) {
+            if (!file.read(record.data(), std::streamsize(record_size))) {
+                std::cerr << path.string() << ": truncated checkpoint" << std::endl;
+                return false;
+            }
+            const char* in = record.data();
+            std::memcpy(&sums[p * sums_per_pixel], in, sums_per_pixel * sizeof(double));
+            in += sums_per_pixel * sizeof(double);
+            std::memcpy(&samples[p], in, sizeof(int32_t));
+            in += sizeof(int32_t);
+            std::memcpy(&targets[p], in, sizeof(int32_t));
+        }
+        return true;
+    }
+
+private:
+    static constexpr char magic[8] = { 'R', 'T', 'C', 'K', 'P', 'T', '\0', '\0' };
+    static constexpr uint32_t byte_order_mark = 0x01020304;
+
+    template <typename T>
+    static void put(std::ostream& out, const T& value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    static bool get(std::istream& in, T& value) {
+        return bool(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+    }
+
+    void writeHeader(std::ostream& out) const {
+        out.write(magic, sizeof(magic));
+        put(out, byte_order_mark);
+        put(out, version);
+        put(out, int32_t(width));
+        put(out, int32_t(height));
+        put(out, int32_t(pass));
+        put(out, fingerprint);
+        put(out, paths);
+        put(out, rays);
+        put(out, shadow_rays);
+        put(out, int32_t(passes));
+        put(out, seconds);
+    }
+
+    bool readHeader(std::istream& in) {
+        char file_magic[sizeof(magic)];
+        uint32_t file_mark, file_version;
+        int32_t w, h, p, n;
+        if (!in.read(file_magic, sizeof(file_magic)) || std::memcmp(file_magic, magic, sizeof(magic)) != 0)
+            return false;
+        if (!get(in, file_mark) || file_mark != byte_order_mark)
+            return false;
+        if (!get(in, file_version) || file_version != version)
+            return false;
+        if (!get(in, w) || !get(in, h) || !get(in, p) || !get(in, fingerprint) || !get(in, paths)
+            || !get(in, rays) || !get(in, shadow_rays) || !get(in, n) || !get(in, seconds))
+            return false;
+        width = w;
+        height = h;
+        pass = p;
+        passes = n;
+        return true;
+    }
+};
+
+#endif
\ No newline at end of file
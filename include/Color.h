@@ -7,6 +7,10 @@
 
 using Color = Vec3;
 
+template <typename T>
+inline double luminance(const Vec3T<T>& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
 
 inline Color from_hsv(double h, double s, double v) {
     int i = int(h * 6);
@@ -0,0 +1,245 @@
+#ifndef DEMO_SCENES_H
+#define DEMO_SCENES_H
+
+#include "Scene.h"
+#include "Object.h"
+#include "Material.h"
+#include "Mesh.h"
+#include "Random.h"
+
+// Fixed scenes shared by the renderer and the benchmark. Each one sets the camera and adds
+// its objects; the caller picks resolution and samples and then calls Init. The generator
+// is restarted first, so a scene comes out identical on every call.
+
+// The "Ray Tracing in One Weekend" cover, with emissive spheres mixed in.
+inline void BuildSpheresScene(Scene& scene) {
+    thread_rng() = Pcg32();
+
+    scene.vfov = 20;
+    scene.lookfrom = Point3(13, 2, 3);
+    scene.lookat = Point3(0, 0, 0);
+
+    scene.defocus_angle = 0.6;
+    scene.focus_dist = 10.0;
+    scene.exposure = 0.05;
+
+    auto ground_material = MakeLambertian(Color(0.5, 0.5, 0.5));
+    scene.AddObject(MakeSphere(Point3(0, -1000, 0), 1000, ground_material));
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_double();
+            Point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+
+            if ((center - Point3(4, 0.2, 0)).length() > 0.9) {
+                std::shared_ptr<Material> sphere_material;
+
+                if (choose_mat < 0.3) {
+                    // diffuse
+                    auto albedo = Color::random() * Color::random();
+                    sphere_material = MakeLambertian(albedo);
+                    scene.AddObject(MakeSphere(center, 0.2, sphere_material));
+                }
+                else if (choose_mat < 0.8) {
+                    // emission
+                    auto emit_color = from_hsv(random_double(0.2, 0.95), 0.7, 1);
+                    emit_color = emit_color * emit_color;
+                    sphere_material = MakeEmission(emit_color, random_double(6, 15));
+                    scene.AddObject(MakeSphere(center, 0.2, sphere_material));
+                }
+                else if (choose_mat < 0.95) {
+                    // metal
+                    auto albedo = Color::random(0.5, 1);
+                    auto fuzz = random_double(0, 0.5);
+                    sphere_material = MakeMetal(albedo, fuzz);
+                    scene.AddObject(MakeSphere(center, 0.2, sphere_material));
+                }
+                else {
+                    // glass
+                    sphere_material = MakeDielectric(1.5);
+                    scene.AddObject(MakeSphere(center, 0.2, sphere_material));
+                }
+            }
+        }
+    }
+
+    auto material1 = MakeDielectric(1.5);
+    scene.AddObject(MakeSphere(Point3(0, 1, 0), 1.0, material1));
+
+    auto material2 = MakeLambertian(Color(0.4, 0.2, 0.1));
+    scene.AddObject(MakeSphere(Point3(-4, 1, 0), 1.0, material2));
+
+    auto material3 = MakeMetal(Color(0.7, 0.6, 0.5), 0.0);
+    scene.AddObject(MakeSphere(Point3(4, 1, 0), 1.0, material3));
+
+
+
+    auto material_ground = MakeLambertian(Color(0.1, 0.2, 0.5));
+    auto material_center = MakeLambertian(Color(0.1, 0.2, 0.5));
+    auto material_left = MakeDielectric(1.5);
+    auto material_bubble = MakeDielectric(1.0 / 1.5);
+    auto material_right = MakeMetal(Color(0.8, 0.6, 0.2), 1.0);
+
+    scene.AddObject(MakeSphere(Point3(0.0, -100.5, -1.0), 100.0, material_ground));
+    scene.AddObject(MakeSphere(Point3(0.0, 0.0, -1.2), 0.5, material_center));
+    scene.AddObject(MakeSphere(Point3(-1.0, 0.0, -1.0), 0.5, material_left));
+    scene.AddObject(MakeSphere(Point3(-1.0, 0.0, -1.0), 0.4, material_bubble));
+    scene.AddObject(MakeSphere(Point3(1.0, 0.0, -1.0), 0.5, material_right));
+}
+
+// Glass spheres, some of them hollow, on a diffuse ground and lit only by the sky.
+// Paths bounce through many refractions, so this stresses long paths and Russian roulette.
+inline void BuildGlassScene(Scene& scene) {
+    thread_rng() = Pcg32();
+
+    scene.vfov = 30;
+    scene.lookfrom = Point3(0, 6, 12);
+    scene.lookat = Point3(0, 0.5, 0);
+    scene.defocus_angle = 0;
+    scene.focus_dist = 12;
+    scene.exposure = 1;
+
+    scene.AddObject(MakeSphere(Point3(0, -1000, 0), 1000, MakeLambertian(Color(0.6, 0.6, 0.6))));
+
+    auto glass = MakeDielectric(1.5);
+    auto bubble = MakeDielectric(1.0 / 1.5);
+    for (int a = -4; a <= 4; a++) {
+        for (int b = -4; b <= 4; b++) {
+            Point3 center(1.1 * a, 0.5, 1.1 * b);
+            scene.AddObject(MakeSphere(center, 0.5, glass));
+            if ((a + b) % 3 == 0)
+                scene.AddObject(MakeSphere(center, 0.4, bubble));
+        }
+    }
+}
+
+// A field of small spheres, half of them emissive, lit only by themselves. Exercises light
+// selection and shadow rays.
+inline void BuildManyLightsScene(Scene& scene) {
+    thread_rng() = Pcg32();
+
+    scene.vfov = 35;
+    scene.lookfrom = Point3(0, 8, 14);
+    scene.lookat = Point3(0, 0, 0);
+    scene.defocus_angle = 0;
+    scene.focus_dist = 16;
+    scene.exposure = 0;
+
+    scene.AddObject(MakeSphere(Point3(0, -1000, 0), 1000, MakeLambertian(Color(0.5, 0.5, 0.5))));
+
+    auto diffuse = MakeLambertian(Color(0.6, 0.6, 0.6));
+    for (int a = -16; a < 16; a++) {
+        for (int b = -16; b < 16; b++) {
+            Point3 center(0.6 * a + 0.3 * random_double(), 0.2, 0.6 * b + 0.3 * random_double());
+            if (random_double() < 0.5) {
+                auto emit_color = from_hsv(random_double(0, 1), 0.5, 1);
+                scene.AddObject(MakeSphere(center, 0.2, MakeEmission(emit_color, random_double(2, 10))));
+            }
+            else {
+                scene.AddObject(MakeSphere(center, 0.2, diffuse));
+            }
+        }
+    }
+}
+
+// A large, regular grid of diffuse and metal spheres. Most of the time goes into
+// BVH traversal, so this tracks acceleration structure performance.
+inline void BuildSphereGridScene(Scene& scene) {
+    thread_rng() = Pcg32();
+
+    scene.vfov = 40;
+    scene.lookfrom = Point3(0, 25, 60);
+    scene.lookat = Point3(0, 0, 0);
+    scene.defocus_angle = 0;
+    scene.focus_dist = 65;
+    scene.exposure = 1;
+
+    scene.AddObject(MakeSphere(Point3(0, -1000, 0), 1000, MakeLambertian(Color(0.5, 0.5, 0.5))));
+
+    for (int a = -100; a < 100; a++) {
+        for (int b = -100; b < 100; b++) {
+            Point3 center(0.5 * a, 0.2 + 0.1 * random_double(), 0.5 * b);
+            std::shared_ptr<Material> material;
+            if (random_double() < 0.7)
+                material = MakeLambertian(Color::random() * Color::random());
+            else
+                material = MakeMetal(Color::random(0.5, 1), random_double(0, 0.3));
+            scene.AddObject(MakeSphere(center, 0.2, material));
+        }
+    }
+}
+
+// A bumpy sphere of half a million triangles on a diffuse ground, lit by the sky and one
+// emissive sphere. Nearly all the time goes into the mesh's own BVH.
+inline void BuildMeshScene(Scene& scene) {
+    thread_rng() = Pcg32();
+
+    scene.vfov = 30;
+    scene.lookfrom = Point3(0, 2, 7);
+    scene.lookat = Point3(0, 0.9, 0);
+    scene.defocus_angle = 0;
+    scene.focus_dist = 7;
+    scene.exposure = 0.5;
+
+    scene.AddObject(MakeSphere(Point3(0, -1000, 0), 1000, MakeLambertian(Color(0.5, 0.5, 0.5))));
+    scene.AddObject(MakeSphere(Point3(2, 0.4, 1), 0.4, MakeEmission(Color(1, 0.8, 0.6), 8)));
+
+    // A latitude-longitude grid on the unit sphere, pushed in and out along the normal
+    const int rings = 512, segments = 512;
+    std::vector<Point3> positions;
+    positions.reserve(size_t(rings + 1) * (segments + 1));
+    for (int i = 0; i <= rings; i++) {
+        double theta = pi * i / rings;
+        for (int j = 0; j <= segments; j++) {
+            double phi = 2 * pi * j / segments;
+            Vec3 n(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            double r = 1 + 0.08 * std::sin(12 * theta) * std::sin(12 * phi);
+            positions.push_back(Point3(0, 1, 0) + r * n);
+        }
+    }
+    std::vector<uint32_t> indices;
+    indices.reserve(size_t(rings) * segments * 6);
+    for (int i = 0; i < rings; i++) {
+        for (int j = 0; j < segments; j++) {
+            uint32_t a = uint32_t(i * (segments + 1) + j), b = a + 1;
+            uint32_t c = a + segments + 1, d = c + 1;
+            for (uint32_t v : { a, c, b, b, c, d })
+                indices.push_back(v);
+        }
+    }
+    scene.AddObject(MakeMesh(std::move(positions), std::move(indices), MakeMetal(Color(0.8, 0.7, 0.6), 0.2)));
+}
+
+// A million spheres of random size scattered over a 1000 by 1000 grid, drawing on a small
+// palette of materials. The tree is deep and mostly out of cache, so this measures the
+// acceleration structure at scale.
+inline void BuildMillionSpheresScene(Scene& scene) {
+    thread_rng() = Pcg32();
+
+    scene.vfov = 30;
+    scene.lookfrom = Point3(0, 40, 160);
+    scene.lookat = Point3(0, 0, 40);
+    scene.defocus_angle = 0;
+    scene.focus_dist = 125;
+    scene.exposure = 1;
+
+    scene.AddObject(MakeSphere(Point3(0, -1000, 0), 1000, MakeLambertian(Color(0.5, 0.5, 0.5))));
+
+    std::vector<std::shared_ptr<Material>> palette;
+    for (int m = 0; m < 24; m++)
+        palette.push_back(MakeLambertian(Color::random() * Color::random()));
+    for (int m = 0; m < 8; m++)
+        palette.push_back(MakeMetal(Color::random(0.5, 1), random_double(0, 0.3)));
+
+    scene.ReserveObjects(1000 * 1000 + 1);
+    for (int a = -500; a < 500; a++) {
+        for (int b = -500; b < 500; b++) {
+            double radius = random_double(0.05, 0.2);
+            Point3 center(0.5 * a + 0.2 * random_double(), radius, 0.5 * b + 0.2 * random_double());
+            auto material = palette[std::min(int(random_double() * palette.size()), int(palette.size()) - 1)];
+            scene.AddObject(MakeSphere(center, radius, material));
+        }
+    }
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,284 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+
+#include "Vec3.h"
+#include "Color.h"
+#include "Simd.h"
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010), with the variance guided
+// luminance test of SVGF (Schied et al. 2017).
+//
+// Every iteration blurs the image with a 5x5 B3 spline kernel whose taps are 2^i pixels
+// apart, so five iterations cover 125x125 pixels for the cost of 125 taps. Each tap is
+// weighted down by how far its normal, albedo and depth are from the centre pixel's, which
+// keeps the blur inside objects, and by how far its luminance is from the centre pixel's
+// in units of the centre pixel's own noise, so detail the samples agree on survives.
+class DenoiseSettings {
+public:
+    int iterations = 5;             // Passes of the kernel; pass i has taps 2^i pixels apart
+    double sigma_luminance = 4;     // Luminance difference allowed, in standard errors of the pixel
+    double sigma_normal = 0.3;      // Length of the difference between normals allowed
+    double sigma_albedo = 0.1;      // Albedo difference allowed
+    double sigma_depth = 1;         // Depth difference allowed, in multiples of what the local slope explains
+};
+
+// e^-x for x >= 0, to about 5e-6 relative. Written without calls, branches or float
+// comparisons (which GCC will not if-convert by default) so loops over it vectorize.
+inline float fast_exp_neg(float x) {
+    // Non-negative floats order like their bit patterns, so the clamp to 80 is an integer min.
+    int32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    const int32_t limit = 0x42A00000;   // 80.0f
+    bits = bits < limit ? bits : limit;
+    std::memcpy(&x, &bits, sizeof(x));
+
+    // -x / ln 2 = n + f with integer n and |f| <= 1/2. Adding 1.5 * 2^23 rounds to n and
+    // leaves it in the low mantissa bits, from where it goes into the exponent of 2^n.
+    float t = x * -1.44269504f;
+    float shifted = t + 12582912.0f;
+    float n = shifted - 12582912.0f;
+    float f = t - n;
+    float p = 1.0f + f * (0.693147181f + f * (0.240226507f + f * (0.0555041087f + f * (0.00961812911f + f * 0.00133335581f))));
+    std::memcpy(&bits, &shifted, sizeof(bits));
+    bits = (bits - 0x4B400000 + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+class Denoiser {
+public:
+    DenoiseSettings settings;
+    unsigned int thread_count = 0;  // 0 uses std::thread::hardware_concurrency()
+
+    // Filters color in place. The guides are per-pixel means over the same samples as
+    // color; variance is the variance of the mean of each pixel's tone mapped luminance.
+    void Filter(int width, int height, std::vector<Color>& color, const std::vector<Color>& albedo,
+        const std::vector<Vec3>& normal, const std::vector<double>& depth, const std::vector<double>& variance) {
+        this->width = width;
+        this->height = height;
+        if (width <= 0 || height <= 0 || settings.iterations <= 0)
+            return;
+        if (thread_count == 0) thread_count = std::thread::hardware_concurrency();
+        if (thread_count == 0) thread_count = 4;
+
+        setGuides(albedo, normal, depth);
+
+        Planes a, b;
+        a.resize(color.size());
+        b.resize(color.size());
+        for (size_t p = 0; p < color.size(); p++) {
+            a.r[p] = float(color[p].x());
+            a.g[p] = float(color[p].y());
+            a.b[p] = float(color[p].z());
+            a.tone[p] = toneLuminance(a.r[p], a.g[p], a.b[p]);
+            a.variance[p] = float(std::min(variance[p], 1.0));
+        }
+        lum_scale.resize(color.size());
+
+        Planes* in = &a;
+        Planes* out = &b;
+        for (int i = 0; i < settings.iterations; i++) {
+            int step = 1 << i;
+            forEachRow([&](int y) { luminanceScales(*in, y); });
+            forEachRow([&](int y) { filterRow(*in, *out, y, step); });
+            std::swap(in, out);
+        }
+
+        for (size_t p = 0; p < color.size(); p++)
+            color[p] = Color(in->r[p], in->g[p], in->b[p]);
+    }
+
+private:
+    // The image one channel per array, so the filter loops run over contiguous floats.
+    class Planes {
+    public:
+        std::vector<float> r, g, b;
+        std::vector<float> tone;        // Tone mapped luminance
+        std::vector<float> variance;    // Of tone, as the filter has propagated it
+
+        void resize(size_t n) {
+            r.resize(n); g.resize(n); b.resize(n);
+            tone.resize(n);
+            variance.resize(n);
+        }
+    };
+
+    // Pixels without a surface have infinite depth; a large finite one keeps the arithmetic clean.
+    static constexpr float far_depth = 1e8f;
+    static constexpr int block = 256;   // Pixels of a row filtered together
+
+    int width = 0;
+    int height = 0;
+    std::vector<float> nx, ny, nz;
+    std::vector<float> ar, ag, ab;
+    std::vector<float> z;
+    std::vector<float> slope_x, slope_y;    // Depth change per pixel, on the smoother side
+    std::vector<float> lum_scale;           // 1 / allowed squared luminance difference, per iteration
+
+    static float toneLuminance(float r, float g, float b) {
+        float l = 0.2126f * r + 0.7152f * g + 0.0722f * b;
+        return l / (1.0f + l);     // Colours are never negative
+    }
+
+    void setGuides(const std::vector<Color>& albedo, const std::vector<Vec3>& normal, const std::vector<double>& depth) {
+        size_t n = size_t(width) * height;
+        nx.resize(n); ny.resize(n); nz.resize(n);
+        ar.resize(n); ag.resize(n); ab.resize(n);
+        z.resize(n);
+        slope_x.resize(n); slope_y.resize(n);
+        for (size_t p = 0; p < n; p++) {
+            nx[p] = float(normal[p].x());
+            ny[p] = float(normal[p].y());
+            nz[p] = float(normal[p].z());
+            ar[p] = float(albedo[p].x());
+            ag[p] = float(albedo[p].y());
+            ab[p] = float(albedo[p].z());
+            z[p] = std::isfinite(depth[p]) ? float(std::min(depth[p], double(far_depth))) : far_depth;
+        }
+
+        // One-sided differences, taking the smaller, so a pixel beside an edge gets the
+        // slope of its own surface rather than the jump.
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                int p = y * width + x;
+                float left = x > 0 ? std::fabs(z[p] - z[p - 1]) : far_depth;
+                float right = x + 1 < width ? std::fabs(z[p + 1] - z[p]) : far_depth;
+                float up = y > 0 ? std::fabs(z[p] - z[p - width]) : far_depth;
+                float down = y + 1 < height ? std::fabs(z[p + width] - z[p]) : far_depth;
+                slope_x[p] = width > 1 ? std::min(left, right) : 0.0f;
+                slope_y[p] = height > 1 ? std::min(up, down) : 0.0f;
+            }
+        }
+    }
+
+    // Runs fn(y) for every row, spread over the threads.
+    template <class F>
+    void forEachRow(F fn) const {
+        std::atomic<int> next_row(0);
+        auto run = [&]() {
+#if RT_SIMD_X86
+            // Weights of taps across an edge are tiny, and products of them would otherwise
+            // be denormals, which cost the FPU a hundred cycles each. The mode is per thread.
+            _mm_setcsr(_mm_getcsr() | 0x8040);     // Flush to zero, denormals are zero
+#endif
+            for (int y = next_row.fetch_add(1); y < height; y = next_row.fetch_add(1))
+                fn(y);
+            };
+        std::vector<std::thread> threads;
+        for (unsigned int t = 0; t < thread_count; ++t)
+            threads.emplace_back(run);
+        for (auto& t : threads)
+            t.join();
+    }
+
+    // A handful of samples easily miss a rare bright path, which leaves a pixel looking less
+    // noisy than it is, so the luminance test goes by the largest variance around the pixel.
+    void luminanceScales(const Planes& in, int y) {
+        float sigma2 = float(settings.sigma_luminance * settings.sigma_luminance);
+        for (int x = 0; x < width; x++) {
+            float worst = 0;
+            for (int yq = std::max(y - 1, 0); yq <= std::min(y + 1, height - 1); yq++)
+                for (int xq = std::max(x - 1, 0); xq <= std::min(x + 1, width - 1); xq++)
+                    worst = std::max(worst, in.variance[yq * width + xq]);
+            lum_scale[y * width + x] = 1.0f / (sigma2 * worst + 1e-6f);
+        }
+    }
+
+    void filterRow(const Planes& in, Planes& out, int y, int step) const {
+        switch (simd_level()) {
+#if RT_SIMD_X86
+        case SimdLevel::AVX:
+            filterRowAVX(in, out, y, step);
+            return;
+#endif
+        default:
+            filterRowGeneric(in, out, y, step);
+            return;
+        }
+    }
+
+#if RT_SIMD_X86
+    // The same loops compiled for AVX, 8 pixels at a time instead of 4.
+    RT_TARGET_AVX void filterRowAVX(const Planes& in, Planes& out, int y, int step) const {
+        filterRowGeneric(in, out, y, step);
+    }
+#endif
+
+    // One row of one iteration. The loops run over tap, then pixel, so the inner loop
+    // weighs the same tap for a run of pixels, which the compiler turns into vector code.
+    RT_FORCE_INLINE void filterRowGeneric(const Planes& in, Planes& out, int y, int step) const {
+        static const float kernel[5] = { 1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+        float inv_normal = float(1 / (settings.sigma_normal * settings.sigma_normal));
+        float inv_albedo = float(1 / (settings.sigma_albedo * settings.sigma_albedo));
+        float sigma_depth = float(settings.sigma_depth);
+
+        float sum_r[block], sum_g[block], sum_b[block], sum_w[block], sum_v[block];
+        for (int x0 = 0; x0 < width; x0 += block) {
+            int x1 = std::min(x0 + block, width);
+            int n = x1 - x0;
+            std::fill(sum_r, sum_r + n, 0.0f);
+            std::fill(sum_g, sum_g + n, 0.0f);
+            std::fill(sum_b, sum_b + n, 0.0f);
+            std::fill(sum_w, sum_w + n, 0.0f);
+            std::fill(sum_v, sum_v + n, 0.0f);
+
+            for (int ky = -2; ky <= 2; ky++) {
+                int yq = y + ky * step;
+                if (yq < 0 || yq >= height) continue;
+                for (int kx = -2; kx <= 2; kx++) {
+                    int dx = kx * step;
+                    int begin = std::max(x0, -dx);
+                    int end = std::min(x1, width - dx);
+                    float h = kernel[ky + 2] * kernel[kx + 2];
+                    // Depth change the slope explains over this tap's offset
+                    float reach_x = sigma_depth * std::abs(dx);
+                    float reach_y = sigma_depth * std::abs(ky * step);
+                    int p0 = y * width;
+                    int q0 = yq * width + dx;
+                    for (int x = begin; x < end; x++) {
+                        int p = p0 + x;
+                        int q = q0 + x;
+                        float dnx = nx[p] - nx[q], dny = ny[p] - ny[q], dnz = nz[p] - nz[q];
+                        float dar = ar[p] - ar[q], dag = ag[p] - ag[q], dab = ab[p] - ab[q];
+                        float dz = z[p] - z[q];
+                        float z_scale = slope_x[p] * reach_x + slope_y[p] * reach_y + 1e-3f * z[p] + 1e-6f;
+                        float dl = in.tone[p] - in.tone[q];
+                        float e = (dnx * dnx + dny * dny + dnz * dnz) * inv_normal
+                            + (dar * dar + dag * dag + dab * dab) * inv_albedo
+                            + dz * dz / (z_scale * z_scale)
+                            + dl * dl * lum_scale[p];
+                        float w = h * fast_exp_neg(e);
+                        int i = x - x0;
+                        sum_r[i] += w * in.r[q];
+                        sum_g[i] += w * in.g[q];
+                        sum_b[i] += w * in.b[q];
+                        sum_w[i] += w;
+                        sum_v[i] += w * w * in.variance[q];
+                    }
+                }
+            }
+
+            // The centre tap always has full weight, so sum_w > 0.
+            for (int i = 0; i < n; i++) {
+                int p = y * width + x0 + i;
+                float inv_w = 1.0f / sum_w[i];
+                out.r[p] = sum_r[i] * inv_w;
+                out.g[p] = sum_g[i] * inv_w;
+                out.b[p] = sum_b[i] * inv_w;
+                out.tone[p] = toneLuminance(out.r[p], out.g[p], out.b[p]);
+                out.variance[p] = sum_v[i] * inv_w * inv_w;
+            }
+        }
+    }
+};
+
+#endif
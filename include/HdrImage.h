@@ -0,0 +1,263 @@
+#ifndef HDR_IMAGE_H
+#define HDR_IMAGE_H
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <algorithm>
+
+#include "Vec3.h"
+
+namespace fs = std::filesystem;
+
+// Linear HDR image files: the render buffers as they are, without tone mapping or 8-bit
+// quantisation.
+//   PFM  one (Pf) or three (PF) float channels, rows bottom to top, little-endian
+//   EXR  OpenEXR scanline file of any number of named float channels, uncompressed or RLE
+//        compressed, one scanline per chunk
+//
+// Both writers read the pixels straight from the caller's buffers through ImageChannel and
+// convert them to float one row at a time, so no copy of the image is made.
+
+// One channel of an image: where its first pixel is and how many bytes apart its pixels
+// are. Pixels are float or double.
+class ImageChannel {
+public:
+    std::string name;
+    const unsigned char* first = nullptr;
+    size_t stride = 0;
+    bool is_double = false;
+
+    float at(size_t pixel) const {
+        const unsigned char* p = first + pixel * stride;
+        if (is_double) {
+            double value;
+            std::memcpy(&value, p, sizeof(value));
+            return float(value);
+        }
+        float value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    }
+};
+
+inline ImageChannel MakeImageChannel(std::string name, const double* first, size_t stride = sizeof(double)) {
+    return ImageChannel{ std::move(name), reinterpret_cast<const unsigned char*>(first), stride, true };
+}
+
+inline ImageChannel MakeImageChannel(std::string name, const float* first, size_t stride = sizeof(float)) {
+    return ImageChannel{ std::move(name), reinterpret_cast<const unsigned char*>(first), stride, false };
+}
+
+// The three components of a vector buffer as channels prefix + names[i].
+template <typename T>
+inline void AddImageChannels(std::vector<ImageChannel>& channels, const std::vector<Vec3T<T>>& buffer,
+    const std::string& prefix, const char* const names[3]) {
+    for (int i = 0; i < 3; i++)
+        channels.push_back(MakeImageChannel(prefix + names[i], buffer.empty() ? nullptr : &buffer[0].e[i], sizeof(Vec3T<T>)));
+}
+
+enum class ExrCompression : uint8_t {
+    None = 0,
+    RLE = 1     // Byte-wise run lengths after OpenEXR's reordering and delta predictor
+};
+
+namespace hdr_detail {
+    // Both formats are little-endian whatever the machine.
+    inline void put_u32(std::vector<unsigned char>& out, uint32_t value) {
+        for (int i = 0; i < 4; i++)
+            out.push_back(static_cast<unsigned char>(value >> (8 * i)));
+    }
+
+    inline void put_u64(std::vector<unsigned char>& out, uint64_t value) {
+        for (int i = 0; i < 8; i++)
+            out.push_back(static_cast<unsigned char>(value >> (8 * i)));
+    }
+
+    inline void put_f32(std::vector<unsigned char>& out, float value) {
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        put_u32(out, bits);
+    }
+
+    inline void put_string(std::vector<unsigned char>& out, const std::string& s) {
+        out.insert(out.end(), s.begin(), s.end());
+        out.push_back(0);
+    }
+
+    inline void put_attribute(std::vector<unsigned char>& out, const std::string& name, const std::string& type,
+        const std::vector<unsigned char>& value) {
+        put_string(out, name);
+        put_string(out, type);
+        put_u32(out, uint32_t(value.size()));
+        out.insert(out.end(), value.begin(), value.end());
+    }
+
+    // OpenEXR's RLE: the bytes split into even and odd positions, each byte replaced by its
+    // difference to the one before, then runs of 3 to 128 equal bytes stored as
+    // (length - 1, byte) and everything else as (-count, bytes...).
+    inline void rle_compress(const std::vector<unsigned char>& in, std::vector<unsigned char>& scratch,
+        std::vector<unsigned char>& out) {
+        size_t n = in.size();
+        scratch.resize(n);
+        size_t half = (n + 1) / 2;
+        for (size_t i = 0; i < n; i++)
+            scratch[(i & 1) ? half + i / 2 : i / 2] = in[i];
+        for (size_t i = n; i-- > 1;)
+            scratch[i] = static_cast<unsigned char>(int(scratch[i]) - int(scratch[i - 1]) + 128);
+
+        out.clear();
+        const unsigned char* data = scratch.data();
+        size_t start = 0;
+        while (start < n) {
+            size_t run = 1;
+            while (start + run < n && run < 128 && data[start + run] == data[start])
+                run++;
+            if (run >= 3) {
+                out.push_back(static_cast<unsigned char>(run - 1));
+                out.push_back(data[start]);
+                start += run;
+                continue;
+            }
+            // Literal bytes, up to where a run of three starts
+            size_t end = start + 1;
+            while (end < n && end - start < 127 &&
+                !(end + 2 < n && data[end] == data[end + 1] && data[end] == data[end + 2]))
+                end++;
+            out.push_back(static_cast<unsigned char>(-int(end - start)));
+            out.insert(out.end(), data + start, data + end);
+            start = end;
+        }
+    }
+}
+
+inline bool WritePFM(const fs::path& path, int width, int height, const std::vector<ImageChannel>& channels) {
+    if (channels.size() != 1 && channels.size() != 3) {
+        std::cerr << "PFM holds 1 or 3 channels, not " << channels.size() << std::endl;
+        return false;
+    }
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cerr << "Failed to create " << path.string() << std::endl;
+        return false;
+    }
+    // A negative scale marks the data little-endian.
+    file << (channels.size() == 3 ? "PF" : "Pf") << "\n" << width << " " << height << "\n-1.0\n";
+
+    std::vector<unsigned char> row;
+    for (int j = height - 1; j >= 0; j--) {
+        row.clear();
+        for (int i = 0; i < width; i++) {
+            size_t p = size_t(j) * width + i;
+            for (const ImageChannel& channel : channels)
+                hdr_detail::put_f32(row, channel.at(p));
+        }
+        file.write(reinterpret_cast<const char*>(row.data()), std::streamsize(row.size()));
+    }
+    if (!file.flush()) {
+        std::cerr << "Failed to write " << path.string() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+inline bool WriteEXR(const fs::path& path, int width, int height, std::vector<ImageChannel> channels,
+    ExrCompression compression = ExrCompression::RLE) {
+    using namespace hdr_detail;
+    if (channels.empty() || width <= 0 || height <= 0) {
+        std::cerr << "Nothing to write to " << path.string() << std::endl;
+        return false;
+    }
+    // Readers expect the channels sorted by name, and their data in that order.
+    std::sort(channels.begin(), channels.end(),
+        [](const ImageChannel& a, const ImageChannel& b) { return a.name < b.name; });
+
+    std::vector<unsigned char> header = { 0x76, 0x2f, 0x31, 0x01 };
+    put_u32(header, 2);     // Version 2, single part scanline file
+
+    std::vector<unsigned char> value;
+    for (const ImageChannel& channel : channels) {
+        put_string(value, channel.name);
+        put_u32(value, 2);  // FLOAT
+        put_u32(value, 0);  // pLinear and reserved bytes
+        put_u32(value, 1);  // x sampling
+        put_u32(value, 1);  // y sampling
+    }
+    value.push_back(0);
+    put_attribute(header, "channels", "chlist", value);
+    put_attribute(header, "compression", "compression", { static_cast<unsigned char>(compression) });
+    value.clear();
+    for (int v : { 0, 0, width - 1, height - 1 })
+        put_u32(value, uint32_t(v));
+    put_attribute(header, "dataWindow", "box2i", value);
+    put_attribute(header, "displayWindow", "box2i", value);
+    put_attribute(header, "lineOrder", "lineOrder", { 0 });   // Increasing y
+    value.clear();
+    put_f32(value, 1);
+    put_attribute(header, "pixelAspectRatio", "float", value);
+    value.clear();
+    put_f32(value, 0);
+    put_f32(value, 0);
+    put_attribute(header, "screenWindowCenter", "v2f", value);
+    value.clear();
+    put_f32(value, 1);
+    put_attribute(header, "screenWindowWidth", "float", value);
+    header.push_back(0);
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cerr << "Failed to create " << path.string() << std::endl;
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(header.data()), std::streamsize(header.size()));
+
+    // The table of chunk offsets comes before the chunks, but compressed chunk sizes are only
+    // known once written, so it is filled in at the end.
+    uint64_t table_offset = header.size();
+    std::vector<unsigned char> table(size_t(height) * 8, 0);
+    file.write(reinterpret_cast<const char*>(table.data()), std::streamsize(table.size()));
+    uint64_t offset = table_offset + table.size();
+
+    std::vector<unsigned char> line, compressed, scratch, chunk;
+    std::vector<uint64_t> offsets(height);
+    for (int j = 0; j < height; j++) {
+        line.clear();
+        for (const ImageChannel& channel : channels)
+            for (int i = 0; i < width; i++)
+                put_f32(line, channel.at(size_t(j) * width + i));
+
+        const std::vector<unsigned char>* data = &line;
+        if (compression == ExrCompression::RLE) {
+            rle_compress(line, scratch, compressed);
+            // Chunks that do not get smaller are stored as they are, which readers detect
+            // from the size.
+            if (compressed.size() < line.size())
+                data = &compressed;
+        }
+
+        chunk.clear();
+        put_u32(chunk, uint32_t(j));
+        put_u32(chunk, uint32_t(data->size()));
+        file.write(reinterpret_cast<const char*>(chunk.data()), std::streamsize(chunk.size()));
+        file.write(reinterpret_cast<const char*>(data->data()), std::streamsize(data->size()));
+        offsets[j] = offset;
+        offset += chunk.size() + data->size();
+    }
+
+    table.clear();
+    for (uint64_t o : offsets)
+        put_u64(table, o);
+    file.seekp(std::streamoff(table_offset));
+    file.write(reinterpret_cast<const char*>(table.data()), std::streamsize(table.size()));
+    if (!file.flush()) {
+        std::cerr << "Failed to write " << path.string() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+#endif
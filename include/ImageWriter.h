@@ -0,0 +1,532 @@
+#ifndef IMAGE_WRITER_H
+#define IMAGE_WRITER_H
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <filesystem>
+#include <algorithm>
+
+#include "Simd.h"
+
+namespace fs = std::filesystem;
+
+// 8-bit PNG output, encoded in parallel and written from a background thread.
+//
+// The image is cut into strips of rows. Every strip is filtered and deflated by a thread of
+// its own, each ending on a byte boundary (an empty stored block, as zlib's sync flush
+// does), so the strips concatenate into one zlib stream; each goes into an IDAT chunk of its
+// own. A strip's matches may still reach back into the strip before it, so the file comes
+// out about as small as a serial encoder's.
+
+namespace png_detail {
+    inline uint32_t crc32(uint32_t crc, const unsigned char* data, size_t size) {
+        static const std::vector<uint32_t> table = []() {
+            std::vector<uint32_t> t(256);
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++)
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                t[n] = c;
+            }
+            return t;
+        }();
+        crc = ~crc;
+        for (size_t i = 0; i < size; i++)
+            crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    constexpr uint32_t adler_base = 65521;
+
+    inline uint32_t adler32(const unsigned char* data, size_t size) {
+        uint32_t a = 1, b = 0;
+        while (size > 0) {
+            // 5552 bytes is the most that cannot overflow b before the reduction.
+            size_t n = std::min<size_t>(size, 5552);
+            size -= n;
+            for (size_t i = 0; i < n; i++) {
+                a += data[i];
+                b += a;
+            }
+            data += n;
+            a %= adler_base;
+            b %= adler_base;
+        }
+        return (b << 16) | a;
+    }
+
+    // Adler-32 of two pieces joined, from their checksums and the length of the second.
+    inline uint32_t adler32_combine(uint32_t first, uint32_t second, size_t second_size) {
+        uint64_t rem = second_size % adler_base;
+        uint64_t a = ((first & 0xFFFF) + (second & 0xFFFF) + adler_base - 1) % adler_base;
+        uint64_t b = (rem * (first & 0xFFFF) + (first >> 16) + (second >> 16) + adler_base - rem) % adler_base;
+        return uint32_t((b << 16) | a);
+    }
+
+    // LSB-first bit packing, as deflate wants it.
+    class BitWriter {
+    public:
+        std::vector<unsigned char>& out;
+        uint64_t bits = 0;
+        int count = 0;
+
+        explicit BitWriter(std::vector<unsigned char>& out) : out(out) {}
+
+        void Put(uint32_t value, int length) {
+            bits |= uint64_t(value) << count;
+            count += length;
+            while (count >= 8) {
+                out.push_back(static_cast<unsigned char>(bits));
+                bits >>= 8;
+                count -= 8;
+            }
+        }
+
+        // Huffman codes are defined most significant bit first.
+        void PutReversed(uint32_t code, int length) {
+            uint32_t reversed = 0;
+            for (int i = 0; i < length; i++)
+                reversed |= ((code >> i) & 1) << (length - 1 - i);
+            Put(reversed, length);
+        }
+
+        void AlignToByte() {
+            if (count > 0)
+                Put(0, 8 - count);
+        }
+    };
+
+    // Deflate with the fixed Huffman codes: hash chains over 3-byte sequences, a 32 KB window
+    // and one step of lazy matching. Compresses data[begin, end), with data[begin - 32K,
+    // begin) available as history.
+    class Deflater {
+    public:
+        void Compress(const unsigned char* data, size_t begin, size_t end, bool final_block, std::vector<unsigned char>& out) {
+            head.assign(hash_size, -1);
+            prev.assign(window, -1);
+            // Positions count from the start of the history, so they fit in 32 bits.
+            size_t history = begin > window ? begin - window : 0;
+            data += history;
+            begin -= history;
+            end -= history;
+            for (size_t i = 0; i < begin && i + 2 < end; i++)
+                insert(data, i);
+
+            BitWriter writer(out);
+            writer.Put(final_block ? 1 : 0, 1);
+            writer.Put(1, 2);       // Fixed Huffman codes
+
+            size_t i = begin;
+            while (i < end) {
+                int length = 0, distance = 0;
+                if (i + 2 < end) {
+                    findMatch(data, i, end, length, distance);
+                    insert(data, i);
+                    // Lazy matching: a longer match one byte on is worth a literal now.
+                    if (length >= 3 && length < 16 && i + 3 < end) {
+                        int next_length = 0, next_distance = 0;
+                        findMatch(data, i + 1, end, next_length, next_distance);
+                        if (next_length > length)
+                            length = 0;
+                    }
+                }
+                if (length >= 3) {
+                    putLength(writer, length);
+                    putDistance(writer, distance);
+                    for (size_t k = i + 1; k < i + length; k++)
+                        if (k + 2 < end)
+                            insert(data, k);
+                    i += length;
+                }
+                else {
+                    putLiteral(writer, data[i]);
+                    i++;
+                }
+            }
+            putLiteral(writer, 256);    // End of block
+
+            if (final_block) {
+                writer.AlignToByte();
+            }
+            else {
+                // An empty stored block brings the stream to a byte boundary.
+                writer.Put(0, 3);
+                writer.AlignToByte();
+                writer.Put(0x0000, 16);
+                writer.Put(0xFFFF, 16);
+            }
+        }
+
+    private:
+        static constexpr size_t window = 32768;
+        static constexpr int hash_bits = 15;
+        static constexpr size_t hash_size = size_t(1) << hash_bits;
+        static constexpr int max_chain = 16;
+        static constexpr int max_match = 258;
+        static constexpr int nice_match = 64;   // Long enough to stop searching
+
+        std::vector<int32_t> head;     // Most recent position of each hash
+        std::vector<int32_t> prev;     // Previous position with the same hash, by position mod window
+
+        static uint32_t hash(const unsigned char* p) {
+            uint32_t v = uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16);
+            return (v * 2654435761u) >> (32 - hash_bits);
+        }
+
+        void insert(const unsigned char* data, size_t i) {
+            uint32_t h = hash(data + i);
+            prev[i % window] = head[h];
+            head[h] = int32_t(i);
+        }
+
+        void findMatch(const unsigned char* data, size_t i, size_t end, int& best_length, int& best_distance) const {
+            best_length = 0;
+            int limit = int(std::min<size_t>(max_match, end - i));
+            const unsigned char* b = data + i;
+            int32_t candidate = head[hash(b)];
+            for (int chain = 0; chain < max_chain && candidate >= 0; chain++) {
+                size_t distance = i - size_t(candidate);
+                if (distance > window || distance == 0)
+                    break;
+                const unsigned char* a = data + candidate;
+                if (a[best_length] == b[best_length]) {
+                    int length = match_length(a, b, limit);
+                    if (length > best_length) {
+                        best_length = length;
+                        best_distance = int(distance);
+                        if (length >= nice_match)
+                            break;
+                    }
+                }
+                int32_t next = prev[size_t(candidate) % window];
+                if (next >= candidate)
+                    break;  // The slot has been reused by a newer position
+                candidate = next;
+            }
+        }
+
+        // Length of the common prefix of a and b, up to limit, compared eight bytes at a time.
+        static int match_length(const unsigned char* a, const unsigned char* b, int limit) {
+            int length = 0;
+            while (length + 8 <= limit) {
+                uint64_t x, y;
+                std::memcpy(&x, a + length, 8);
+                std::memcpy(&y, b + length, 8);
+                if (x != y)
+                    break;
+                length += 8;
+            }
+            while (length < limit && a[length] == b[length])
+                length++;
+            return length;
+        }
+
+        static void putLiteral(BitWriter& writer, int symbol) {
+            if (symbol < 144) writer.PutReversed(0x30 + symbol, 8);
+            else if (symbol < 256) writer.PutReversed(0x190 + symbol - 144, 9);
+            else if (symbol < 280) writer.PutReversed(symbol - 256, 7);
+            else writer.PutReversed(0xC0 + symbol - 280, 8);
+        }
+
+        static void putLength(BitWriter& writer, int length) {
+            static const int base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+            static const int extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+            int code = int(std::upper_bound(base, base + 29, length) - base) - 1;
+            putLiteral(writer, 257 + code);
+            writer.Put(uint32_t(length - base[code]), extra[code]);
+        }
+
+        static void putDistance(BitWriter& writer, int distance) {
+            static const int base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+            static const int extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+            int code = int(std::upper_bound(base, base + 30, distance) - base) - 1;
+            writer.PutReversed(uint32_t(code), 5);
+            writer.Put(uint32_t(distance - base[code]), extra[code]);
+        }
+    };
+
+    inline int paeth(int a, int b, int c) {
+        int p = a + b - c;
+        int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        if (pa <= pb && pa <= pc) return a;
+        if (pb <= pc) return b;
+        return c;
+    }
+
+    // Filters one row with filter type F (1 sub, 2 up, 3 average, 4 Paeth) into out and
+    // returns the sum of the absolute values of the result. Each type has its own loop, so the
+    // simple ones vectorise. above is a row of zeros for the first row.
+    template <int F>
+    inline long filter_row_with(const unsigned char* row, const unsigned char* above, size_t stride, unsigned char* out) {
+        const size_t bpp = 3;
+        long cost = 0;
+        for (size_t i = 0; i < stride; i++) {
+            int a = i >= bpp ? row[i - bpp] : 0;
+            int b = above[i];
+            int predicted;
+            if (F == 1) predicted = a;
+            else if (F == 2) predicted = b;
+            else if (F == 3) predicted = (a + b) >> 1;
+            else predicted = paeth(a, b, i >= bpp ? above[i - bpp] : 0);
+            unsigned char value = static_cast<unsigned char>(row[i] - predicted);
+            out[i] = value;
+            cost += std::abs(int(static_cast<signed char>(value)));
+        }
+        return cost;
+    }
+
+    // Writes row y, filter type byte first, with whichever of the five filters leaves the
+    // smallest sum of absolute values, the usual guess at what will compress best. zeros and
+    // scratch are rows of the image's width, the first of them all zero.
+    inline void filter_row(const unsigned char* image, int width, int y, const unsigned char* zeros,
+        unsigned char* scratch, unsigned char* out) {
+        size_t stride = size_t(width) * 3;
+        const unsigned char* row = image + y * stride;
+        const unsigned char* above = y > 0 ? row - stride : zeros;
+
+        // The best candidate so far sits in out, the one being tried in scratch.
+        int best_filter = 0;
+        long best_cost = 0;
+        for (size_t i = 0; i < stride; i++) {
+            out[1 + i] = row[i];
+            best_cost += std::abs(int(static_cast<signed char>(row[i])));
+        }
+        for (int filter = 1; filter < 5; filter++) {
+            long cost = 0;
+            switch (filter) {
+            case 1: cost = filter_row_with<1>(row, above, stride, scratch); break;
+            case 2: cost = filter_row_with<2>(row, above, stride, scratch); break;
+            case 3: cost = filter_row_with<3>(row, above, stride, scratch); break;
+            case 4: cost = filter_row_with<4>(row, above, stride, scratch); break;
+            }
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_filter = filter;
+                std::memcpy(out + 1, scratch, stride);
+            }
+        }
+        out[0] = static_cast<unsigned char>(best_filter);
+    }
+
+    inline void put_u32_be(std::vector<unsigned char>& out, uint32_t value) {
+        for (int i = 3; i >= 0; i--)
+            out.push_back(static_cast<unsigned char>(value >> (8 * i)));
+    }
+
+    inline void write_chunk(std::ostream& file, const char type[4], const std::vector<unsigned char>& data) {
+        std::vector<unsigned char> head;
+        put_u32_be(head, uint32_t(data.size()));
+        head.insert(head.end(), type, type + 4);
+        uint32_t crc = crc32(0, head.data() + 4, 4);
+        crc = crc32(crc, data.data(), data.size());
+        std::vector<unsigned char> tail;
+        put_u32_be(tail, crc);
+        file.write(reinterpret_cast<const char*>(head.data()), std::streamsize(head.size()));
+        file.write(reinterpret_cast<const char*>(data.data()), std::streamsize(data.size()));
+        file.write(reinterpret_cast<const char*>(tail.data()), std::streamsize(tail.size()));
+    }
+}
+
+// Runs fn(begin, end) over [0, count) in chunks of at least min_chunk, on up to thread_count threads.
+template <class F>
+inline void ParallelFor(size_t count, unsigned int thread_count, size_t min_chunk, F fn) {
+    if (thread_count == 0) thread_count = std::thread::hardware_concurrency();
+    if (thread_count == 0) thread_count = 4;
+    size_t chunks = std::max<size_t>(1, std::min<size_t>(size_t(thread_count) * 4, count / std::max<size_t>(min_chunk, 1)));
+    size_t chunk_size = (count + chunks - 1) / chunks;
+    std::atomic<size_t> next(0);
+    auto run = [&]() {
+        for (size_t c = next.fetch_add(1); c < chunks; c = next.fetch_add(1))
+            fn(c * chunk_size, std::min(count, (c + 1) * chunk_size));
+        };
+    std::vector<std::thread> threads;
+    for (unsigned int t = 1; t < std::min<size_t>(thread_count, chunks); t++)
+        threads.emplace_back(run);
+    run();
+    for (auto& t : threads)
+        t.join();
+}
+
+// Encodes an 8-bit RGB image as PNG, spreading the filtering and compression over threads.
+// Fails for an empty image, which PNG cannot hold.
+inline bool WritePNG(const fs::path& path, int width, int height, const unsigned char* rgb, unsigned int thread_count = 0) {
+    using namespace png_detail;
+    if (width <= 0 || height <= 0)
+        return false;
+    size_t row_size = 1 + size_t(width) * 3;
+    std::vector<unsigned char> filtered(row_size * height);
+
+    // Strips of whole rows, big enough that their per-strip overhead is negligible.
+    const int min_strip_rows = 16;
+    if (thread_count == 0) thread_count = std::thread::hardware_concurrency();
+    if (thread_count == 0) thread_count = 4;
+    int strip_count = std::max(1, std::min(int(thread_count) * 2, height / min_strip_rows));
+    int strip_rows = (height + strip_count - 1) / strip_count;
+    strip_count = (height + strip_rows - 1) / strip_rows;
+
+    std::vector<std::vector<unsigned char>> compressed(strip_count);
+    std::vector<uint32_t> adler(strip_count);
+    // Strips are filtered first, as compressing one reads the end of the strip before it.
+    ParallelFor(size_t(height), thread_count, size_t(min_strip_rows), [&](size_t begin, size_t end) {
+        std::vector<unsigned char> zeros(row_size), scratch(row_size);
+        for (size_t y = begin; y < end; y++)
+            filter_row(rgb, width, int(y), zeros.data(), scratch.data(), &filtered[y * row_size]);
+        });
+    ParallelFor(size_t(strip_count), thread_count, 1, [&](size_t begin, size_t end) {
+        Deflater deflater;
+        for (size_t s = begin; s < end; s++) {
+            size_t first = s * strip_rows * row_size;
+            size_t last = std::min(size_t(height), (s + 1) * strip_rows) * row_size;
+            std::vector<unsigned char>& out = compressed[s];
+            if (s == 0) {
+                out.push_back(0x78);    // zlib header: deflate, 32 KB window
+                out.push_back(0x01);
+            }
+            bool final_strip = s + 1 == size_t(strip_count);
+            deflater.Compress(filtered.data(), first, last, final_strip, out);
+            adler[s] = adler32(filtered.data() + first, last - first);
+        }
+        });
+
+    uint32_t checksum = adler[0];
+    for (int s = 1; s < strip_count; s++) {
+        size_t first = size_t(s) * strip_rows * row_size;
+        size_t last = std::min(size_t(height), size_t(s + 1) * strip_rows) * row_size;
+        checksum = adler32_combine(checksum, adler[s], last - first);
+    }
+    put_u32_be(compressed.back(), checksum);
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+        return false;
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    file.write(reinterpret_cast<const char*>(signature), sizeof(signature));
+    std::vector<unsigned char> header;
+    put_u32_be(header, uint32_t(width));
+    put_u32_be(header, uint32_t(height));
+    header.insert(header.end(), { 8, 2, 0, 0, 0 });    // 8-bit RGB, deflate, no interlacing
+    write_chunk(file, "IHDR", header);
+    for (const std::vector<unsigned char>& strip : compressed)
+        write_chunk(file, "IDAT", strip);
+    write_chunk(file, "IEND", {});
+    return bool(file.flush());
+}
+
+// Tone maps with x / (1 + x), applies gamma 2 and quantises to 8 bits, the transform of the
+// colour PNGs. Every component gets the same treatment, so the buffer is one flat run of
+// values and SSE2 takes two at a time; the result is identical to the scalar code.
+template <typename T>
+inline void ToneMapTo8Bit(const T* values, size_t count, unsigned char* out) {
+    size_t i = 0;
+#if RT_SIMD_X86
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d top = _mm_set1_pd(0.999);
+    const __m128d scale = _mm_set1_pd(256.0);
+    for (; i + 2 <= count; i += 2) {
+        __m128d x;
+        if constexpr (sizeof(T) == sizeof(double))
+            x = _mm_loadu_pd(reinterpret_cast<const double*>(values + i));
+        else
+            x = _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd(reinterpret_cast<const double*>(values + i))));
+        x = _mm_div_pd(x, _mm_add_pd(one, x));
+        // max(x, 0) returns 0 for NaN too, as the scalar x > 0 test does
+        x = _mm_sqrt_pd(_mm_max_pd(x, zero));
+        x = _mm_mul_pd(_mm_min_pd(x, top), scale);
+        __m128i q = _mm_cvttpd_epi32(x);
+        out[i] = static_cast<unsigned char>(_mm_cvtsi128_si32(q));
+        out[i + 1] = static_cast<unsigned char>(_mm_cvtsi128_si32(_mm_srli_si128(q, 4)));
+    }
+#endif
+    for (; i < count; i++) {
+        double x = double(values[i]);
+        x = x / (1.0 + x);
+        x = x > 0 ? std::sqrt(x) : 0.0;
+        out[i] = static_cast<unsigned char>(256 * std::min(x, 0.999));
+    }
+}
+
+// A background thread that runs queued writes in order, so rendering the next frame can
+// start while the last one is still being encoded. Destruction waits for the queue.
+class ImageWriter {
+public:
+    ImageWriter() = default;
+    ImageWriter(const ImageWriter&) = delete;
+    ImageWriter& operator=(const ImageWriter&) = delete;
+
+    ~ImageWriter() {
+        Finish();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (worker.joinable())
+            worker.join();
+    }
+
+    // Queues job; it returns false if the write failed.
+    void Submit(std::function<bool()> job) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!worker.joinable())
+            worker = std::thread([this]() { run(); });
+        jobs.push_back(std::move(job));
+        pending++;
+        wake.notify_all();
+    }
+
+    // Waits until every queued write is done. Returns false if any failed since the last call.
+    bool Finish() {
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this]() { return pending == 0; });
+        bool ok = failures == 0;
+        failures = 0;
+        return ok;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::deque<std::function<bool()>> jobs;
+    int pending = 0;
+    int failures = 0;
+    bool stopping = false;
+    std::thread worker;
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this]() { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            std::function<bool()> job = std::move(jobs.front());
+            jobs.pop_front();
+            lock.unlock();
+            bool ok = job();
+            lock.lock();
+            if (!ok)
+                failures++;
+            pending--;
+            idle.notify_all();
+        }
+    }
+};
+
+#endif
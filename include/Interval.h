@@ -3,37 +3,42 @@
 
 #include "Utils.h"
 
-class Interval {
+template <typename T>
+class IntervalT {
 public:
-    double min;
-    double max;
+    T min;
+    T max;
 
-    Interval() : min(-infinity), max(infinity) {}
-    Interval(double min, double max) : min(min), max(max) {}
+    IntervalT() : min(-infinity), max(infinity) {}
+    IntervalT(T min, T max) : min(min), max(max) {}
 
-    double size() {
+    T size() {
         return max - min;
     }
 
-    bool contains(double x) {
+    bool contains(T x) {
         return min <= x && x <= max;
     }
 
-    bool surrounds(double x) {
+    bool surrounds(T x) const {
         return min < x && x < max;
     }
 
-    double clamp(double x) const {
+    T clamp(T x) const {
         if (x < min) return min;
         if (x > max) return max;
         return x;
     }
 
-    static const Interval Empty, Universe;
+    static const IntervalT Empty, Universe;
 };
 
-const Interval Interval::Empty = Interval(+infinity, -infinity);
-const Interval Interval::Universe = Interval(-infinity, +infinity);
+template <typename T>
+const IntervalT<T> IntervalT<T>::Empty = IntervalT<T>(+infinity, -infinity);
+template <typename T>
+const IntervalT<T> IntervalT<T>::Universe = IntervalT<T>(-infinity, +infinity);
 
+using Interval = IntervalT<real>;
 
-#endif
\ No newline at end of file
+
+#endif
@@ -0,0 +1,266 @@
+#ifndef LIGHT_BVH_H
+#define LIGHT_BVH_H
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#include "AABB.h"
+#include "Vec3.h"
+
+class LightBVHNode {
+public:
+    AABB bounds;
+    Point3 center;          // Centre of bounds and squared half diagonal, cached for importance()
+    double radius_squared = 0;
+    double power = 0;       // Summed power of the lights below this node
+    int offset = 0;         // Interior node: index of the second child, the first is the next node.
+                            // Leaf node: position of its first light in the light order.
+    int count = 0;          // Number of lights in a leaf, 0 for interior nodes
+
+    bool is_leaf() const { return count > 0; }
+};
+
+// Hierarchy over the lights of a scene, used to pick a light with probability roughly
+// proportional to its contribution at a shading point: each level chooses between
+// its two children by power over squared distance, so a sample costs O(log N).
+// Lights are grouped so that each cluster is both compact and of similar power.
+class LightBVH {
+public:
+    static constexpr int bin_count = 12;
+    static constexpr int max_depth = 64;
+
+    void Build(const std::vector<AABB>& light_bounds, const std::vector<double>& light_power) {
+        nodes.clear();
+        light_order.clear();
+        light_trail.assign(light_bounds.size(), 0);
+        if (light_bounds.empty())
+            return;
+
+        std::vector<BuildLight> build(light_bounds.size());
+        for (size_t i = 0; i < light_bounds.size(); i++) {
+            build[i].bounds = light_bounds[i];
+            build[i].centroid = light_bounds[i].centroid();
+            build[i].power = light_power[i];
+            build[i].index = int(i);
+        }
+
+        nodes.reserve(2 * build.size());
+        buildRecursive(build, 0, int(build.size()), 0, 0);
+
+        light_order.resize(build.size());
+        for (size_t i = 0; i < build.size(); i++)
+            light_order[i] = build[i].index;
+    }
+
+    bool empty() const {
+        return nodes.empty();
+    }
+
+    // Chooses a light for shading point p with surface normal n (a zero normal disables
+    // the test that skips clusters entirely below the surface). u is a uniform random
+    // number in [0,1). Returns -1, with pdf 0, if no light can contribute.
+    int Sample(const Point3& p, const Vec3& n, double u, double& pdf) const {
+        pdf = 0;
+        if (nodes.empty() || importance(nodes[0], p, n) <= 0)
+            return -1;
+
+        int current = 0;
+        double probability = 1;
+        while (!nodes[current].is_leaf()) {
+            int first = current + 1;
+            int second = nodes[current].offset;
+            double i_first = importance(nodes[first], p, n);
+            double i_second = importance(nodes[second], p, n);
+            if (i_first <= 0 && i_second <= 0)
+                return -1;
+
+            // Pick a child and stretch the part of u that selected it back over [0,1).
+            double p_first = i_first / (i_first + i_second);
+            if (u < p_first) {
+                u = std::fmin(u / p_first, 0x1.fffffffffffffp-1);
+                probability *= p_first;
+                current = first;
+            }
+            else {
+                u = std::fmin((u - p_first) / (1 - p_first), 0x1.fffffffffffffp-1);
+                probability *= 1 - p_first;
+                current = second;
+            }
+        }
+        // Leaves only hold several lights when the tree hit max_depth; pick among them uniformly.
+        const LightBVHNode& leaf = nodes[current];
+        int i = std::min(int(u * leaf.count), leaf.count - 1);
+        pdf = probability / leaf.count;
+        return light_order[leaf.offset + i];
+    }
+
+    // Probability that Sample(p, n, ...) returns light.
+    double Pdf(const Point3& p, const Vec3& n, int light) const {
+        if (nodes.empty() || importance(nodes[0], p, n) <= 0)
+            return 0;
+
+        // Follow the recorded left/right choices from the root down to the light's leaf.
+        uint64_t trail = light_trail[light];
+        int current = 0;
+        double probability = 1;
+        while (!nodes[current].is_leaf()) {
+            int first = current + 1;
+            int second = nodes[current].offset;
+            double i_first = importance(nodes[first], p, n);
+            double i_second = importance(nodes[second], p, n);
+            if (i_first <= 0 && i_second <= 0)
+                return 0;
+
+            double p_first = i_first / (i_first + i_second);
+            if (trail & 1) {
+                probability *= 1 - p_first;
+                current = second;
+            }
+            else {
+                probability *= p_first;
+                current = first;
+            }
+            trail >>= 1;
+        }
+        return probability / nodes[current].count;
+    }
+
+private:
+    class BuildLight {
+    public:
+        AABB bounds;
+        Point3 centroid;
+        double power;
+        int index;
+    };
+
+    std::vector<LightBVHNode> nodes;
+    std::vector<int> light_order;       // Lights in leaf order
+    std::vector<uint64_t> light_trail;  // Bit i set: the path to the light takes the second child at depth i
+
+    static double importance(const LightBVHNode& node, const Point3& p, const Vec3& n) {
+        if (node.power <= 0)
+            return 0;
+
+        // Power over squared distance, with the distance clamped to the cluster's radius
+        // so shading points inside or near a cluster do not blow up.
+        Vec3 to_center = node.center - p;
+        double distance_squared = to_center.length_squared();
+        double result = node.power / std::fmax(distance_squared, node.radius_squared);
+        if (n.near_zero() || distance_squared <= node.radius_squared)
+            return result;
+
+        // Times the largest cosine to the surface normal of any direction into the
+        // cluster's bounding sphere, which is 0 when the whole cluster is below the surface.
+        double distance = std::sqrt(distance_squared);
+        double cos_theta = dot(to_center, n) / distance;
+        double sin_theta_b = std::sqrt(node.radius_squared / distance_squared);
+        double cos_theta_b = std::sqrt(1 - sin_theta_b * sin_theta_b);
+        if (cos_theta >= cos_theta_b)
+            return result;
+        double sin_theta = std::sqrt(std::fmax(0.0, 1 - cos_theta * cos_theta));
+        double cos_bound = cos_theta * cos_theta_b + sin_theta * sin_theta_b;
+        return cos_bound > 0 ? result * cos_bound : 0;
+    }
+
+    int buildRecursive(std::vector<BuildLight>& build, int begin, int end, int depth, uint64_t trail) {
+        int node_index = int(nodes.size());
+        nodes.emplace_back();
+
+        AABB bounds, centroid_bounds;
+        double power = 0;
+        for (int i = begin; i < end; i++) {
+            bounds.expand(build[i].bounds);
+            centroid_bounds.expand(build[i].centroid);
+            power += build[i].power;
+        }
+        nodes[node_index].bounds = bounds;
+        nodes[node_index].center = bounds.centroid();
+        nodes[node_index].radius_squared = 0.25 * bounds.extent().length_squared();
+        nodes[node_index].power = power;
+
+        // The trail has one bit per level, so the tree stops splitting at max_depth.
+        if (end - begin == 1 || depth >= max_depth - 1) {
+            nodes[node_index].offset = begin;
+            nodes[node_index].count = end - begin;
+            for (int i = begin; i < end; i++)
+                light_trail[build[i].index] = trail;
+            return node_index;
+        }
+
+        int mid = findSplit(build, begin, end, centroid_bounds);
+        if (mid < 0) {
+            // Coincident lights: split the range in half.
+            mid = (begin + end) / 2;
+        }
+
+        buildRecursive(build, begin, mid, depth + 1, trail);
+        uint64_t second_trail = trail | (uint64_t(1) << depth);
+        nodes[node_index].offset = buildRecursive(build, mid, end, depth + 1, second_trail);
+        return node_index;
+    }
+
+    // Binned split minimising power * surface area summed over both sides, so bright
+    // lights end up in small clusters of their own. Returns -1 if no split separates anything.
+    int findSplit(std::vector<BuildLight>& build, int begin, int end, const AABB& centroid_bounds) {
+        int best_axis = -1;
+        int best_bin = -1;
+        double best_cost = infinity;
+
+        for (int axis = 0; axis < 3; axis++) {
+            double axis_min = centroid_bounds.min[axis];
+            double axis_extent = centroid_bounds.max[axis] - axis_min;
+            if (axis_extent <= 0)
+                continue;
+
+            AABB bin_bounds[bin_count];
+            double bin_power[bin_count] = {};
+            int bin_lights[bin_count] = {};
+            for (int i = begin; i < end; i++) {
+                int b = std::clamp(int(bin_count * ((build[i].centroid[axis] - axis_min) / axis_extent)), 0, bin_count - 1);
+                bin_bounds[b].expand(build[i].bounds);
+                bin_power[b] += build[i].power;
+                bin_lights[b]++;
+            }
+
+            for (int split = 0; split < bin_count - 1; split++) {
+                AABB left, right;
+                double left_power = 0, right_power = 0;
+                int left_lights = 0, right_lights = 0;
+                for (int b = 0; b <= split; b++) {
+                    left.expand(bin_bounds[b]);
+                    left_power += bin_power[b];
+                    left_lights += bin_lights[b];
+                }
+                for (int b = split + 1; b < bin_count; b++) {
+                    right.expand(bin_bounds[b]);
+                    right_power += bin_power[b];
+                    right_lights += bin_lights[b];
+                }
+                if (left_lights == 0 || right_lights == 0)
+                    continue;
+
+                double cost = left_power * left.surface_area() + right_power * right.surface_area();
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = split;
+                }
+            }
+        }
+
+        if (best_axis < 0)
+            return -1;
+
+        double axis_min = centroid_bounds.min[best_axis];
+        double axis_extent = centroid_bounds.max[best_axis] - axis_min;
+        auto split = std::partition(build.begin() + begin, build.begin() + end, [&](const BuildLight& light) {
+            int b = std::clamp(int(bin_count * ((light.centroid[best_axis] - axis_min) / axis_extent)), 0, bin_count - 1);
+            return b <= best_bin;
+            });
+        return int(split - build.begin());
+    }
+};
+
+#endif
\ No newline at end of file
@@ -1,17 +1,234 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
+#include <cstdint>
+
 #include "Object.h"
 
+class CompactMaterial;
+
+// What a material did with a ray that hit it.
+class Scattering {
+public:
+    Color albedo;           // For the albedo buffer
+    Color attenuation;      // Throughput of the scattered ray, or the emitted radiance if emit
+    Ray scattered;
+    bool scatter = false;
+    bool emit = false;
+};
+
+// Base of every material. The built-in materials describe themselves as a CompactMaterial,
+// which the renderer shades without a virtual call per hit. Custom materials derive from
+// Material and override fall, Evaluate, IsEmissive and Emitted instead; the renderer then
+// calls those, which is slower but otherwise works the same.
 class Material {
 public:
     virtual ~Material() = default;
 
-    virtual void fall(const Ray& r_in, const HitRecord& rec, Color& out_albedo, Color& attenuation, Ray& scattered, bool& scatter, bool& emit) const {
-        return;
+    // Fills in the compact form of the material. Returns false for custom materials.
+    virtual bool Compact(CompactMaterial& compact) const {
+        return false;
+    }
+
+    virtual void fall(const Ray& r_in, const HitRecord& rec, Scattering& s) const;
+
+    // For a unit direction leaving the hit point, returns the BSDF times the cosine term
+    // (f_cos) and the density with which fall() would have scattered into it (pdf).
+    // Returns false for materials whose scattering is a delta distribution (perfect
+    // mirrors, glass), which cannot be combined with light sampling.
+    virtual bool Evaluate(const Ray& r_in, const HitRecord& rec, const Vec3& direction, Color& f_cos, double& pdf) const;
+
+    virtual bool IsEmissive() const;
+
+    // Radiance leaving an emissive surface.
+    virtual Color Emitted() const;
+};
+
+enum class MaterialType : uint8_t {
+    Lambertian,
+    Metal,
+    Dielectric,
+    Emission,
+    Custom      // Shaded through the virtual functions of custom
+};
+
+// A material as plain data. Shading switches on the type, so the integrator can inline the
+// built-in materials and keep them in one flat table.
+class CompactMaterial {
+public:
+    MaterialType type = MaterialType::Custom;
+    Color color;                        // Albedo, or the emitted colour
+    double value = 0;                   // Metal fuzz, refractive index or emission intensity
+    const Material* custom = nullptr;   // Custom materials only; owned by the scene
+
+    // u holds the sampler's numbers for this bounce: u.x and u.y pick the direction, u.z
+    // makes discrete choices. Custom materials draw their own random numbers instead.
+    void Scatter(const Ray& r_in, const HitRecord& rec, const Vec3& u, Scattering& s) const {
+        switch (type) {
+        case MaterialType::Lambertian: scatterLambertian(rec, u, s); break;
+        case MaterialType::Metal: scatterMetal(r_in, rec, u, s); break;
+        case MaterialType::Dielectric: scatterDielectric(r_in, rec, u, s); break;
+        case MaterialType::Emission:
+            s.attenuation = value * color;
+            s.albedo = color;
+            s.scatter = false;
+            s.emit = true;
+            break;
+        case MaterialType::Custom: custom->fall(r_in, rec, s); break;
+        }
+    }
+
+    // See Material::Evaluate.
+    bool Evaluate(const Ray& r_in, const HitRecord& rec, const Vec3& direction, Color& f_cos, double& pdf) const {
+        switch (type) {
+        case MaterialType::Lambertian: {
+            // Scatter samples the cosine-weighted hemisphere around the normal.
+            double cos_theta = std::fmax(dot(direction, rec.normal), 0.0);
+            pdf = cos_theta / pi;
+            f_cos = color * pdf;
+            return true;
+        }
+        case MaterialType::Metal: return evaluateMetal(r_in, rec, direction, f_cos, pdf);
+        case MaterialType::Custom: return custom->Evaluate(r_in, rec, direction, f_cos, pdf);
+        default: return false;
+        }
+    }
+
+    // Whether Evaluate reports a delta distribution, which the material type decides
+    // without needing a direction. Custom materials are asked along the normal.
+    bool IsSpecular(const Ray& r_in, const HitRecord& rec) const {
+        switch (type) {
+        case MaterialType::Lambertian: return false;
+        case MaterialType::Metal: return value <= 0;
+        case MaterialType::Custom: {
+            Color f_cos;
+            double pdf;
+            return !custom->Evaluate(r_in, rec, rec.normal, f_cos, pdf);
+        }
+        default: return true;
+        }
+    }
+
+    bool IsEmissive() const {
+        if (type == MaterialType::Custom)
+            return custom->IsEmissive();
+        return type == MaterialType::Emission;
+    }
+
+    Color Emitted() const {
+        if (type == MaterialType::Custom)
+            return custom->Emitted();
+        return type == MaterialType::Emission ? value * color : Color(0, 0, 0);
+    }
+
+private:
+    void scatterLambertian(const HitRecord& rec, const Vec3& u, Scattering& s) const {
+        Vec3 scatter_direction = sample_cosine_direction(rec.normal, u);
+        s.scattered = Ray(offset_ray_origin(rec, scatter_direction), scatter_direction);
+        s.attenuation = color;
+        s.albedo = color;
+        s.scatter = true;
+        s.emit = false;
+    }
+
+    void scatterMetal(const Ray& r_in, const HitRecord& rec, const Vec3& u, Scattering& s) const {
+        Vec3 reflected = reflect(r_in.direction(), rec.normal);
+        reflected = normalize(reflected) + (value * sample_unit_vector(u));
+        s.scattered = Ray(offset_ray_origin(rec, reflected), reflected);
+        s.attenuation = color;
+        s.albedo = color;
+        s.scatter = (dot(s.scattered.direction(), rec.normal) > 0);
+        s.emit = false;
+    }
+
+    bool evaluateMetal(const Ray& r_in, const HitRecord& rec, const Vec3& direction, Color& f_cos, double& pdf) const {
+        double fuzz = value;
+        if (fuzz <= 0)
+            return false;   // Perfect mirror
+
+        pdf = 0;
+        f_cos = Color(0, 0, 0);
+        if (dot(direction, rec.normal) <= 0)
+            return true;    // fall() absorbs these
+
+        // fall() picks a point on the sphere of radius fuzz around the unit reflection
+        // vector. The directions through that sphere hit it at distances t with
+        // t^2 - 2bt + (1 - fuzz^2) = 0, and each such point contributes its area density
+        // 1 / (4 pi fuzz^2) converted to solid angle, t^2 / |cos|, with |cos| = sqrt(disc) / fuzz.
+        Vec3 reflected = normalize(reflect(r_in.direction(), rec.normal));
+        double b = dot(direction, reflected);
+        double discriminant = b * b - (1 - fuzz * fuzz);
+        if (discriminant <= 0)
+            return true;
+
+        double sqrtd = std::sqrt(discriminant);
+        double t_near = b - sqrtd;
+        double t_far = b + sqrtd;
+        double sum = 0;
+        if (t_near > 0) sum += t_near * t_near;
+        if (t_far > 0) sum += t_far * t_far;
+
+        pdf = sum / (4 * pi * fuzz * sqrtd);
+        f_cos = color * pdf;
+        return true;
+    }
+
+    void scatterDielectric(const Ray& r_in, const HitRecord& rec, const Vec3& u, Scattering& s) const {
+        s.albedo = Color(1.0, 1.0, 1.0);
+        s.attenuation = Color(1.0, 1.0, 1.0);
+        double ri = rec.front_face ? (1.0 / value) : value;
+
+        Vec3 unit_direction = normalize(r_in.direction());
+        double cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
+        double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
+
+        bool cannot_refract = ri * sin_theta > 1.0;
+        Vec3 direction;
+
+        if (cannot_refract || reflectance(cos_theta, ri) > u.z())
+            direction = reflect(unit_direction, rec.normal);
+        else
+            direction = refract(unit_direction, rec.normal, ri);
+
+        s.scattered = Ray(offset_ray_origin(rec, direction), direction);
+        s.scatter = true;
+        s.emit = false;
+    }
+
+    static double reflectance(double cosine, double refraction_index) {
+        // Use Schlick's approximation for reflectance.
+        auto r0 = (1 - refraction_index) / (1 + refraction_index);
+        r0 = r0 * r0;
+        return r0 + (1 - r0) * std::pow((1 - cosine), 5);
     }
 };
 
+// The base class versions serve materials that have a compact form, so fall() and friends
+// work on any material.
+inline void Material::fall(const Ray& r_in, const HitRecord& rec, Scattering& s) const {
+    CompactMaterial compact;
+    if (Compact(compact)) {
+        double x = random_double();
+        double y = random_double();
+        compact.Scatter(r_in, rec, Vec3(x, y, random_double()), s);
+    }
+}
+
+inline bool Material::Evaluate(const Ray& r_in, const HitRecord& rec, const Vec3& direction, Color& f_cos, double& pdf) const {
+    CompactMaterial compact;
+    return Compact(compact) && compact.Evaluate(r_in, rec, direction, f_cos, pdf);
+}
+
+inline bool Material::IsEmissive() const {
+    CompactMaterial compact;
+    return Compact(compact) && compact.IsEmissive();
+}
+
+inline Color Material::Emitted() const {
+    CompactMaterial compact;
+    return Compact(compact) ? compact.Emitted() : Color(0, 0, 0);
+}
+
 
 
 class Lambertian : public Material {
@@ -20,15 +237,10 @@ private:
 public:
     Lambertian(const Color& albedo) : albedo(albedo) {}
 
-    void fall(const Ray& r_in, const HitRecord& rec, Color& out_albedo, Color& attenuation, Ray& scattered, bool& scatter, bool& emit) const override {
-        Vec3 scatter_direction = rec.normal + random_unit_vector();
-        if (scatter_direction.near_zero())
-            scatter_direction = rec.normal;
-        scattered = Ray(rec.hitPoint, scatter_direction);
-        attenuation = albedo;
-        out_albedo = albedo;
-        scatter = true;
-        emit = false;
+    bool Compact(CompactMaterial& compact) const override {
+        compact.type = MaterialType::Lambertian;
+        compact.color = albedo;
+        return true;
     }
 
 };
@@ -46,14 +258,11 @@ private:
 public:
     Metal(const Color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz) {}
 
-    void fall(const Ray& r_in, const HitRecord& rec, Color& out_albedo, Color& attenuation, Ray& scattered, bool& scatter, bool& emit) const override {
-        Vec3 reflected = reflect(r_in.direction(), rec.normal);
-        reflected = normalize(reflected) + (fuzz * random_unit_vector());
-        scattered = Ray(rec.hitPoint, reflected);
-        attenuation = albedo;
-        out_albedo = albedo;
-        scatter = (dot(scattered.direction(), rec.normal) > 0);
-        emit = false;
+    bool Compact(CompactMaterial& compact) const override {
+        compact.type = MaterialType::Metal;
+        compact.color = albedo;
+        compact.value = fuzz;
+        return true;
     }
 
 };
@@ -70,34 +279,10 @@ private:
 public:
     Dielectric(double refractive_index) : refractive_index(refractive_index) {}
 
-    void fall(const Ray& r_in, const HitRecord& rec, Color& out_albedo, Color& attenuation, Ray& scattered, bool& scatter, bool& emit) const override {
-
-        out_albedo = Color(1.0, 1.0, 1.0);
-        attenuation = Color(1.0, 1.0, 1.0);
-        double ri = rec.front_face ? (1.0 / refractive_index) : refractive_index;
-
-        Vec3 unit_direction = normalize(r_in.direction());
-        double cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
-        double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
-
-        bool cannot_refract = ri * sin_theta > 1.0;
-        Vec3 direction;
-
-        if (cannot_refract || reflectance(cos_theta, ri) > random_double())
-            direction = reflect(unit_direction, rec.normal);
-        else
-            direction = refract(unit_direction, rec.normal, ri);
-
-        scattered = Ray(rec.hitPoint, direction);
-        scatter = true;
-        emit = false;
-    }
-private:
-    static double reflectance(double cosine, double refraction_index) {
-        // Use Schlick's approximation for reflectance.
-        auto r0 = (1 - refraction_index) / (1 + refraction_index);
-        r0 = r0 * r0;
-        return r0 + (1 - r0) * std::pow((1 - cosine), 5);
+    bool Compact(CompactMaterial& compact) const override {
+        compact.type = MaterialType::Dielectric;
+        compact.value = refractive_index;
+        return true;
     }
 
 };
@@ -115,11 +300,11 @@ private:
 public:
     Emission(Color emit_color, double intensity) : emit_color(emit_color), intensity(intensity) {}
 
-    void fall(const Ray& r_in, const HitRecord& rec, Color& out_albedo, Color& attenuation, Ray& scattered, bool& scatter, bool& emit) const override {
-        attenuation = intensity * emit_color;
-        out_albedo = emit_color;
-        scatter = false;
-        emit = true;
+    bool Compact(CompactMaterial& compact) const override {
+        compact.type = MaterialType::Emission;
+        compact.color = emit_color;
+        compact.value = intensity;
+        return true;
     }
 
 
@@ -130,4 +315,4 @@ inline std::shared_ptr<Material> MakeEmission(Color emit_color, double intensity
 }
 
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,224 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <utility>
+
+#include "Vec3.h"
+#include "Ray.h"
+#include "Interval.h"
+#include "AABB.h"
+#include "BVH.h"
+#include "Object.h"
+
+// Per-ray constants of the watertight ray/triangle test (Woop, Benthin and Wald 2013):
+// the ray is sheared so it points down +z, which makes edge tests exact in sign and
+// guarantees that rays through shared edges and vertices hit exactly one triangle.
+class WatertightRay {
+public:
+    int kx, ky, kz;
+    real sx, sy, sz;
+
+    WatertightRay(const Ray& r) {
+        const Vec3& d = r.direction();
+        kz = std::fabs(d.x()) > std::fabs(d.y())
+            ? (std::fabs(d.x()) > std::fabs(d.z()) ? 0 : 2)
+            : (std::fabs(d.y()) > std::fabs(d.z()) ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        if (d[kz] < 0) std::swap(kx, ky);   // Keep the winding order
+        sx = d[kx] / d[kz];
+        sy = d[ky] / d[kz];
+        sz = 1 / d[kz];
+    }
+};
+
+// Indexed triangle mesh: vertices and normals live in shared arrays, and every triangle
+// is three indices into them. The mesh carries its own BVH, so the scene sees it as a
+// single object however many triangles it has. That BVH is built on first use, normally
+// when the scene passes its BVH width on, so a mesh is never built at a width it drops.
+class TriangleMesh : public Object {
+public:
+    static constexpr uint32_t no_normal = 0xffffffffu;
+
+    // indices holds three position indices per triangle. normals may be empty (flat
+    // shading), indexed by the same indices as the positions when normal_indices is empty,
+    // or indexed separately through normal_indices (one entry per corner, no_normal for
+    // corners without one).
+    // bvh_width is the children per node of the mesh's BVH, 2, 4 or 8 (see BVH).
+    TriangleMesh(std::vector<Point3> positions, std::vector<uint32_t> indices, std::shared_ptr<Material> mat,
+        std::vector<Vec3> normals = {}, std::vector<uint32_t> normal_indices = {}, int bvh_width = 8)
+        : positions(std::move(positions)), indices(std::move(indices)),
+          normals(std::move(normals)), normal_indices(std::move(normal_indices)) {
+        this->mat = std::move(mat);
+        bvh.width = bvh_width;
+        for (uint32_t index : this->indices)
+            box.expand(this->positions[index]);
+    }
+
+    size_t triangle_count() const { return indices.size() / 3; }
+    size_t vertex_count() const { return positions.size(); }
+
+    // Bytes held by the geometry and its BVH.
+    size_t memory_usage() const {
+        return positions.capacity() * sizeof(Point3) + normals.capacity() * sizeof(Vec3)
+            + indices.capacity() * sizeof(uint32_t) + normal_indices.capacity() * sizeof(uint32_t)
+            + bvh.memory_usage();
+    }
+
+    bool RayHit(const Ray& r, HitRecord& hit, Interval ray_t = Interval::Universe) override {
+        // Scene::BuildBVH has built it before any rays are traced; this covers meshes used
+        // on their own.
+        if (!bvh_built)
+            buildBVH();
+
+        WatertightRay wr(r);
+        int hit_triangle = -1;
+        real hit_t = 0, hit_b0 = 0, hit_b1 = 0, hit_b2 = 0;
+
+        bvh.Traverse(r, ray_t, [&](int tri, Interval& t) {
+            real t_hit, b0, b1, b2;
+            if (!intersectTriangle(r, wr, tri, t, t_hit, b0, b1, b2))
+                return false;
+            t.max = t_hit;
+            hit_triangle = tri;
+            hit_t = t_hit;
+            hit_b0 = b0;
+            hit_b1 = b1;
+            hit_b2 = b2;
+            return true;
+            });
+        if (hit_triangle < 0)
+            return false;
+
+        const uint32_t* tri = &indices[3 * size_t(hit_triangle)];
+        const Point3& p0 = positions[tri[0]];
+        const Point3& p1 = positions[tri[1]];
+        const Point3& p2 = positions[tri[2]];
+
+        // The hit point from the barycentrics lies on the triangle, unlike o + t*d.
+        hit.t = hit_t;
+        hit.hitPoint = hit_b0 * p0 + hit_b1 * p1 + hit_b2 * p2;
+        hit.p_error = error_gamma<real>(7) * (component_abs(hit_b0 * p0) + component_abs(hit_b1 * p1)
+            + component_abs(hit_b2 * p2));
+
+        Vec3 geometric_normal = normalize(cross(p1 - p0, p2 - p0));
+        Vec3 outward_normal = geometric_normal;
+        if (!normals.empty()) {
+            const uint32_t* ni = normal_indices.empty() ? tri : &normal_indices[3 * size_t(hit_triangle)];
+            if (ni[0] != no_normal && ni[1] != no_normal && ni[2] != no_normal) {
+                Vec3 shading = hit_b0 * normals[ni[0]] + hit_b1 * normals[ni[1]] + hit_b2 * normals[ni[2]];
+                if (!shading.near_zero()) {
+                    shading = normalize(shading);
+                    // Keep the shading normal on the geometric normal's side.
+                    outward_normal = dot(shading, geometric_normal) < 0 ? -shading : shading;
+                }
+            }
+        }
+
+        hit.front_face = dot(r.direction(), geometric_normal) < 0;
+        hit.normal = hit.front_face ? outward_normal : -outward_normal;
+        hit.mat_id = mat_id;
+        return true;
+    }
+
+    AABB BoundingBox() const override {
+        return box;
+    }
+
+    void SetBVHWidth(int width) override {
+        if (bvh_built && width == bvh.width)
+            return;
+        bvh.width = width;
+        buildBVH();
+    }
+
+private:
+    std::vector<Point3> positions;
+    std::vector<uint32_t> indices;
+    std::vector<Vec3> normals;
+    std::vector<uint32_t> normal_indices;
+    AABB box;
+    BVH bvh;
+    bool bvh_built = false;
+
+    void buildBVH() {
+        size_t count = triangle_count();
+        std::vector<AABB> bounds(count);
+        for (size_t i = 0; i < count; i++) {
+            const uint32_t* tri = &indices[3 * i];
+            bounds[i] = AABB(positions[tri[0]], positions[tri[1]]);
+            bounds[i].expand(positions[tri[2]]);
+        }
+        bvh_built = bvh.Build(bounds);
+        bounds = std::vector<AABB>();
+        if (!bvh_built)
+            return;
+
+        // Store the triangles in leaf order.
+        const std::vector<int>& order = bvh.primitive_order();
+        std::vector<uint32_t> ordered(indices.size());
+        for (size_t i = 0; i < count; i++) {
+            for (int k = 0; k < 3; k++)
+                ordered[3 * i + k] = indices[3 * size_t(order[i]) + k];
+        }
+        indices.swap(ordered);
+        if (!normal_indices.empty()) {
+            for (size_t i = 0; i < count; i++) {
+                for (int k = 0; k < 3; k++)
+                    ordered[3 * i + k] = normal_indices[3 * size_t(order[i]) + k];
+            }
+            normal_indices.swap(ordered);
+        }
+    }
+
+    bool intersectTriangle(const Ray& r, const WatertightRay& wr, int triangle, Interval ray_t,
+        real& t_hit, real& b0, real& b1, real& b2) const {
+        const uint32_t* tri = &indices[3 * size_t(triangle)];
+        Vec3 a = positions[tri[0]] - r.origin();
+        Vec3 b = positions[tri[1]] - r.origin();
+        Vec3 c = positions[tri[2]] - r.origin();
+
+        real ax = a[wr.kx] - wr.sx * a[wr.kz];
+        real ay = a[wr.ky] - wr.sy * a[wr.kz];
+        real bx = b[wr.kx] - wr.sx * b[wr.kz];
+        real by = b[wr.ky] - wr.sy * b[wr.kz];
+        real cx = c[wr.kx] - wr.sx * c[wr.kz];
+        real cy = c[wr.ky] - wr.sy * c[wr.kz];
+
+        // Scaled barycentrics: signed areas of the sub-triangles seen along the ray.
+        real u = cx * by - cy * bx;
+        real v = ax * cy - ay * cx;
+        real w = bx * ay - by * ax;
+        if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+            return false;
+
+        real det = u + v + w;
+        if (det == 0)
+            return false;
+
+        real az = wr.sz * a[wr.kz];
+        real bz = wr.sz * b[wr.kz];
+        real cz = wr.sz * c[wr.kz];
+        real t = (u * az + v * bz + w * cz) / det;
+        if (!ray_t.surrounds(t))
+            return false;
+
+        t_hit = t;
+        b0 = u / det;
+        b1 = v / det;
+        b2 = w / det;
+        return true;
+    }
+};
+
+inline std::shared_ptr<TriangleMesh> MakeMesh(std::vector<Point3> positions, std::vector<uint32_t> indices,
+    std::shared_ptr<Material> mat, std::vector<Vec3> normals = {}, std::vector<uint32_t> normal_indices = {},
+    int bvh_width = 8) {
+    return std::make_shared<TriangleMesh>(std::move(positions), std::move(indices), std::move(mat),
+        std::move(normals), std::move(normal_indices), bvh_width);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,463 @@
+#ifndef MESH_LOADER_H
+#define MESH_LOADER_H
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <charconv>
+#include <algorithm>
+#include <filesystem>
+
+#include "Vec3.h"
+#include "Material.h"
+#include "Mesh.h"
+#include "MappedFile.h"
+
+namespace fs = std::filesystem;
+
+// Loaders for triangle meshes. Files are memory mapped and parsed in place; vertex and index
+// arrays are reserved from a counting pass, and polygons are fan-triangulated while they are
+// read, so nothing is allocated per triangle. All loaders print the reason and return nullptr
+// on failure.
+
+namespace mesh_loader {
+
+    inline bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    inline const char* skip_spaces(const char* p, const char* end) {
+        while (p < end && is_space(*p)) p++;
+        return p;
+    }
+
+    inline const char* next_line(const char* p, const char* end) {
+        const char* newline = static_cast<const char*>(std::memchr(p, '\n', size_t(end - p)));
+        return newline ? newline + 1 : end;
+    }
+
+    inline bool parse_double(const char*& p, const char* end, double& value) {
+        p = skip_spaces(p, end);
+        if (p < end && *p == '+') p++;
+        auto result = std::from_chars(p, end, value);
+        if (result.ec != std::errc()) return false;
+        p = result.ptr;
+        return true;
+    }
+
+    inline bool parse_int(const char*& p, const char* end, long long& value) {
+        auto result = std::from_chars(p, end, value);
+        if (result.ec != std::errc()) return false;
+        p = result.ptr;
+        return true;
+    }
+
+    // OBJ indices are 1-based, negative ones count back from the last element read so far.
+    inline bool resolve_index(long long index, size_t count, uint32_t& resolved) {
+        long long i = index > 0 ? index - 1 : (long long)count + index;
+        if (index == 0 || i < 0 || i >= (long long)count) return false;
+        resolved = uint32_t(i);
+        return true;
+    }
+
+    enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64, Invalid };
+
+    inline PlyType ply_type(const std::string& name) {
+        if (name == "char" || name == "int8") return PlyType::Int8;
+        if (name == "uchar" || name == "uint8") return PlyType::UInt8;
+        if (name == "short" || name == "int16") return PlyType::Int16;
+        if (name == "ushort" || name == "uint16") return PlyType::UInt16;
+        if (name == "int" || name == "int32") return PlyType::Int32;
+        if (name == "uint" || name == "uint32") return PlyType::UInt32;
+        if (name == "float" || name == "float32") return PlyType::Float32;
+        if (name == "double" || name == "float64") return PlyType::Float64;
+        return PlyType::Invalid;
+    }
+
+    inline int ply_size(PlyType type) {
+        switch (type) {
+        case PlyType::Int8: case PlyType::UInt8: return 1;
+        case PlyType::Int16: case PlyType::UInt16: return 2;
+        case PlyType::Int32: case PlyType::UInt32: case PlyType::Float32: return 4;
+        case PlyType::Float64: return 8;
+        default: return 0;
+        }
+    }
+
+    template <typename T>
+    inline T load(const char* p, bool swap) {
+        char bytes[sizeof(T)];
+        std::memcpy(bytes, p, sizeof(T));
+        if (swap) std::reverse(bytes, bytes + sizeof(T));
+        T value;
+        std::memcpy(&value, bytes, sizeof(T));
+        return value;
+    }
+
+    inline double load_ply(const char* p, PlyType type, bool swap) {
+        switch (type) {
+        case PlyType::Int8: return load<int8_t>(p, swap);
+        case PlyType::UInt8: return load<uint8_t>(p, swap);
+        case PlyType::Int16: return load<int16_t>(p, swap);
+        case PlyType::UInt16: return load<uint16_t>(p, swap);
+        case PlyType::Int32: return load<int32_t>(p, swap);
+        case PlyType::UInt32: return load<uint32_t>(p, swap);
+        case PlyType::Float32: return load<float>(p, swap);
+        case PlyType::Float64: return load<double>(p, swap);
+        default: return 0;
+        }
+    }
+
+    class PlyProperty {
+    public:
+        std::string name;
+        PlyType type = PlyType::Invalid;
+        PlyType count_type = PlyType::Invalid;  // Set for list properties only
+        bool is_list() const { return count_type != PlyType::Invalid; }
+    };
+
+    class PlyElement {
+    public:
+        std::string name;
+        size_t count = 0;
+        std::vector<PlyProperty> properties;
+
+        int find(const char* property) const {
+            for (size_t i = 0; i < properties.size(); i++)
+                if (properties[i].name == property) return int(i);
+            return -1;
+        }
+
+        // Byte size of one record, or 0 if it holds lists and varies per record.
+        int fixed_stride() const {
+            int stride = 0;
+            for (const PlyProperty& prop : properties) {
+                if (prop.is_list()) return 0;
+                stride += ply_size(prop.type);
+            }
+            return stride;
+        }
+    };
+
+    inline bool host_is_little_endian() {
+        uint16_t one = 1;
+        unsigned char first;
+        std::memcpy(&first, &one, 1);
+        return first == 1;
+    }
+}
+
+inline std::shared_ptr<TriangleMesh> LoadOBJ(const fs::path& path, std::shared_ptr<Material> mat) {
+    using namespace mesh_loader;
+
+    MappedFile file;
+    if (!file.Open(path)) {
+        std::cerr << "Failed to open " << path.string() << std::endl;
+        return nullptr;
+    }
+    const char* begin = file.data();
+    const char* end = begin + file.size();
+
+    // Counting pass, so the arrays are allocated once.
+    size_t vertex_count = 0, normal_count = 0, face_count = 0;
+    for (const char* p = begin; p < end; p = next_line(p, end)) {
+        p = skip_spaces(p, end);
+        if (end - p < 2) continue;
+        if (p[0] == 'v' && is_space(p[1])) vertex_count++;
+        else if (p[0] == 'v' && p[1] == 'n') normal_count++;
+        else if (p[0] == 'f' && is_space(p[1])) face_count++;
+    }
+
+    std::vector<Point3> positions;
+    std::vector<Vec3> normals;
+    std::vector<uint32_t> indices, normal_indices;
+    positions.reserve(vertex_count);
+    normals.reserve(normal_count);
+    indices.reserve(3 * face_count);
+    normal_indices.reserve(normal_count > 0 ? 3 * face_count : 0);
+    bool has_normal_refs = false;
+
+    size_t line_number = 0;
+    for (const char* line = begin, *line_end; line < end; line = line_end) {
+        line_number++;
+        line_end = next_line(line, end);
+        const char* p = skip_spaces(line, line_end);
+        if (line_end - p < 2) continue;
+
+        if (p[0] == 'v' && (is_space(p[1]) || p[1] == 'n')) {
+            bool is_normal = p[1] == 'n';
+            p += is_normal ? 2 : 1;
+            double x, y, z;
+            if (!parse_double(p, line_end, x) || !parse_double(p, line_end, y) || !parse_double(p, line_end, z)) {
+                std::cerr << path.string() << ":" << line_number << ": malformed vertex" << std::endl;
+                return nullptr;
+            }
+            if (is_normal) normals.emplace_back(x, y, z);
+            else positions.emplace_back(x, y, z);
+        }
+        else if (p[0] == 'f' && is_space(p[1])) {
+            p++;
+            // Fan triangulation: every corner after the second closes a triangle with the
+            // first corner and the previous one.
+            uint32_t first[2] = {}, previous[2] = {};
+            int corners = 0;
+            while (true) {
+                p = skip_spaces(p, line_end);
+                if (p >= line_end || *p == '\n' || *p == '#') break;
+
+                long long v, vn = 0;
+                uint32_t corner[2] = { 0, TriangleMesh::no_normal };
+                if (!parse_int(p, line_end, v) || !resolve_index(v, positions.size(), corner[0])) {
+                    std::cerr << path.string() << ":" << line_number << ": bad face index" << std::endl;
+                    return nullptr;
+                }
+                if (p < line_end && *p == '/') {
+                    p++;
+                    long long vt;
+                    if (p < line_end && *p != '/') parse_int(p, line_end, vt);  // Texture coordinates are not used
+                    if (p < line_end && *p == '/') {
+                        p++;
+                        if (!parse_int(p, line_end, vn) || !resolve_index(vn, normals.size(), corner[1])) {
+                            std::cerr << path.string() << ":" << line_number << ": bad normal index" << std::endl;
+                            return nullptr;
+                        }
+                        has_normal_refs = true;
+                    }
+                }
+
+                if (corners == 0) {
+                    first[0] = corner[0];
+                    first[1] = corner[1];
+                }
+                else if (corners >= 2) {
+                    indices.push_back(first[0]);
+                    indices.push_back(previous[0]);
+                    indices.push_back(corner[0]);
+                    normal_indices.push_back(first[1]);
+                    normal_indices.push_back(previous[1]);
+                    normal_indices.push_back(corner[1]);
+                }
+                previous[0] = corner[0];
+                previous[1] = corner[1];
+                corners++;
+            }
+        }
+    }
+
+    if (indices.empty()) {
+        std::cerr << path.string() << ": no faces" << std::endl;
+        return nullptr;
+    }
+    if (!has_normal_refs) {
+        normals = std::vector<Vec3>();
+        normal_indices = std::vector<uint32_t>();
+    }
+    return MakeMesh(std::move(positions), std::move(indices), std::move(mat),
+        std::move(normals), std::move(normal_indices));
+}
+
+inline std::shared_ptr<TriangleMesh> LoadPLY(const fs::path& path, std::shared_ptr<Material> mat) {
+    using namespace mesh_loader;
+
+    MappedFile file;
+    if (!file.Open(path)) {
+        std::cerr << "Failed to open " << path.string() << std::endl;
+        return nullptr;
+    }
+    const char* p = file.data();
+    const char* end = p + file.size();
+
+    auto fail = [&](const char* reason) {
+        std::cerr << path.string() << ": " << reason << std::endl;
+        return nullptr;
+    };
+
+    // Header: plain text lines up to "end_header".
+    if (end - p < 4 || std::strncmp(p, "ply", 3) != 0)
+        return fail("not a PLY file");
+
+    std::vector<PlyElement> elements;
+    bool big_endian = false;
+    bool header_done = false;
+    while (p < end && !header_done) {
+        const char* line_end = next_line(p, end);
+        std::string line(p, line_end);
+        p = line_end;
+        while (!line.empty() && (line.back() == '\n' || line.back() == '\r')) line.pop_back();
+
+        std::vector<std::string> words;
+        size_t pos = 0;
+        while (pos < line.size()) {
+            size_t start = line.find_first_not_of(" \t", pos);
+            if (start == std::string::npos) break;
+            size_t stop = line.find_first_of(" \t", start);
+            if (stop == std::string::npos) stop = line.size();
+            words.push_back(line.substr(start, stop - start));
+            pos = stop;
+        }
+        if (words.empty()) continue;
+
+        if (words[0] == "format") {
+            if (words.size() < 2) return fail("malformed format line");
+            if (words[1] == "binary_little_endian") big_endian = false;
+            else if (words[1] == "binary_big_endian") big_endian = true;
+            else return fail("only binary PLY files are supported");
+        }
+        else if (words[0] == "element") {
+            if (words.size() < 3) return fail("malformed element line");
+            PlyElement element;
+            element.name = words[1];
+            element.count = std::strtoull(words[2].c_str(), nullptr, 10);
+            elements.push_back(element);
+        }
+        else if (words[0] == "property") {
+            if (elements.empty()) return fail("property outside of an element");
+            PlyProperty prop;
+            if (words.size() >= 5 && words[1] == "list") {
+                prop.count_type = ply_type(words[2]);
+                prop.type = ply_type(words[3]);
+                prop.name = words[4];
+                if (prop.count_type == PlyType::Invalid) return fail("unknown property type");
+            }
+            else if (words.size() >= 3) {
+                prop.type = ply_type(words[1]);
+                prop.name = words[2];
+            }
+            if (prop.type == PlyType::Invalid) return fail("unknown property type");
+            elements.back().properties.push_back(prop);
+        }
+        else if (words[0] == "end_header") {
+            header_done = true;
+        }
+    }
+    if (!header_done) return fail("missing end_header");
+
+    bool swap = big_endian == host_is_little_endian();
+    std::vector<Point3> positions;
+    std::vector<Vec3> normals;
+    std::vector<uint32_t> indices;
+
+    for (const PlyElement& element : elements) {
+        int stride = element.fixed_stride();
+
+        if (element.name == "vertex") {
+            int px = element.find("x"), py = element.find("y"), pz = element.find("z");
+            int nx = element.find("nx"), ny = element.find("ny"), nz = element.find("nz");
+            if (px < 0 || py < 0 || pz < 0) return fail("vertex element without x, y, z");
+            if (stride == 0) return fail("list properties on vertices are not supported");
+            bool has_normals = nx >= 0 && ny >= 0 && nz >= 0;
+
+            int offsets[6] = {};
+            for (int i = 0, offset = 0; i < int(element.properties.size()); i++) {
+                if (i == px) offsets[0] = offset;
+                if (i == py) offsets[1] = offset;
+                if (i == pz) offsets[2] = offset;
+                if (i == nx) offsets[3] = offset;
+                if (i == ny) offsets[4] = offset;
+                if (i == nz) offsets[5] = offset;
+                offset += ply_size(element.properties[i].type);
+            }
+            PlyType tx = element.properties[px].type, ty = element.properties[py].type, tz = element.properties[pz].type;
+
+            if (size_t(end - p) / size_t(stride) < element.count) return fail("truncated vertex data");
+            positions.reserve(element.count);
+            if (has_normals) normals.reserve(element.count);
+            for (size_t i = 0; i < element.count; i++, p += stride) {
+                positions.emplace_back(load_ply(p + offsets[0], tx, swap),
+                    load_ply(p + offsets[1], ty, swap), load_ply(p + offsets[2], tz, swap));
+                if (has_normals) {
+                    normals.emplace_back(load_ply(p + offsets[3], element.properties[nx].type, swap),
+                        load_ply(p + offsets[4], element.properties[ny].type, swap),
+                        load_ply(p + offsets[5], element.properties[nz].type, swap));
+                }
+            }
+        }
+        else if (element.name == "face") {
+            int list = element.find("vertex_indices");
+            if (list < 0) list = element.find("vertex_index");
+            if (list < 0 || !element.properties[list].is_list()) return fail("face element without vertex_indices");
+
+            // Most files hold triangles only; reserve for that and let larger polygons grow it.
+            indices.reserve(3 * element.count);
+            for (size_t f = 0; f < element.count; f++) {
+                for (int i = 0; i < int(element.properties.size()); i++) {
+                    const PlyProperty& prop = element.properties[i];
+                    int size = ply_size(prop.type);
+                    if (!prop.is_list()) {
+                        if (end - p < size) return fail("truncated face data");
+                        p += size;
+                        continue;
+                    }
+
+                    int count_size = ply_size(prop.count_type);
+                    if (end - p < count_size) return fail("truncated face data");
+                    double count_value = load_ply(p, prop.count_type, swap);
+                    p += count_size;
+                    if (count_value < 0) return fail("negative list length");
+                    size_t count = size_t(count_value);
+                    if (size_t(end - p) / size_t(size) < count) return fail("truncated face data");
+
+                    if (i == list) {
+                        uint32_t first = 0, previous = 0;
+                        for (size_t k = 0; k < count; k++) {
+                            double index = load_ply(p + k * size, prop.type, swap);
+                            if (index < 0 || index >= double(positions.size())) return fail("face index out of range");
+                            uint32_t corner = uint32_t(index);
+                            if (k == 0) first = corner;
+                            else if (k >= 2) {
+                                indices.push_back(first);
+                                indices.push_back(previous);
+                                indices.push_back(corner);
+                            }
+                            previous = corner;
+                        }
+                    }
+                    p += count * size;
+                }
+            }
+        }
+        else {
+            // Skip elements we do not use.
+            if (stride > 0) {
+                if (size_t(end - p) / size_t(stride) < element.count) return fail("truncated data");
+                p += element.count * stride;
+                continue;
+            }
+            for (size_t e = 0; e < element.count; e++) {
+                for (const PlyProperty& prop : element.properties) {
+                    if (!prop.is_list()) {
+                        p += ply_size(prop.type);
+                        continue;
+                    }
+                    if (end - p < ply_size(prop.count_type)) return fail("truncated data");
+                    size_t count = size_t(load_ply(p, prop.count_type, swap));
+                    p += ply_size(prop.count_type) + count * ply_size(prop.type);
+                }
+                if (p > end) return fail("truncated data");
+            }
+        }
+    }
+
+    if (indices.empty()) return fail("no faces");
+    return MakeMesh(std::move(positions), std::move(indices), std::move(mat), std::move(normals));
+}
+
+// Picks the loader from the file extension.
+inline std::shared_ptr<TriangleMesh> LoadMesh(const fs::path& path, std::shared_ptr<Material> mat) {
+    std::string extension = path.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+        [](unsigned char c) { return char(std::tolower(c)); });
+    if (extension == ".obj")
+        return LoadOBJ(path, std::move(mat));
+    if (extension == ".ply")
+        return LoadPLY(path, std::move(mat));
+    std::cerr << "Unsupported mesh format: " << path.string() << std::endl;
+    return nullptr;
+}
+
+#endif
\ No newline at end of file
@@ -5,10 +5,13 @@
 #include <limits.h>
 
 #include "Vec3.h"
+#include "Warp.h"
 #include "Ray.h"
 #include "Scene.h"
 #include "Interval.h"
+#include "AABB.h"
 #include "Utils.h"
+#include "SphereSoA.h"
 
 class Material;
 
@@ -16,44 +19,81 @@ class HitRecord {
 public:
     Point3 hitPoint;
     Vec3 normal;
-    double t;
+    Vec3 p_error;   // Bound on the absolute error of hitPoint, per axis
+    real t;
     bool front_face;
-    std::shared_ptr<Material> mat;
+    int mat_id;     // Index into the material table of the Scene the object belongs to
+    int object_id;  // Position of the hit object in the Scene, filled in by Scene::Intersect
 };
 
+// Origin for a ray leaving the surface at rec in direction dir: hitPoint pushed along the
+// normal, to the side dir leaves on, just far enough that the rounding error in hitPoint
+// cannot put it back behind the surface. The margin for one more rounding covers the
+// addition of the offset itself.
+inline Point3 offset_ray_origin(const HitRecord& rec, const Vec3& dir) {
+    Vec3 error = rec.p_error + error_gamma<real>(1) * component_abs(rec.hitPoint);
+    real d = dot(component_abs(rec.normal), error);
+    return rec.hitPoint + (dot(dir, rec.normal) < 0 ? -d : d) * rec.normal;
+}
+
 class Object {
 public:
+    virtual ~Object() = default;
+
     virtual bool RayHit(const Ray& r, HitRecord& hit, Interval ray_t = Interval::Universe) = 0;
+    virtual AABB BoundingBox() const = 0;
+
+    // Light sampling support: picks a unit direction from origin towards the object, by the
+    // point u in [0, 1)^2 (u.x, u.y), and returns its solid angle density. Objects that cannot
+    // be sampled return false and are then only found by scattered rays.
+    virtual bool SampleDirection(const Point3& origin, const Vec3& u, Vec3& direction, double& pdf) const {
+        return false;
+    }
+
+    // Solid angle density of SampleDirection choosing direction from origin.
+    virtual double DirectionPdf(const Point3& origin, const Vec3& direction) const {
+        return 0;
+    }
+
+    // Objects with an acceleration structure of their own (meshes) build it with width
+    // children per node. The scene passes its bvh_width on when it builds its BVH.
+    virtual void SetBVHWidth(int /*width*/) {}
+
+    const std::shared_ptr<Material>& GetMaterial() const { return mat; }
+    int GetMaterialId() const { return mat_id; }
+    void SetMaterialId(int id) { mat_id = id; }
+
+protected:
+    // The object keeps its material alive, but hits only carry mat_id so the
+    // intersection path never touches a reference count.
+    std::shared_ptr<Material> mat;
+    int mat_id = 0;
 };
 
 class Sphere : public Object {
 private:
     Vec3 center;
-    double radius;
-    std::shared_ptr<Material> mat;
+    real radius;
 
 public:
-    Sphere(const Vec3& center, double radius, std::shared_ptr<Material> mat) : center(center), radius(std::fmax(0, radius)), mat(mat) {};
+    Sphere(const Vec3& center, real radius, std::shared_ptr<Material> mat) : center(center), radius(std::fmax(real(0), radius)) {
+        this->mat = std::move(mat);
+    };
+
+    const Point3& GetCenter() const { return center; }
+    real GetRadius() const { return radius; }
 
     bool RayHit(const Ray& r, HitRecord& hit, Interval ray_t = Interval::Universe) {
-        Vec3 oc = center - r.origin();
-        auto a = r.direction().length_squared();
-        auto h = dot(r.direction(), oc);
-        auto c = dot(oc, oc) - radius * radius;
-        auto discriminant = h * h - a * c;
-        if (discriminant < 0) return false;
-        double sqrtd = std::sqrt(discriminant);
-
-        double root = (h - sqrtd) / a;
-        if (!ray_t.surrounds(root)) {
-            root = (h + sqrtd) / a;
-            if (!ray_t.surrounds(root))
-                return false;
-        }
+        real root;
+        if (!intersect_sphere(center, radius, r, ray_t, root))
+            return false;
 
+        // Project o + t*d back onto the sphere along the normal, which leaves only a few
+        // roundings of error in the hit point however far along the ray it is.
         hit.t = root;
-        hit.hitPoint = r.at(hit.t);
-        Vec3 outward_normal = (hit.hitPoint - center) / radius;
+        Vec3 outward_normal = normalize(r.at(root) - center);
+        hit.hitPoint = center + radius * outward_normal;
+        hit.p_error = error_gamma<real>(5) * component_abs(hit.hitPoint);
         bool front_face;
         if (dot(r.direction(), outward_normal) > 0.0) {
             // ray is inside the sphere
@@ -66,15 +106,55 @@ public:
             front_face = true;
         }
         hit.front_face = front_face;
-        hit.mat = mat;
+        hit.mat_id = mat_id;
+
+
+        return true;
+    }
+
+    AABB BoundingBox() const override {
+        Vec3 r(radius, radius, radius);
+        return AABB(center - r, center + r);
+    }
 
+    bool SampleDirection(const Point3& origin, const Vec3& u, Vec3& direction, double& pdf) const override {
+        // Uniformly sample the cone of directions the sphere subtends at origin.
+        Vec3 to_center = center - origin;
+        double distance_squared = to_center.length_squared();
+        double one_minus_cos_max = coneOneMinusCosMax(distance_squared);
+        if (one_minus_cos_max <= 0)
+            return false;   // origin is inside the sphere
 
+        double cos_theta = 1 - double(u.x()) * one_minus_cos_max;
+        double sin_theta = std::sqrt(std::fmax(0.0, 1 - cos_theta * cos_theta));
+        double phi = 2 * pi * double(u.y());
+
+        Vec3 w = to_center / std::sqrt(distance_squared);
+        Vec3 t, v;
+        make_basis(w, t, v);
+
+        direction = (sin_theta * std::cos(phi)) * t + (sin_theta * std::sin(phi)) * v + cos_theta * w;
+        pdf = 1 / (2 * pi * one_minus_cos_max);
         return true;
     }
 
+    double DirectionPdf(const Point3& origin, const Vec3& direction) const override {
+        double one_minus_cos_max = coneOneMinusCosMax((center - origin).length_squared());
+        return one_minus_cos_max > 0 ? 1 / (2 * pi * one_minus_cos_max) : 0;
+    }
+
+private:
+    double coneOneMinusCosMax(double distance_squared) const {
+        // 1 - sqrt(1 - x) written as x / (1 + sqrt(1 - x)) so small, distant spheres do not cancel to 0.
+        double sin2_max = radius * radius / distance_squared;
+        if (sin2_max >= 1)
+            return 0;
+        return sin2_max / (1 + std::sqrt(1 - sin2_max));
+    }
+
 };
 
-inline std::shared_ptr<Object> MakeSphere(const Vec3& center, double radius, std::shared_ptr<Material> mat) {
+inline std::shared_ptr<Object> MakeSphere(const Vec3& center, real radius, std::shared_ptr<Material> mat) {
     return std::make_shared<Sphere>(center, radius, mat);
 }
 
@@ -0,0 +1,59 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+
+// splitmix64 finalizer, used to turn structured seeds (pixel indices, pass numbers)
+// into well distributed generator states.
+inline uint64_t mix_bits(uint64_t v) {
+    v += 0x9e3779b97f4a7c15ull;
+    v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ull;
+    v = (v ^ (v >> 27)) * 0x94d049bb133111ebull;
+    return v ^ (v >> 31);
+}
+
+// PCG32 (XSH-RR variant): 64 bits of state, 32-bit output, 2^63 selectable streams.
+class Pcg32 {
+public:
+    Pcg32() { seed(0x853c49e6748fea9bull, 0xda3e39cb94b95bdbull); }
+    Pcg32(uint64_t init_state, uint64_t stream) { seed(init_state, stream); }
+
+    void seed(uint64_t init_state, uint64_t stream = 1) {
+        state = 0;
+        inc = (stream << 1u) | 1u;
+        next_uint();
+        state += init_state;
+        next_uint();
+    }
+
+    uint32_t next_uint() {
+        uint64_t old_state = state;
+        state = old_state * 0x5851f42d4c957f2dull + inc;
+        uint32_t xorshifted = uint32_t(((old_state >> 18u) ^ old_state) >> 27u);
+        uint32_t rot = uint32_t(old_state >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+    }
+
+    double next_double() {
+        // Returns a random real in [0,1).
+        return next_uint() * 0x1p-32;
+    }
+
+private:
+    uint64_t state;
+    uint64_t inc;
+};
+
+// Each thread draws from its own generator, so sampling never touches shared state.
+inline Pcg32& thread_rng() {
+    thread_local Pcg32 rng;
+    return rng;
+}
+
+// Reseeds the calling thread's generator. The renderer calls this per pixel so that
+// images do not depend on how pixels were distributed over threads.
+inline void seed_thread_rng(uint64_t seed, uint64_t stream) {
+    thread_rng().seed(mix_bits(seed), stream);
+}
+
+#endif
\ No newline at end of file
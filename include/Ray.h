@@ -3,22 +3,25 @@
 
 #include "Vec3.h"
 
-class Ray {
+template <typename T>
+class RayT {
 public:
-    Ray() {}
+    RayT() {}
     // a+bt
-    Ray(const Point3& origin, const Vec3& direction) : orig(origin), dir(direction) {}
+    RayT(const Vec3T<T>& origin, const Vec3T<T>& direction) : orig(origin), dir(direction) {}
 
-    const Point3& origin() const { return orig; }
-    const Vec3& direction() const { return dir; }
+    const Vec3T<T>& origin() const { return orig; }
+    const Vec3T<T>& direction() const { return dir; }
 
-    Point3 at(double t) const {
+    Vec3T<T> at(T t) const {
         return orig + t * dir;
     }
 
 private:
-    Point3 orig;
-    Vec3 dir;
+    Vec3T<T> orig;
+    Vec3T<T> dir;
 };
 
-#endif
\ No newline at end of file
+using Ray = RayT<real>;
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include <cstdint>
+#include <cmath>
+#include <limits>
+
+#include "Vec3.h"
+#include "Ray.h"
+#include "AABB.h"
+#include "Simd.h"
+
+// Up to max_size rays that are traced through the BVH together, stored as one array per
+// component so that a box is tested against several of them per instruction. Meant for the
+// camera rays of neighbouring pixels, which mostly visit the same nodes.
+//
+// A packet is only traced as one when all its rays point into the same octant (Finish
+// checks). Every ray then takes the near child first at the same binary nodes, which is
+// what lets BVH::TraversePacket visit them in the order each ray would have visited them
+// alone, and the box test is AABB::RayHit's, operation for operation, so every ray finds
+// the same hit as it would alone.
+class RayPacket {
+public:
+    static constexpr int max_size = 16;
+
+    // Lane k of the arrays holds ray k. Lanes from size on are padding that never hits.
+    alignas(32) real origin[3][max_size];
+    alignas(32) real inv_dir[3][max_size];
+    alignas(32) real t_max[max_size];     // Closest hit so far, the far end of the ray
+    int size = 0;
+    bool dir_is_neg[3] = { false, false, false };
+
+    RayPacket() { Clear(); }
+
+    void Clear() {
+        for (int k = 0; k < max_size; k++) {
+            for (int axis = 0; axis < 3; axis++) {
+                origin[axis][k] = 0;
+                inv_dir[axis][k] = 0;
+            }
+            t_max[k] = -std::numeric_limits<real>::infinity();
+        }
+        size = 0;
+    }
+
+    // Adds r as the next lane and returns it. The packet must not be full.
+    int Add(const Ray& r, real ray_t_max) {
+        int lane = size++;
+        for (int axis = 0; axis < 3; axis++) {
+            origin[axis][lane] = r.origin()[axis];
+            inv_dir[axis][lane] = real(1.0 / r.direction()[axis]);
+        }
+        t_max[lane] = ray_t_max;
+        return lane;
+    }
+
+    // Call once all rays are added. Returns false if they point into different octants, in
+    // which case they have to be traced one by one. Otherwise works out the bounds of the
+    // whole packet that CanMiss culls against.
+    bool Finish() {
+        if (size == 0)
+            return false;
+        frustum = true;
+        for (int axis = 0; axis < 3; axis++) {
+            dir_is_neg[axis] = inv_dir[axis][0] < 0;
+            origin_min[axis] = origin_max[axis] = origin[axis][0];
+            inv_min[axis] = inv_max[axis] = inv_dir[axis][0];
+            for (int k = 1; k < size; k++) {
+                if ((inv_dir[axis][k] < 0) != dir_is_neg[axis])
+                    return false;
+                origin_min[axis] = std::fmin(origin_min[axis], origin[axis][k]);
+                origin_max[axis] = std::fmax(origin_max[axis], origin[axis][k]);
+                inv_min[axis] = std::fmin(inv_min[axis], inv_dir[axis][k]);
+                inv_max[axis] = std::fmax(inv_max[axis], inv_dir[axis][k]);
+            }
+            // An axis some ray runs parallel to has an infinite 1 / d, which the interval
+            // bounds cannot take, so the packet is then tested ray by ray only.
+            if (!std::isfinite(inv_min[axis]) || !std::isfinite(inv_max[axis]))
+                frustum = false;
+        }
+        return true;
+    }
+
+    // Whether the box is certainly missed by every ray, judged once for the whole packet
+    // from interval bounds on the origins and inverse directions (Boulos et al. 2006,
+    // "Geometric and Arithmetic Culling Methods for Entire Ray Packets"). Rounding is
+    // monotonic, so the bounds hold for every ray's own rounded slab distances.
+    bool CanMiss(const AABB& box, real t_min) const {
+        if (!frustum)
+            return false;
+        real near_t = t_min;
+        real far_t = std::numeric_limits<real>::infinity();
+        for (int axis = 0; axis < 3; axis++) {
+            real near_plane = dir_is_neg[axis] ? box.max[axis] : box.min[axis];
+            real far_plane = dir_is_neg[axis] ? box.min[axis] : box.max[axis];
+            // Smallest distance to the near plane and largest to the far one over all rays.
+            // Distances fall with the origin coordinate when the direction is positive and
+            // rise when it is negative; a magnitude grows with that of 1 / d.
+            real a = near_plane - (dir_is_neg[axis] ? origin_min[axis] : origin_max[axis]);
+            real near_lo = a * (a >= 0 ? inv_min[axis] : inv_max[axis]);
+            real b = far_plane - (dir_is_neg[axis] ? origin_max[axis] : origin_min[axis]);
+            real far_hi = b * (b >= 0 ? inv_max[axis] : inv_min[axis]);
+            near_t = near_lo > near_t ? near_lo : near_t;
+            far_t = far_hi < far_t ? far_hi : far_t;
+        }
+        return far_t < near_t;
+    }
+
+    // Bit k set for every ray k >= first that hits the box within [t_min, t_max[k]].
+    uint32_t HitMask(const AABB& box, real t_min, int first) const {
+        real near_plane[3], far_plane[3];
+        for (int axis = 0; axis < 3; axis++) {
+            near_plane[axis] = dir_is_neg[axis] ? box.max[axis] : box.min[axis];
+            far_plane[axis] = dir_is_neg[axis] ? box.min[axis] : box.max[axis];
+        }
+        uint32_t mask;
+        switch (simd_level()) {
+#if RT_SIMD_X86
+        case SimdLevel::AVX:
+            mask = hitMaskAVX(near_plane, far_plane, t_min, first);
+            break;
+        case SimdLevel::SSE2:
+            mask = hitMaskSSE2(near_plane, far_plane, t_min, first);
+            break;
+#endif
+        default:
+            mask = hitMaskScalar(near_plane, far_plane, t_min, first);
+            break;
+        }
+        return mask & ~((uint32_t(1) << first) - 1);
+    }
+
+private:
+    bool frustum = false;
+    real origin_min[3], origin_max[3];
+    real inv_min[3], inv_max[3];
+
+    // The slab test of AABB::RayHit with the swap folded into the choice of planes. The
+    // kernels below take the maximum and minimum with the operands in the order that keeps
+    // the old bound on a NaN, as RayHit does.
+    uint32_t hitMaskScalar(const real* near_plane, const real* far_plane, real t_min, int first) const {
+        uint32_t mask = 0;
+        for (int k = first; k < size; k++) {
+            real near_t = t_min;
+            real far_t = t_max[k];
+            for (int axis = 0; axis < 3; axis++) {
+                real t0 = (near_plane[axis] - origin[axis][k]) * inv_dir[axis][k];
+                real t1 = (far_plane[axis] - origin[axis][k]) * inv_dir[axis][k];
+                near_t = t0 > near_t ? t0 : near_t;
+                far_t = t1 < far_t ? t1 : far_t;
+            }
+            if (!(far_t < near_t))
+                mask |= uint32_t(1) << k;
+        }
+        return mask;
+    }
+
+#if RT_SIMD_X86
+#ifndef RT_SINGLE_PRECISION
+    uint32_t hitMaskSSE2(const real* near_plane, const real* far_plane, real t_min, int first) const {
+        uint32_t mask = 0;
+        for (int k = first & ~1; k < size; k += 2) {
+            __m128d near_t = _mm_set1_pd(t_min);
+            __m128d far_t = _mm_load_pd(&t_max[k]);
+            for (int axis = 0; axis < 3; axis++) {
+                __m128d o = _mm_load_pd(&origin[axis][k]);
+                __m128d inv = _mm_load_pd(&inv_dir[axis][k]);
+                __m128d t0 = _mm_mul_pd(_mm_sub_pd(_mm_set1_pd(near_plane[axis]), o), inv);
+                __m128d t1 = _mm_mul_pd(_mm_sub_pd(_mm_set1_pd(far_plane[axis]), o), inv);
+                near_t = _mm_max_pd(t0, near_t);
+                far_t = _mm_min_pd(t1, far_t);
+            }
+            mask |= uint32_t(_mm_movemask_pd(_mm_cmpge_pd(far_t, near_t))) << k;
+        }
+        return mask;
+    }
+
+    RT_TARGET_AVX uint32_t hitMaskAVX(const real* near_plane, const real* far_plane, real t_min, int first) const {
+        uint32_t mask = 0;
+        for (int k = first & ~3; k < size; k += 4) {
+            __m256d near_t = _mm256_set1_pd(t_min);
+            __m256d far_t = _mm256_load_pd(&t_max[k]);
+            for (int axis = 0; axis < 3; axis++) {
+                __m256d o = _mm256_load_pd(&origin[axis][k]);
+                __m256d inv = _mm256_load_pd(&inv_dir[axis][k]);
+                __m256d t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(near_plane[axis]), o), inv);
+                __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(far_plane[axis]), o), inv);
+                near_t = _mm256_max_pd(t0, near_t);
+                far_t = _mm256_min_pd(t1, far_t);
+            }
+            mask |= uint32_t(_mm256_movemask_pd(_mm256_cmp_pd(far_t, near_t, _CMP_GE_OQ))) << k;
+        }
+        return mask;
+    }
+#else
+    uint32_t hitMaskSSE2(const real* near_plane, const real* far_plane, real t_min, int first) const {
+        uint32_t mask = 0;
+        for (int k = first & ~3; k < size; k += 4) {
+            __m128 near_t = _mm_set1_ps(t_min);
+            __m128 far_t = _mm_load_ps(&t_max[k]);
+            for (int axis = 0; axis < 3; axis++) {
+                __m128 o = _mm_load_ps(&origin[axis][k]);
+                __m128 inv = _mm_load_ps(&inv_dir[axis][k]);
+                __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(near_plane[axis]), o), inv);
+                __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(far_plane[axis]), o), inv);
+                near_t = _mm_max_ps(t0, near_t);
+                far_t = _mm_min_ps(t1, far_t);
+            }
+            mask |= uint32_t(_mm_movemask_ps(_mm_cmpge_ps(far_t, near_t))) << k;
+        }
+        return mask;
+    }
+
+    RT_TARGET_AVX uint32_t hitMaskAVX(const real* near_plane, const real* far_plane, real t_min, int first) const {
+        uint32_t mask = 0;
+        for (int k = first & ~7; k < size; k += 8) {
+            __m256 near_t = _mm256_set1_ps(t_min);
+            __m256 far_t = _mm256_load_ps(&t_max[k]);
+            for (int axis = 0; axis < 3; axis++) {
+                __m256 o = _mm256_load_ps(&origin[axis][k]);
+                __m256 inv = _mm256_load_ps(&inv_dir[axis][k]);
+                __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(near_plane[axis]), o), inv);
+                __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(far_plane[axis]), o), inv);
+                near_t = _mm256_max_ps(t0, near_t);
+                far_t = _mm256_min_ps(t1, far_t);
+            }
+            mask |= uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(far_t, near_t, _CMP_GE_OQ))) << k;
+        }
+        return mask;
+    }
+#endif
+#endif
+};
+
+#endif
@@ -0,0 +1,252 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+#include <array>
+#include <algorithm>
+
+#include "Random.h"
+#include "Vec3.h"
+
+// Where the random numbers of a path come from.
+//   Independent  uniform numbers from the pixel's PCG stream, the plain Monte Carlo rate
+//   Sobol        Owen-scrambled Sobol points, scrambled independently per pixel and dimension
+//   ZSobol       the same points, but one sequence runs through the pixels in Morton order, so
+//                neighbouring pixels share its stratification and the error left in the image
+//                is blue noise rather than white (Ahmed and Wonka 2020)
+// The Sobol samplers use the first two Sobol dimensions for every pair of dimensions and
+// decorrelate the pairs by shuffling the sample index (Burley 2020, "Practical Hash-based
+// Owen Scrambling"), which keeps 2D stratification in every pair and needs no table of
+// direction numbers. Their error falls fastest at power-of-two sample counts.
+enum class SamplerType {
+    Independent,
+    Sobol,
+    ZSobol
+};
+
+// Which dimension each random decision of a path takes its numbers from. Every bounce has
+// a block of its own, so a decision gets the same dimension in every sample of a pixel,
+// whatever the path did before it.
+namespace sample_dim {
+    constexpr int pixel = 0;            // 2D: position within the pixel
+    constexpr int lens = 2;             // 2D: position on the defocus disk
+    constexpr int first_bounce = 4;
+    constexpr int per_bounce = 8;
+
+    // Offsets within a bounce's block
+    constexpr int bsdf = 0;             // 2D: scattered direction
+    constexpr int choices = 2;          // 2D: x reflect or refract, y Russian roulette
+    constexpr int light_choice = 4;     // 1D: which light to sample
+    constexpr int light = 5;            // 2D: direction towards the light
+
+    inline int Bounce(int bounce, int offset) {
+        return first_bounce + bounce * per_bounce + offset;
+    }
+}
+
+namespace sobol_detail {
+    inline uint32_t reverse_bits(uint32_t x) {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+        x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    // Sobol dimension 0 is the van der Corput sequence, reverse_bits(index).
+
+    // Sobol dimension 1, whose direction numbers are v[0] = 2^31, v[k] = v[k-1] ^ v[k-1] >> 1,
+    // returned with its bits reversed. The map is linear over GF(2), so it is four lookups of
+    // a byte each.
+    inline uint32_t sobol1_reversed(uint32_t index) {
+        static const std::array<std::array<uint32_t, 256>, 4> tables = []() {
+            std::array<std::array<uint32_t, 256>, 4> t{};
+            uint32_t v[32];
+            v[0] = 0x80000000u;
+            for (int k = 1; k < 32; k++)
+                v[k] = v[k - 1] ^ (v[k - 1] >> 1);
+            for (int byte = 0; byte < 4; byte++)
+                for (int value = 0; value < 256; value++)
+                    for (int bit = 0; bit < 8; bit++)
+                        if (value & (1 << bit))
+                            t[byte][value] ^= reverse_bits(v[8 * byte + bit]);
+            return t;
+        }();
+        return tables[0][index & 0xFF] ^ tables[1][(index >> 8) & 0xFF]
+            ^ tables[2][(index >> 16) & 0xFF] ^ tables[3][index >> 24];
+    }
+
+    // A hash in which every bit depends only on the bits below it (Laine and Karras, with
+    // Vegdahl's constants). Applied to bit-reversed values, where every bit then depends on
+    // the ones above it, it is a nested uniform (Owen) scramble:
+    //   owen_scramble(x) = reverse_bits(laine_karras(reverse_bits(x)))
+    // The samplers stay in the reversed domain where they can, which saves most reversals.
+    inline uint32_t laine_karras(uint32_t x, uint32_t seed) {
+        x ^= x * 0x3d20adeau;
+        x += seed;
+        x *= (seed >> 16) | 1;
+        x ^= x * 0x05526c56u;
+        x ^= x * 0x53a22864u;
+        return x;
+    }
+
+    // Interleaves the bits of x and y, x in the even positions.
+    inline uint64_t morton2(uint32_t x, uint32_t y) {
+        auto spread = [](uint64_t v) {
+            v &= 0xFFFFFFFFull;
+            v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+            v = (v | (v << 8)) & 0x00FF00FF00FF00FFull;
+            v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0Full;
+            v = (v | (v << 2)) & 0x3333333333333333ull;
+            v = (v | (v << 1)) & 0x5555555555555555ull;
+            return v;
+        };
+        return spread(x) | (spread(y) << 1);
+    }
+
+    inline double to_unit(uint32_t x) {
+        return x * 0x1p-32;
+    }
+}
+
+// Hands out the numbers of one pixel sample at a time. One sampler per rendering thread:
+// StartPixelSample picks the pixel and the index of the sample within it, and the Get
+// functions then return the same numbers for the same (pixel, index, dimension) whichever
+// thread asks, so images do not depend on how pixels were spread over threads.
+class Sampler {
+public:
+    Sampler(SamplerType type, uint64_t seed, int width, int height, int samples_per_pixel)
+        : type(type), seed(seed) {
+        // ZSobol gives each pixel a block of the next power of two samples at or above
+        // samples_per_pixel; samples past it start a new, independently scrambled block.
+        while ((1 << log2_samples) < samples_per_pixel && log2_samples < 20)
+            log2_samples++;
+        int resolution_log2 = 0;
+        while ((1 << resolution_log2) < std::max(width, height) && resolution_log2 < 16)
+            resolution_log2++;
+        base4_digits = resolution_log2 + (log2_samples + 1) / 2;
+    }
+
+    SamplerType Type() const {
+        return type;
+    }
+
+    void StartPixelSample(int i, int j, uint64_t pixel_index, uint64_t sample_index) {
+        uint64_t new_seed = pixel_seed;
+        if (type == SamplerType::Sobol) {
+            new_seed = mix_bits(seed ^ mix_bits(pixel_index));
+            index_reversed = sobol_detail::reverse_bits(uint32_t(sample_index));
+        }
+        else if (type == SamplerType::ZSobol) {
+            uint64_t block_mask = (uint64_t(1) << log2_samples) - 1;
+            uint64_t pixel_morton = sobol_detail::morton2(uint32_t(i), uint32_t(j)) << log2_samples;
+            new_seed = mix_bits(seed ^ mix_bits(sample_index >> log2_samples));
+            if (pixel_morton != (morton_index & ~block_mask))
+                cached_dimensions = 0;
+            morton_index = pixel_morton | (sample_index & block_mask);
+        }
+        if (new_seed != pixel_seed)
+            cached_dimensions = 0;
+        pixel_seed = new_seed;
+    }
+
+    // A number in [0, 1) for dimension.
+    double Get1D(int dimension) {
+        using namespace sobol_detail;
+        if (type == SamplerType::Independent)
+            return random_double();
+        uint64_t dimension_seed;
+        uint32_t shuffled = shuffledIndex(dimension, dimension_seed);
+        // The Owen scramble of sobol0(shuffled), whose reverse is shuffled itself
+        return to_unit(reverse_bits(laine_karras(shuffled, uint32_t(dimension_seed))));
+    }
+
+    // A point in [0, 1)^2 for dimensions dimension and dimension + 1, in x and y.
+    Vec3 Get2D(int dimension) {
+        using namespace sobol_detail;
+        if (type == SamplerType::Independent) {
+            double x = random_double();
+            return Vec3(x, random_double(), 0);
+        }
+        uint64_t dimension_seed;
+        uint32_t shuffled = shuffledIndex(dimension, dimension_seed);
+        return Vec3(to_unit(reverse_bits(laine_karras(shuffled, uint32_t(dimension_seed)))),
+            to_unit(reverse_bits(laine_karras(sobol1_reversed(shuffled), uint32_t(dimension_seed >> 32)))), 0);
+    }
+
+private:
+    SamplerType type;
+    uint64_t seed;
+    int log2_samples = 0;
+    int base4_digits = 0;
+    uint32_t index_reversed = 0;
+    uint64_t pixel_seed = 0;
+    uint64_t morton_index = ~uint64_t(0);
+
+    // What a dimension needs that is the same for all samples of a pixel: its seed and, for
+    // ZSobol, the digits of zDigits above the sample's. Kept for the first dimensions.
+    struct DimensionCache {
+        uint64_t seed;
+        uint64_t pixel_digits;
+    };
+    static constexpr int cached_dimension_count = 64;
+    uint64_t cached_dimensions = 0;     // Bit d set once cache[d] is filled in
+    DimensionCache cache[cached_dimension_count];
+
+    DimensionCache dimensionCache(int dimension) {
+        if (dimension < cached_dimension_count && (cached_dimensions >> dimension & 1))
+            return cache[dimension];
+        DimensionCache entry;
+        entry.seed = mix_bits(pixel_seed + uint64_t(dimension));
+        entry.pixel_digits = type == SamplerType::ZSobol
+            ? zDigits(entry.seed, (log2_samples + 1) / 2, base4_digits) : 0;
+        if (dimension < cached_dimension_count) {
+            cache[dimension] = entry;
+            cached_dimensions |= uint64_t(1) << dimension;
+        }
+        return entry;
+    }
+
+    // The sample index, permuted per dimension in a way that keeps every aligned
+    // power-of-two block of indices together, so each block stays stratified, and the seed
+    // that scrambles the dimension's output. Index bits past the 32 that reach the output are
+    // folded into that seed instead.
+    uint32_t shuffledIndex(int dimension, uint64_t& dimension_seed) {
+        DimensionCache entry = dimensionCache(dimension);
+        dimension_seed = entry.seed;
+        if (type == SamplerType::Sobol)
+            return sobol_detail::reverse_bits(sobol_detail::laine_karras(index_reversed,
+                uint32_t((dimension_seed * 0x9e3779b97f4a7c15ull) >> 32)));
+        uint64_t z = entry.pixel_digits | zDigits(dimension_seed, 0, (log2_samples + 1) / 2);
+        if (z >> 32)
+            dimension_seed ^= mix_bits(z >> 32);
+        return uint32_t(z);
+    }
+
+    // ZSobol: the Morton index of the sample, with every base 4 digit replaced through a
+    // permutation chosen by the digits above it and the dimension (pbrt-v4's ZSobolSampler).
+    // Pixels that share the high digits share a block of the sequence. Returns the digits
+    // [first, last); digit 0 is the lone base 2 digit when log2_samples is odd.
+    uint64_t zDigits(uint64_t dimension_key, int first, int last) const {
+        static const uint8_t permutations[24][4] = {
+            { 0, 1, 2, 3 }, { 0, 1, 3, 2 }, { 0, 2, 1, 3 }, { 0, 2, 3, 1 }, { 0, 3, 2, 1 }, { 0, 3, 1, 2 },
+            { 1, 0, 2, 3 }, { 1, 0, 3, 2 }, { 1, 2, 0, 3 }, { 1, 2, 3, 0 }, { 1, 3, 2, 0 }, { 1, 3, 0, 2 },
+            { 2, 1, 0, 3 }, { 2, 1, 3, 0 }, { 2, 0, 1, 3 }, { 2, 0, 3, 1 }, { 2, 3, 0, 1 }, { 2, 3, 1, 0 },
+            { 3, 1, 2, 0 }, { 3, 1, 0, 2 }, { 3, 2, 1, 0 }, { 3, 2, 0, 1 }, { 3, 0, 2, 1 }, { 3, 0, 1, 2 } };
+        bool odd = log2_samples & 1;
+        uint64_t result = 0;
+        for (int digit_index = std::max(first, odd ? 1 : 0); digit_index < last; digit_index++) {
+            int shift = 2 * digit_index - (odd ? 1 : 0);
+            int digit = int((morton_index >> shift) & 3);
+            uint64_t higher = morton_index >> (shift + 2);
+            int p = int((mix_bits(higher ^ dimension_key) >> 24) % 24);
+            result |= uint64_t(permutations[p][digit]) << shift;
+        }
+        // An odd power of two leaves one base 2 digit at the bottom.
+        if (odd && first == 0)
+            result |= (morton_index & 1) ^ (mix_bits((morton_index >> 1) ^ dimension_key) & 1);
+        return result;
+    }
+};
+
+#endif
@@ -1,16 +1,21 @@
 #ifndef SCENE_H
 #define SCENE_H
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
-
 #include <vector>
 #include <thread>
 #include <atomic>
 #include <mutex>
 #include <iomanip> // for std::setprecision
+#include <chrono>
 #include <filesystem>  // C++17
 #include <algorithm> 
+#include <unordered_map>
+#include <typeinfo>
+#include <string>
+#include <functional>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 
 namespace fs = std::filesystem;
 
@@ -20,7 +25,18 @@ namespace fs = std::filesystem;
 #include "Ray.h"
 #include "Object.h"
 #include "Material.h"
+#include "BVH.h"
+#include "RayPacket.h"
+#include "Tiles.h"
+#include "LightBVH.h"
+#include "SphereSoA.h"
 #include "Utils.h"
+#include "Checkpoint.h"
+#include "Socket.h"
+#include "Denoiser.h"
+#include "HdrImage.h"
+#include "ImageWriter.h"
+#include "Sampler.h"
 
 std::mutex console_mutex; // Global or static to protect console output
 
@@ -33,6 +49,113 @@ public:
     double depth;
 };
 
+// A camera ray's first intersection, when it was found ahead of the path by packet tracing.
+class PrimaryHit {
+public:
+    bool found = false;
+    HitRecord rec;
+};
+
+// Running sums of every sample a pixel has taken so far. The buffers hold sums rather than
+// means so more samples can be added in later passes. They stay in double in the single
+// precision build, where thousands of float additions would lose the low bits.
+class PixelSums {
+public:
+    Vec3d color;
+    Vec3d albedo;
+    Vec3d normal;
+    double depth = 0;
+    // First two moments of the tone mapped luminance, for estimating the pixel's noise.
+    double tone_sum = 0;
+    double tone_squared_sum = 0;
+    int samples = 0;
+
+    void Add(const PixelInfo& sample) {
+        color = color + Vec3d(sample.color);
+        albedo = albedo + Vec3d(sample.albedo);
+        normal = normal + Vec3d(sample.normal);
+        depth += sample.depth;
+        double l = luminance(sample.color);
+        double tone = l > 0 ? l / (1.0 + l) : 0;
+        tone_sum += tone;
+        tone_squared_sum += tone * tone;
+        samples++;
+    }
+
+    // Standard error of the pixel as displayed (tone mapped, then gamma 2).
+    double error() const {
+        if (samples < 2) return infinity;
+        double mean = tone_sum / samples;
+        double variance = std::max(0.0, (tone_squared_sum - samples * mean * mean) / (samples - 1));
+        // d sqrt(x) / dx = 1 / (2 sqrt(x)), floored so black pixels do not demand endless samples
+        return std::sqrt(variance / samples) / (2 * std::sqrt(std::max(mean, 0.01)));
+    }
+
+    // The sums as a flat array of doubles, for checkpoints and worker results. Bit exact, so
+    // a pixel unpacked elsewhere continues exactly as it would have here.
+    static constexpr int packed_size = 12;
+
+    void Pack(double* out) const {
+        for (int c = 0; c < 3; c++) {
+            out[c] = color[c];
+            out[3 + c] = albedo[c];
+            out[6 + c] = normal[c];
+        }
+        out[9] = depth;
+        out[10] = tone_sum;
+        out[11] = tone_squared_sum;
+    }
+
+    void Unpack(const double* in) {
+        color = Vec3d(in[0], in[1], in[2]);
+        albedo = Vec3d(in[3], in[4], in[5]);
+        normal = Vec3d(in[6], in[7], in[8]);
+        depth = in[9];
+        tone_sum = in[10];
+        tone_squared_sum = in[11];
+    }
+};
+
+enum class LightSelection {
+    Uniform,    // Every light equally likely
+    Importance  // Light BVH: proportional to estimated contribution at the shading point
+};
+
+class RenderStats {
+public:
+    uint64_t paths = 0;     // Camera rays, i.e. pixel samples
+    uint64_t rays = 0;      // Every ray cast into the scene
+    uint64_t shadow_rays = 0;
+    double seconds = 0;
+    int passes = 0;         // Passes over the frame, 1 unless rendering adaptively or progressively
+    double denoise_seconds = 0; // Spent in Denoise, not included in seconds
+
+    void Merge(const RenderStats& other) {
+        paths += other.paths;
+        rays += other.rays;
+        shadow_rays += other.shadow_rays;
+    }
+
+    double rays_per_second() const {
+        return seconds > 0 ? rays / seconds : 0;
+    }
+
+    double average_path_length() const {
+        return paths > 0 ? double(rays - shadow_rays) / paths : 0;
+    }
+};
+
+// Messages between a render coordinator and its workers.
+enum class WorkerMessage : uint32_t {
+    Hello = 1,  // Worker: protocol version and settings fingerprint
+    Welcome,    // Coordinator: settings match, tiles follow
+    Reject,     // Coordinator: settings differ
+    Tile,       // Coordinator: index and bounds of a tile to render
+    Result,     // Worker: tile index, counters and the tile's pixel sums
+    Done        // Coordinator: the frame is complete
+};
+constexpr uint32_t worker_protocol_version = 1;
+
 class Scene {
 public:
     int canvas_height;
@@ -47,6 +170,57 @@ public:
     double defocus_angle = 0;
     double focus_dist = 10;
     double exposure = 1;
+    uint64_t seed = 0;              // Base seed of the per-pixel random streams
+    SamplerType sampler = SamplerType::ZSobol;  // Source of the camera, lens, BSDF and light samples
+    unsigned int thread_count = 0;  // 0 uses std::thread::hardware_concurrency()
+    int tile_size = 16;             // Edge length in pixels of the tiles handed to threads
+    TileOrder tile_order = TileOrder::Spiral;
+    // Camera rays of neighbouring pixels traced through the BVH as one packet: 4 (blocks of
+    // 2x2 pixels), 8 (4x2) or 16 (4x4); 0 traces every ray on its own. Only the camera rays
+    // go in packets, the paths continue alone, and the image is the same either way.
+    int packet_size = 0;
+    // Wavefront mode: the paths of a whole tile advance together, one stage at a time over
+    // all of them (extend every ray, sort the hits by material, shade each material's queue,
+    // trace the shadow rays), instead of each path running to its end before the next
+    // starts. Same image; packet_size does not apply.
+    bool wavefront = false;
+    // Children per BVH node: 2, or 4 or 8 to trace through the wide form of the tree, where
+    // one SIMD test covers all children of a node (see BVH); no other value is valid.
+    // Packets walk the same tree, and meshes get the width for their own BVHs. Any width
+    // finds the same hits; applies from the next BuildBVH.
+    int bvh_width = 8;
+    bool russian_roulette = true;   // Randomly end paths whose throughput has become small
+    int rr_min_bounces = 3;         // Bounces every path gets before roulette starts
+    double rr_max_survival = 0.95;  // Cap, so even white paths (glass) terminate eventually
+    bool sample_lights = true;      // Next-event estimation: shadow rays towards emissive objects
+    LightSelection light_selection = LightSelection::Importance;
+    bool report_stats = false;      // Print ray count, rays/s and path length after Render
+    bool show_progress = true;      // Print the progress line while rendering
+    // Adaptive sampling: the same budget of samples_per_pixel * pixels, but spent in passes
+    // on the pixels whose estimated error is still above adaptive_threshold.
+    bool adaptive_sampling = false;
+    int adaptive_min_samples = 16;  // Samples every pixel gets before its error is trusted
+    int adaptive_max_samples = 0;   // Per-pixel cap, 0 for 8 * samples_per_pixel
+    double adaptive_threshold = 0.02;   // Standard error of the displayed value, 1.0 = white
+    // Progressive rendering: passes of progressive_pass_samples samples over the whole frame,
+    // so a complete (if noisy) image exists after the first pass. Stops at samples_per_pixel,
+    // at time_limit or once the average pixel error reaches target_error, whichever is first.
+    // Combined with adaptive_sampling, pixels below adaptive_threshold sit passes out.
+    bool progressive = false;
+    int progressive_pass_samples = 1;
+    double time_limit = 0;          // Seconds, 0 for no limit; an unfinished pass is cut short
+    double target_error = 0;        // Same units as adaptive_threshold, 0 for no target
+    std::function<void(int pass)> on_pass_complete;  // Called between passes, e.g. to save a preview
+    // Checkpoints: while rendering, a background thread saves the unfinished render to
+    // checkpoint_path every checkpoint_interval seconds. LoadCheckpoint before Render picks it
+    // up again, and the result is the image an uninterrupted render would have produced.
+    fs::path checkpoint_path;
+    double checkpoint_interval = 0; // Seconds, 0 for no checkpoints
+    // Denoising: Render ends by filtering the colour map with an edge-avoiding wavelet filter
+    // guided by the albedo, normal and depth maps (see Denoiser.h), so a few samples per
+    // pixel give a clean image. Denoise can also be called on its own after rendering.
+    bool denoise = false;
+    DenoiseSettings denoise_settings;
 
 private:
     Point3 camera_center;
@@ -67,8 +241,38 @@ private:
     std::vector<Color> albedo_map;
     std::vector<Vec3> normal_map;
     std::vector<double> depth_map;
+    std::vector<PixelSums> pixel_sums;
+    std::vector<int> pass_target;   // Samples each pixel is to have when the current pass ends
+    int current_pass = 0;
+    RenderStats render_stats;
+    bool resume_pending = false;    // LoadCheckpoint filled the buffers, Render continues them
+    double prior_seconds = 0;       // Rendering time before the resumed checkpoint
+    std::chrono::steady_clock::time_point render_start;
+    std::atomic<bool> rendering{ false };
+
+    // Checkpoints are copied while render threads run. Pixels are published under a lock
+    // striped by row, the counters under stats_mutex, and plan_mutex keeps the pass plan
+    // from changing halfway through a copy.
+    static constexpr int row_lock_count = 64;
+    std::mutex row_locks[row_lock_count];
+    std::mutex stats_mutex;
+    std::mutex plan_mutex;
 
     std::vector<std::shared_ptr<Object>> objects;
+    // Flat material table indexed by HitRecord::mat_id, and the compact form of each entry
+    // that shading reads.
+    std::vector<std::shared_ptr<Material>> materials;
+    std::vector<CompactMaterial> material_table;
+    std::unordered_map<const Material*, int> material_ids;
+    BVH bvh;
+    bool bvh_dirty = true;
+    SphereSoA leaf_spheres;             // Sphere data of objects, in BVH leaf order
+    std::vector<unsigned char> is_sphere;
+    bool all_spheres = true;
+    std::vector<int> lights;        // Indices of emissive objects
+    std::vector<int> object_light;  // Light index of each object, -1 if it does not emit
+    LightBVH light_bvh;
+    ImageWriter image_writer;       // Background thread the Write functions queue PNGs on
 public:
     Scene() {}
 
@@ -109,294 +313,1591 @@ public:
         defocus_disk_v = v * defocus_radius;
     }
 
+    int AddMaterial(std::shared_ptr<Material> mat) {
+        auto found = material_ids.find(mat.get());
+        if (found != material_ids.end())
+            return found->second;
+
+        int id = int(materials.size());
+        CompactMaterial compact;
+        if (!mat->Compact(compact)) {
+            compact = CompactMaterial();
+            compact.custom = mat.get();
+        }
+        material_table.push_back(compact);
+        material_ids.emplace(mat.get(), id);
+        materials.push_back(std::move(mat));
+        return id;
+    }
+
+    void ReserveObjects(size_t count) {
+        objects.reserve(count);
+    }
+
     void AddObject(std::shared_ptr<Object> obj) {
+        obj->SetMaterialId(AddMaterial(obj->GetMaterial()));
         objects.push_back(std::move(obj));
+        bvh_dirty = true;
     }
 
+    // Fails, with the scene left unbuilt, unless bvh_width is 2, 4 or 8.
+    bool BuildBVH() {
+        if (bvh_width != 2 && bvh_width != 4 && bvh_width != 8) {
+            std::cerr << "BVH width must be 2, 4 or 8, not " << bvh_width << std::endl;
+            return false;
+        }
+        std::vector<AABB> bounds;
+        bounds.reserve(objects.size());
+        for (const auto& obj : objects) {
+            obj->SetBVHWidth(bvh_width);
+            bounds.push_back(obj->BoundingBox());
+        }
 
-    void Render() {
-        color_map.assign(canvas_height * canvas_width, Color(0, 0, 0));
-        albedo_map.assign(canvas_height * canvas_width, Color(0, 0, 0));
-        normal_map.assign(canvas_height * canvas_width, Vec3(0, 0, 0));
-        depth_map.assign(canvas_height * canvas_width, 0.0);
+        bvh.leaf_batch_size = 4;
+        bvh.width = bvh_width;
+        if (!bvh.Build(bounds))
+            return false;
+
+        // Store the objects in leaf order so each leaf covers a contiguous range.
+        std::vector<std::shared_ptr<Object>> ordered;
+        ordered.reserve(objects.size());
+        for (int index : bvh.primitive_order())
+            ordered.push_back(objects[index]);
+        objects = std::move(ordered);
+
+        // Plain spheres are intersected from SoA leaf storage; every other object keeps
+        // an empty slot there and goes through its virtual RayHit.
+        leaf_spheres.clear();
+        leaf_spheres.reserve(int(objects.size()));
+        is_sphere.assign(objects.size(), 0);
+        all_spheres = true;
+        for (size_t i = 0; i < objects.size(); i++) {
+            const Object& obj = *objects[i];
+            if (typeid(obj) == typeid(Sphere)) {
+                const Sphere& sphere = static_cast<const Sphere&>(obj);
+                leaf_spheres.Add(sphere.GetCenter(), sphere.GetRadius());
+                is_sphere[i] = 1;
+            }
+            else {
+                leaf_spheres.AddEmpty();
+                all_spheres = false;
+            }
+        }
+        bvh_dirty = false;
+        return true;
+    }
 
-        unsigned int thread_count = std::thread::hardware_concurrency();
-        if (thread_count == 0) thread_count = 4;
+    void BuildLightList() {
+        // Every emissive object is a light. Objects that cannot be sampled still get an
+        // entry; their DirectionPdf is 0, which leaves them entirely to scattered rays.
+        lights.clear();
+        object_light.assign(objects.size(), -1);
+        std::vector<AABB> light_bounds;
+        std::vector<double> light_power;
+        for (size_t i = 0; i < objects.size(); i++) {
+            const CompactMaterial& mat = material_table[objects[i]->GetMaterialId()];
+            if (mat.IsEmissive()) {
+                object_light[i] = int(lights.size());
+                lights.push_back(int(i));
+
+                // Emitted radiance times the box area, which is proportional to the area of a sphere.
+                AABB box = objects[i]->BoundingBox();
+                light_bounds.push_back(box);
+                light_power.push_back(luminance(mat.Emitted()) * box.surface_area());
+            }
+        }
+        light_bvh.Build(light_bounds, light_power);
+    }
 
-        std::vector<std::thread> threads;
-        int rows_per_thread = canvas_height / thread_count;
 
-        std::atomic<int> lines_done(0);
+    bool Render() {
+        if (bvh_dirty) {
+            if (!BuildBVH())
+                return false;
+            BuildLightList();
+        }
 
-        auto render_rows = [&](int start_row, int end_row) {
-            for (int j = start_row; j < end_row; j++) {
-                for (int i = 0; i < canvas_width; i++) {
-                    int index = j * canvas_width + i;
+        int pixel_count = canvas_height * canvas_width;
+        // A checkpoint from before the first pass was planned holds nothing worth keeping.
+        bool resuming = resume_pending && current_pass > 0;
+        resume_pending = false;
+        if (!resuming) {
+            std::lock_guard<std::mutex> lock(plan_mutex);
+            pixel_sums.assign(pixel_count, PixelSums());
+            pass_target.assign(pixel_count, 0);
+            current_pass = 0;
+            render_stats = RenderStats();
+        }
+        prior_seconds = render_stats.seconds;
+
+        auto start_time = std::chrono::steady_clock::now();
+        render_start = start_time;
+        rendering = true;
+
+        // Checkpoints are written from a thread of their own, so the file I/O never holds up
+        // the render threads; they only wait for the copy of the row they want to store.
+        std::mutex checkpoint_mutex;
+        std::condition_variable checkpoint_wake;
+        bool render_done = false;
+        std::thread checkpointer;
+        if (!checkpoint_path.empty() && checkpoint_interval > 0) {
+            checkpointer = std::thread([&]() {
+                auto interval = std::chrono::duration<double>(checkpoint_interval);
+                std::unique_lock<std::mutex> lock(checkpoint_mutex);
+                while (!checkpoint_wake.wait_for(lock, interval, [&]() { return render_done; })) {
+                    lock.unlock();
+                    SaveCheckpoint(checkpoint_path);
+                    lock.lock();
+                }
+                });
+        }
 
-                    PixelInfo pixel;
+        if (progressive)
+            renderProgressive(start_time, resuming);
+        else if (adaptive_sampling)
+            renderAdaptive(resuming);
+        else
+            renderFixed(resuming);
+
+        if (checkpointer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(checkpoint_mutex);
+                render_done = true;
+            }
+            checkpoint_wake.notify_one();
+            checkpointer.join();
+        }
+        rendering = false;
 
-                    samplePixel(i, j, pixel);
+        resolveMaps();
 
-                    color_map[index] = pixel.color;
-                    albedo_map[index] = pixel.albedo;
-                    normal_map[index] = pixel.normal;
-                    depth_map[index] = pixel.depth;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        render_stats.seconds = prior_seconds + seconds;
+        {
+            std::lock_guard<std::mutex> lock(console_mutex);
+            if (show_progress) {
+                std::clog << "\rProgress: 100.0% - Done in " << std::setprecision(2) << seconds << " s.                    \n";
+            }
+            if (report_stats) {
+                std::clog << "Rays: " << render_stats.rays << " (" << std::setprecision(3)
+                    << render_stats.rays_per_second() / 1e6 << " Mrays/s), average path length: "
+                    << render_stats.average_path_length() << "\n";
+                std::clog << "Samples: " << render_stats.paths << " (" << std::setprecision(3)
+                    << double(render_stats.paths) / pixel_count << " per pixel, "
+                    << render_stats.passes << (render_stats.passes == 1 ? " pass" : " passes") << ")\n";
+            }
+        }
 
-                }
+        if (denoise)
+            Denoise();
+        return true;
+    }
 
-                int completed = lines_done.fetch_add(1) + 1;
+    // Filters the colour map in place, guided by the other maps and each pixel's noise
+    // estimate. The albedo, normal and depth maps are left as they are.
+    void Denoise() {
+        if (color_map.empty())
+            return;
+        auto start_time = std::chrono::steady_clock::now();
+
+        std::vector<double> variance(pixel_sums.size(), 1.0);
+        for (size_t p = 0; p < pixel_sums.size(); p++) {
+            const PixelSums& sums = pixel_sums[p];
+            if (sums.samples < 2) continue;
+            double mean = sums.tone_sum / sums.samples;
+            double sample_variance = std::max(0.0, (sums.tone_squared_sum - sums.samples * mean * mean) / (sums.samples - 1));
+            variance[p] = sample_variance / sums.samples;
+        }
 
-                // Show progress every N lines
-                if (completed % 10 == 0 || completed == canvas_height) {
-                    std::lock_guard<std::mutex> lock(console_mutex);
-                    double percent = (double)completed / canvas_height * 100.0;
-                    std::clog << "\rProgress: " << std::fixed << std::setprecision(1)
-                        << percent << "% (" << completed << "/" << canvas_height << ")"
-                        << std::flush;
-                }
-            }
-            };
+        Denoiser denoiser;
+        denoiser.settings = denoise_settings;
+        denoiser.thread_count = thread_count;
+        denoiser.Filter(canvas_width, canvas_height, color_map, albedo_map, normal_map, depth_map, variance);
 
-        for (unsigned int t = 0; t < thread_count; ++t) {
-            int start_row = t * rows_per_thread;
-            int end_row = (t == thread_count - 1) ? canvas_height : start_row + rows_per_thread;
-            threads.emplace_back(render_rows, start_row, end_row);
+        render_stats.denoise_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        if (show_progress) {
+            std::lock_guard<std::mutex> lock(console_mutex);
+            std::clog << "Denoised in " << std::setprecision(2) << render_stats.denoise_seconds << " s.\n";
         }
+    }
 
-        for (auto& t : threads) {
-            t.join();
-        }
+    static_assert(RenderCheckpoint::sums_per_pixel == PixelSums::packed_size, "checkpoint layout");
 
+    // Saves the render as it stands; safe to call from another thread while Render runs.
+    bool SaveCheckpoint(const fs::path& path) {
+        RenderCheckpoint checkpoint;
         {
-            std::lock_guard<std::mutex> lock(console_mutex);
-            std::clog << "\rProgress: 100.0% (" << canvas_height << "/" << canvas_height << ")"
-                << " - Done.           \n";
+            std::lock_guard<std::mutex> plan_lock(plan_mutex);
+            if (pixel_sums.size() != size_t(canvas_width) * canvas_height) {
+                std::cerr << "Nothing rendered to checkpoint" << std::endl;
+                return false;
+            }
+            checkpoint.Resize(canvas_width, canvas_height);
+            checkpoint.pass = current_pass;
+            checkpoint.fingerprint = settingsFingerprint();
+            for (int j = 0; j < canvas_height; j++) {
+                std::lock_guard<std::mutex> row_lock(row_locks[j % row_lock_count]);
+                for (int i = 0; i < canvas_width; i++) {
+                    size_t p = size_t(j) * canvas_width + i;
+                    const PixelSums& sums = pixel_sums[p];
+                    sums.Pack(&checkpoint.sums[p * RenderCheckpoint::sums_per_pixel]);
+                    checkpoint.samples[p] = sums.samples;
+                    checkpoint.targets[p] = pass_target[p];
+                }
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(stats_mutex);
+            checkpoint.paths = render_stats.paths;
+            checkpoint.rays = render_stats.rays;
+            checkpoint.shadow_rays = render_stats.shadow_rays;
+            checkpoint.passes = render_stats.passes;
         }
+        checkpoint.seconds = render_stats.seconds;
+        if (rendering)
+            checkpoint.seconds = prior_seconds + std::chrono::duration<double>(std::chrono::steady_clock::now() - render_start).count();
+
+        return checkpoint.Write(path);
     }
 
-    void Write(fs::path output_path, std::vector<double> d_buffer) {
-        int write_buffer_size = canvas_width * canvas_height * 3;
-        unsigned char* write_buffer = new unsigned char[write_buffer_size];
+    // Makes the next Render continue the checkpointed one. Call after Init, with the scene and
+    // every setting that decides which samples are taken exactly as they were; the limits that
+    // only decide when to stop (time_limit, target_error) may change.
+    bool LoadCheckpoint(const fs::path& path) {
+        RenderCheckpoint checkpoint;
+        if (!checkpoint.Read(path))
+            return false;
+        if (checkpoint.width != canvas_width || checkpoint.height != canvas_height) {
+            std::cerr << path.string() << " is a " << checkpoint.width << "x" << checkpoint.height
+                << " render, not " << canvas_width << "x" << canvas_height << std::endl;
+            return false;
+        }
+        if (checkpoint.fingerprint != settingsFingerprint()) {
+            std::cerr << path.string() << " was rendered with different settings" << std::endl;
+            return false;
+        }
 
-        const double max_depth_valid = 1e5;
-        const double epsilon = 1e-4;
+        size_t pixel_count = checkpoint.samples.size();
+        pixel_sums.assign(pixel_count, PixelSums());
+        pass_target.assign(pixel_count, 0);
+        for (size_t p = 0; p < pixel_count; p++) {
+            PixelSums& sums = pixel_sums[p];
+            sums.Unpack(&checkpoint.sums[p * RenderCheckpoint::sums_per_pixel]);
+            sums.samples = checkpoint.samples[p];
+            pass_target[p] = checkpoint.targets[p];
+        }
+        current_pass = checkpoint.pass;
+        render_stats = RenderStats();
+        render_stats.paths = checkpoint.paths;
+        render_stats.rays = checkpoint.rays;
+        render_stats.shadow_rays = checkpoint.shadow_rays;
+        render_stats.passes = checkpoint.passes;
+        render_stats.seconds = checkpoint.seconds;
+        resume_pending = true;
+        return true;
+    }
 
-        for (auto& d : d_buffer) {
-            if (!std::isfinite(d) || d > max_depth_valid) {
-                d = max_depth_valid;
+    // Distributed rendering. RenderCoordinator listens on address (see Socket.h), hands tiles
+    // to the worker processes that connect and assembles their results into the usual maps;
+    // RunWorker is the other end. Both must set up the same scene with the same settings,
+    // which the handshake checks. Tiles of a worker that disconnects go to the others, and
+    // workers may join at any time. Every pixel gets samples_per_pixel samples, from the
+    // same random streams as in Render, so the image matches a local render.
+    bool RenderCoordinator(const std::string& address) {
+        if (adaptive_sampling || progressive)
+            std::clog << "Distributed rendering takes samples_per_pixel samples everywhere; adaptive and progressive settings are ignored" << std::endl;
+
+        Socket listener = Socket::Listen(address);
+        if (!listener.is_open())
+            return false;
+
+        int pixel_count = canvas_height * canvas_width;
+        {
+            std::lock_guard<std::mutex> lock(plan_mutex);
+            pixel_sums.assign(pixel_count, PixelSums());
+            pass_target.assign(pixel_count, samples_per_pixel);
+            current_pass = 1;
+            render_stats = RenderStats();
+        }
+        auto start_time = std::chrono::steady_clock::now();
+
+        std::vector<Tile> tiles = MakeTiles(canvas_width, canvas_height, tile_size, tile_order);
+        int tile_count = int(tiles.size());
+        std::deque<int> pending;
+        for (int t = 0; t < tile_count; t++)
+            pending.push_back(t);
+        int tiles_done = 0;
+
+        class Worker {
+        public:
+            Socket socket;
+            bool ready = false;         // Handshake done
+            std::vector<int> tiles;     // Sent and not yet returned
+        };
+        std::vector<Worker> workers;
+        // Two tiles per worker, so the next one is already there when a result goes out.
+        const size_t tiles_in_flight = 2;
+        const size_t max_message = 64 + size_t(tile_size) * tile_size * (PixelSums::packed_size * sizeof(double) + sizeof(int32_t));
+        uint64_t fingerprint = settingsFingerprint();
+
+        auto send_tiles = [&](Worker& worker) {
+            while (worker.ready && worker.tiles.size() < tiles_in_flight && !pending.empty()) {
+                int t = pending.front();
+                const Tile& tile = tiles[t];
+                MessageWriter message;
+                message.Put(int32_t(t));
+                message.Put(int32_t(tile.x0));
+                message.Put(int32_t(tile.y0));
+                message.Put(int32_t(tile.x1));
+                message.Put(int32_t(tile.y1));
+                if (!worker.socket.SendMessage(uint32_t(WorkerMessage::Tile), message.bytes))
+                    return false;
+                pending.pop_front();
+                worker.tiles.push_back(t);
             }
-            if (d < epsilon) {
-                d = epsilon;
+            return true;
+        };
+
+        // Returns false if the worker has to be dropped.
+        auto handle_message = [&](Worker& worker) {
+            uint32_t type;
+            std::vector<char> payload;
+            if (!worker.socket.ReceiveMessage(type, payload, max_message))
+                return false;
+            MessageReader reader(payload);
+
+            if (type == uint32_t(WorkerMessage::Hello) && !worker.ready) {
+                uint32_t version = 0;
+                uint64_t worker_fingerprint = 0;
+                reader.Get(version);
+                reader.Get(worker_fingerprint);
+                if (!reader.ok() || version != worker_protocol_version || worker_fingerprint != fingerprint) {
+                    std::clog << "\rRejected a worker with different settings" << std::endl;
+                    worker.socket.SendMessage(uint32_t(WorkerMessage::Reject), {});
+                    return false;
+                }
+                worker.ready = true;
+                return worker.socket.SendMessage(uint32_t(WorkerMessage::Welcome), {}) && send_tiles(worker);
             }
-        }
 
-        auto [min_d_it, max_d_it] = std::minmax_element(d_buffer.begin(), d_buffer.end());
+            if (type != uint32_t(WorkerMessage::Result) || !worker.ready)
+                return false;
+            int32_t t = -1;
+            RenderStats tile_stats;
+            reader.Get(t);
+            reader.Get(tile_stats.paths);
+            reader.Get(tile_stats.rays);
+            reader.Get(tile_stats.shadow_rays);
+            auto sent = std::find(worker.tiles.begin(), worker.tiles.end(), t);
+            if (!reader.ok() || sent == worker.tiles.end())
+                return false;
+            const Tile& tile = tiles[t];
+            if (reader.remaining() != size_t(tile.pixel_count()) * (PixelSums::packed_size * sizeof(double) + sizeof(int32_t)))
+                return false;
+            for (int j = tile.y0; j < tile.y1; j++) {
+                for (int i = tile.x0; i < tile.x1; i++) {
+                    double packed[PixelSums::packed_size];
+                    int32_t samples;
+                    reader.GetBytes(packed, sizeof(packed));
+                    reader.Get(samples);
+                    PixelSums& sums = pixel_sums[j * canvas_width + i];
+                    sums.Unpack(packed);
+                    sums.samples = samples;
+                }
+            }
+            render_stats.Merge(tile_stats);
+            worker.tiles.erase(sent);
+            tiles_done++;
+
+            if (show_progress) {
+                std::lock_guard<std::mutex> lock(console_mutex);
+                std::clog << "\rProgress: " << std::fixed << std::setprecision(1) << 100.0 * tiles_done / tile_count
+                    << "% (" << tiles_done << "/" << tile_count << " tiles, " << workers.size() << " workers)" << std::flush;
+            }
+            return send_tiles(worker);
+        };
+
+        // Hands the tiles of a lost worker back, to be sent out before any others.
+        auto drop_worker = [&](size_t w) {
+            Worker& worker = workers[w];
+            if (!worker.tiles.empty()) {
+                std::clog << "\rLost a worker, reassigning " << worker.tiles.size() << " tiles" << std::endl;
+                pending.insert(pending.begin(), worker.tiles.begin(), worker.tiles.end());
+            }
+            workers.erase(workers.begin() + w);
+            for (Worker& other : workers) {
+                if (!send_tiles(other))
+                    other.socket.Close();   // Noticed as a lost worker on the next poll
+            }
+        };
+
+        while (tiles_done < tile_count) {
+            std::vector<pollfd> fds(workers.size() + 1);
+            fds[0] = { listener.handle(), POLLIN, 0 };
+            for (size_t w = 0; w < workers.size(); w++)
+                fds[w + 1] = { workers[w].socket.handle(), POLLIN, 0 };
+            if (poll(fds.data(), nfds_t(fds.size()), -1) < 0) {
+                if (errno == EINTR) continue;
+                std::cerr << "poll failed: " << std::strerror(errno) << std::endl;
+                return false;
+            }
 
+            // Backwards, so dropping a worker does not shift the ones still to be looked at.
+            for (size_t w = workers.size(); w-- > 0;) {
+                bool closed = !workers[w].socket.is_open() || (fds[w + 1].revents & POLLNVAL);
+                if (!closed && (fds[w + 1].revents & (POLLIN | POLLHUP | POLLERR)))
+                    closed = !handle_message(workers[w]);
+                if (closed)
+                    drop_worker(w);
+            }
 
-        for (int j = 0; j < canvas_height; j++) {
-            for (int i = 0; i < canvas_width; i++) {
-                int idx = j * canvas_width + i;
+            if (fds[0].revents & POLLIN) {
+                Worker worker;
+                worker.socket = listener.Accept();
+                if (worker.socket.is_open())
+                    workers.push_back(std::move(worker));
+            }
+        }
 
-                double r, g, b;
-                double d = d_buffer[idx];
+        for (Worker& worker : workers)
+            worker.socket.SendMessage(uint32_t(WorkerMessage::Done), {});
 
-                // Avoid log(0)
-                const double epsilon = 1e-4;
-                d = std::max(d, epsilon);
+        render_stats.passes = 1;
+        resolveMaps();
 
-                // Log scale normalization
-                double log_d = std::log(d);
-                double log_min = std::log(*min_d_it + epsilon);
-                double log_max = std::log(*max_d_it + epsilon);
-                double scaled = (log_d - log_min) / (log_max - log_min);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        render_stats.seconds = seconds;
+        if (show_progress) {
+            std::lock_guard<std::mutex> lock(console_mutex);
+            std::clog << "\rProgress: 100.0% - Done in " << std::setprecision(2) << seconds << " s.                    \n";
+        }
+        if (denoise)
+            Denoise();
+        return true;
+    }
 
-                r = g = b = scaled;
+    // Renders the tiles a coordinator at address sends until it reports the frame complete.
+    // Waits a few seconds for the coordinator to come up.
+    bool RunWorker(const std::string& address) {
+        if (bvh_dirty) {
+            if (!BuildBVH())
+                return false;
+            BuildLightList();
+        }
 
-                r = linear_to_gamma(r);   // gamma-correct afterwards
-                g = linear_to_gamma(g);
-                b = linear_to_gamma(b);
+        Socket socket;
+        for (int attempt = 0; attempt < 50 && !socket.is_open(); attempt++) {
+            socket = Socket::Connect(address);
+            if (!socket.is_open())
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        if (!socket.is_open()) {
+            std::cerr << "Cannot connect to " << address << std::endl;
+            return false;
+        }
 
-                Interval col_range(0.0, 0.999);
-                // safe cast
-                write_buffer[idx * 3 + 0] = static_cast<unsigned char>(256 * col_range.clamp(r));
-                write_buffer[idx * 3 + 1] = static_cast<unsigned char>(256 * col_range.clamp(g));
-                write_buffer[idx * 3 + 2] = static_cast<unsigned char>(256 * col_range.clamp(b));
+        MessageWriter hello;
+        hello.Put(worker_protocol_version);
+        hello.Put(settingsFingerprint());
+        uint32_t type;
+        std::vector<char> payload;
+        if (!socket.SendMessage(uint32_t(WorkerMessage::Hello), hello.bytes) || !socket.ReceiveMessage(type, payload, 0)
+            || type != uint32_t(WorkerMessage::Welcome)) {
+            std::cerr << "Coordinator at " << address << " did not accept this worker; are scene and settings the same?" << std::endl;
+            return false;
+        }
 
+        int tiles_rendered = 0;
+        while (true) {
+            if (!socket.ReceiveMessage(type, payload, 64)) {
+                std::cerr << "Lost the connection to " << address << std::endl;
+                return false;
+            }
+            if (type == uint32_t(WorkerMessage::Done))
+                break;
+
+            MessageReader reader(payload);
+            int32_t t;
+            Tile tile;
+            reader.Get(t);
+            reader.Get(tile.x0);
+            reader.Get(tile.y0);
+            reader.Get(tile.x1);
+            reader.Get(tile.y1);
+            if (type != uint32_t(WorkerMessage::Tile) || !reader.ok() || tile.x0 < 0 || tile.y0 < 0
+                || tile.x1 > canvas_width || tile.y1 > canvas_height || tile.x0 >= tile.x1 || tile.y0 >= tile.y1) {
+                std::cerr << "Bad message from " << address << std::endl;
+                return false;
             }
-        }
 
-        fs::create_directories(output_path.parent_path());
-        if (stbi_write_png(output_path.string().c_str(), canvas_width, canvas_height, 3, write_buffer, canvas_width * 3)) {
-            std::cout << "Saved " << output_path.string() << std::endl;
-        }
-        else {
-            std::cerr << "Failed to write PNG" << std::endl;
+            std::vector<PixelSums> sums(tile.pixel_count());
+            RenderStats tile_stats;
+            renderTile(tile, sums, tile_stats);
+
+            MessageWriter result;
+            result.Put(t);
+            result.Put(tile_stats.paths);
+            result.Put(tile_stats.rays);
+            result.Put(tile_stats.shadow_rays);
+            for (const PixelSums& pixel : sums) {
+                double packed[PixelSums::packed_size];
+                pixel.Pack(packed);
+                result.PutBytes(packed, sizeof(packed));
+                result.Put(int32_t(pixel.samples));
+            }
+            if (!socket.SendMessage(uint32_t(WorkerMessage::Result), result.bytes)) {
+                std::cerr << "Lost the connection to " << address << std::endl;
+                return false;
+            }
+            tiles_rendered++;
         }
-        delete[] write_buffer;
+        if (show_progress)
+            std::clog << "Worker done, rendered " << tiles_rendered << " tiles" << std::endl;
+        return true;
     }
 
-    void Write(fs::path output_path, std::vector<Color> color_buffer) {
-        int write_buffer_size = canvas_width * canvas_height * 3;
-        unsigned char* write_buffer = new unsigned char[write_buffer_size];
+    // The Write functions turn a buffer into 8-bit pixels on the calling thread, spread over
+    // thread_count threads, and queue the PNG encoding on a background thread, so they return
+    // before the file exists and the buffer may change as soon as they do. FinishWrites waits
+    // for the files.
+    void Write(const fs::path& output_path, const std::vector<double>& d_buffer) {
+        const double max_depth_valid = 1e5;
+        const double epsilon = 1e-4;
+        auto valid_depth = [&](double d) {
+            if (!std::isfinite(d) || d > max_depth_valid)
+                d = max_depth_valid;
+            return std::max(d, epsilon);
+        };
+
+        double min_d = max_depth_valid, max_d = epsilon;
+        for (double d : d_buffer) {
+            d = valid_depth(d);
+            min_d = std::min(min_d, d);
+            max_d = std::max(max_d, d);
+        }
+        // Log scale normalization
+        double log_min = std::log(min_d + epsilon);
+        double log_max = std::log(max_d + epsilon);
+
+        std::vector<unsigned char> pixels(d_buffer.size() * 3);
+        ParallelFor(d_buffer.size(), thread_count, 4096, [&](size_t begin, size_t end) {
+            Interval col_range(0.0, 0.999);
+            for (size_t idx = begin; idx < end; idx++) {
+                double scaled = (std::log(valid_depth(d_buffer[idx])) - log_min) / (log_max - log_min);
+                unsigned char v = static_cast<unsigned char>(256 * col_range.clamp(linear_to_gamma(scaled)));
+                pixels[idx * 3 + 0] = pixels[idx * 3 + 1] = pixels[idx * 3 + 2] = v;
+            }
+            });
+        queuePng(output_path, std::move(pixels));
+    }
 
-        for (int j = 0; j < canvas_height; j++) {
-            for (int i = 0; i < canvas_width; i++) {
-                int idx = j * canvas_width + i;
+    void Write(const fs::path& output_path, const std::vector<Color>& color_buffer) {
+        std::vector<unsigned char> pixels(color_buffer.size() * 3);
+        const real* values = color_buffer.empty() ? nullptr : color_buffer[0].e;
+        ParallelFor(pixels.size(), thread_count, 3 * 4096, [&](size_t begin, size_t end) {
+            ToneMapTo8Bit(values + begin, end - begin, pixels.data() + begin);
+            });
+        queuePng(output_path, std::move(pixels));
+    }
 
-                double r = color_buffer[idx].x();
-                double g = color_buffer[idx].y();
-                double b = color_buffer[idx].z();
+    // Waits for every queued Write. Returns false if any of them failed.
+    bool FinishWrites() {
+        return image_writer.Finish();
+    }
 
-                auto tone = [](double x) { return x / (1.0 + x); };   // maps [0,inf) → [0,1)
+    // Linear HDR output, without the tone mapping and quantisation of the PNGs. WriteEXR puts
+    // the colour, albedo, normal and depth maps in one file, as the channels R, G, B,
+    // albedo.R/G/B, normal.X/Y/Z and Z (infinite where a pixel saw no surface).
+    bool WriteEXR(const fs::path& output_path, ExrCompression compression = ExrCompression::RLE) const {
+        static const char* const rgb[3] = { "R", "G", "B" };
+        static const char* const xyz[3] = { "X", "Y", "Z" };
+        std::vector<ImageChannel> channels;
+        AddImageChannels(channels, color_map, "", rgb);
+        AddImageChannels(channels, albedo_map, "albedo.", rgb);
+        AddImageChannels(channels, normal_map, "normal.", xyz);
+        channels.push_back(MakeImageChannel("Z", depth_map.data()));
+        return writeHdr(output_path, color_map.size(), [&]() {
+            return ::WriteEXR(output_path, canvas_width, canvas_height, channels, compression);
+            });
+    }
 
-                r = tone(r);
-                g = tone(g);
-                b = tone(b);
+    bool WritePFM(const fs::path& output_path, const std::vector<Color>& color_buffer) const {
+        static const char* const rgb[3] = { "R", "G", "B" };
+        std::vector<ImageChannel> channels;
+        AddImageChannels(channels, color_buffer, "", rgb);
+        return writeHdr(output_path, color_buffer.size(), [&]() {
+            return ::WritePFM(output_path, canvas_width, canvas_height, channels);
+            });
+    }
 
-                r = linear_to_gamma(r);   // γ-correct afterwards
-                g = linear_to_gamma(g);
-                b = linear_to_gamma(b);
+    bool WritePFM(const fs::path& output_path, const std::vector<double>& d_buffer) const {
+        std::vector<ImageChannel> channels = { MakeImageChannel("Y", d_buffer.data()) };
+        return writeHdr(output_path, d_buffer.size(), [&]() {
+            return ::WritePFM(output_path, canvas_width, canvas_height, channels);
+            });
+    }
 
-                Interval col_range(0.0, 0.999);
-                // safe cast
-                write_buffer[idx * 3 + 0] = static_cast<unsigned char>(256 * col_range.clamp(r));
-                write_buffer[idx * 3 + 1] = static_cast<unsigned char>(256 * col_range.clamp(g));
-                write_buffer[idx * 3 + 2] = static_cast<unsigned char>(256 * col_range.clamp(b));
+private:
+    void queuePng(const fs::path& output_path, std::vector<unsigned char> pixels) {
+        int width = canvas_width, height = canvas_height;
+        unsigned int threads = thread_count;
+        image_writer.Submit([=, pixels = std::move(pixels)]() {
+            if (output_path.has_parent_path())
+                fs::create_directories(output_path.parent_path());
+            bool ok = WritePNG(output_path, width, height, pixels.data(), threads);
+            std::lock_guard<std::mutex> lock(console_mutex);
+            if (ok)
+                std::cout << "Saved " << output_path.string() << std::endl;
+            else
+                std::cerr << "Failed to write PNG" << std::endl;
+            return ok;
+            });
+    }
 
-            }
+    template <class F>
+    bool writeHdr(const fs::path& output_path, size_t pixel_count, F write) const {
+        if (pixel_count != size_t(canvas_width) * canvas_height) {
+            std::cerr << "Buffer for " << output_path.string() << " does not match the canvas" << std::endl;
+            return false;
         }
+        if (output_path.has_parent_path())
+            fs::create_directories(output_path.parent_path());
+        if (!write())
+            return false;
+        std::cout << "Saved " << output_path.string() << std::endl;
+        return true;
+    }
+
+    bool Intersect(const Ray& r, Interval ray_t, HitRecord& rec) const {
+        return bvh.TraverseLeaves(r, ray_t, [&](int first, int count, Interval& t) {
+            return hitLeaf(r, first, count, t, rec);
+            });
+    }
 
-        fs::create_directories(output_path.parent_path());
-        if (stbi_write_png(output_path.string().c_str(), canvas_width, canvas_height, 3, write_buffer, canvas_width * 3)) {
-            std::cout << "Saved " << output_path.string() << std::endl;
+    // Intersects r with the objects first to first + count of a BVH leaf. On a hit, fills in
+    // rec and shrinks t.max to its distance.
+    bool hitLeaf(const Ray& r, int first, int count, Interval& t, HitRecord& rec) const {
+        HitRecord temp_rec;
+        auto hit_object = [&](int i, Interval& t) {
+            if (!objects[i]->RayHit(r, temp_rec, t))
+                return false;
+            t.max = temp_rec.t;
+            rec = temp_rec;
+            rec.object_id = i;
+            return true;
+        };
+
+        bool hit = false;
+        real t_hit;
+        int nearest = leaf_spheres.Intersect(r, t, first, first + count, t_hit);
+        if (nearest >= 0) {
+            // Let the winner fill in the record. The kernel repeats Sphere::RayHit's
+            // arithmetic, so this only fails if the compiler rounded differently. The
+            // winner is known to be a sphere, so call it directly where it can be inlined.
+            Sphere* sphere = static_cast<Sphere*>(objects[nearest].get());
+            if (sphere->Sphere::RayHit(r, temp_rec, t)) {
+                t.max = temp_rec.t;
+                rec = temp_rec;
+                rec.object_id = nearest;
+                hit = true;
+            }
+            else {
+                for (int i = first; i < first + count; i++)
+                    hit = hit_object(i, t) || hit;
+                return hit;
+            }
         }
-        else {
-            std::cerr << "Failed to write PNG" << std::endl;
+        if (!all_spheres) {
+            for (int i = first; i < first + count; i++) {
+                if (!is_sphere[i])
+                    hit = hit_object(i, t) || hit;
+            }
         }
-        delete[] write_buffer;
+        return hit;
     }
 
-private:
-    void getRayHit(const Ray& r, int bounce_depth, PixelInfo& pixel) {
-        if (bounce_depth <= 0) {
-            pixel.color = Color(0, 0, 0);
+    // Intersects the rays of a packet of camera rays, as one if they are coherent and one by
+    // one if not. hits[k] receives the result for rays[k], the ray in lane k.
+    void intersectPacket(RayPacket& packet, const Ray* rays, PrimaryHit* hits) const {
+        if (!packet.Finish()) {
+            for (int k = 0; k < packet.size; k++)
+                hits[k].found = Intersect(rays[k], clip_interval, hits[k].rec);
             return;
         }
+        for (int k = 0; k < packet.size; k++)
+            hits[k].found = false;
+        bvh.TraversePacket(packet, clip_interval.min, [&](int lane, int first, int count, Interval& t) {
+            if (hitLeaf(rays[lane], first, count, t, hits[lane].rec))
+                hits[lane].found = true;
+            });
+    }
 
-        HitRecord rec;
-        bool hit_anything = false;
-        double closest_so_far = clip_interval.max;
-
-        for (const auto& obj : objects) {
-            HitRecord temp_rec;
-            if (obj->RayHit(r, temp_rec, Interval(clip_interval.min, closest_so_far))) {
-                hit_anything = true;
-                closest_so_far = temp_rec.t;
-                rec = temp_rec;
+    // primary, if given, is camera_ray's intersection, found ahead of the path by packet
+    // tracing.
+    void getRayHit(const Ray& camera_ray, Sampler& sampler, PixelInfo& pixel, RenderStats& stats,
+        const PrimaryHit* primary = nullptr) {
+        // Iterative path tracer: instead of recursing per bounce, carry the product of
+        // the attenuations seen so far and add emission scaled by it.
+        Ray r = camera_ray;
+        Color throughput(1, 1, 1);
+        PathVertex prev;
+        startPath(pixel);
+
+        stats.paths++;
+        for (int bounce = 0; bounce < max_bouces; bounce++) {
+            stats.rays++;
+
+            HitRecord rec;
+            bool found;
+            if (bounce == 0 && primary) {
+                found = primary->found;
+                rec = primary->rec;
+            }
+            else {
+                found = Intersect(r, clip_interval, rec);
             }
+
+            ShadowRay shadow;
+            bool more = shadeHit(found, rec, bounce, r, throughput, prev, pixel, sampler, shadow);
+            if (shadow.pending)
+                traceShadowRay(shadow, pixel, stats);
+            if (!more)
+                return;
         }
+    }
+
+    // The previous scattering event of a path, needed to weight emission that a scattered
+    // ray finds against the light sample taken at the same vertex.
+    class PathVertex {
+    public:
+        bool specular = true;
+        Point3 point;
+        Vec3 normal;
+        double pdf = 0;
+    };
+
+    // A light sample waiting for its shadow ray: if the ray's first hit is light_object,
+    // the path gains throughput * (factor * emitted radiance of the hit).
+    class ShadowRay {
+    public:
+        bool pending = false;
+        Ray ray;
+        int light_object = -1;
+        Color factor;
+        Color throughput;
+    };
+
+    void startPath(PixelInfo& pixel) const {
+        pixel.color = Color(0, 0, 0);
+        pixel.albedo = Vec3();
+        pixel.normal = Vec3();
+        pixel.depth = clip_interval.max;
+    }
 
-        if (hit_anything) {
-            Ray scattered;
-            Color emitted = Color(0, 0, 0); // Always initialize
-            Color attenuation;
-            Color albedo;
-            bool didScatter = false;
-            bool didEmit = false;
+    // One bounce of a path whose ray r found rec (if found): adds the emission there, takes
+    // a light sample into shadow, and turns r into the scattered ray. Returns false when
+    // the path ends here.
+    bool shadeHit(bool found, const HitRecord& rec, int bounce, Ray& r, Color& throughput, PathVertex& prev,
+        PixelInfo& pixel, Sampler& sampler, ShadowRay& shadow) {
+        if (!found) {
+            Vec3 unit_direction = normalize(r.direction());
+            double t = (unit_direction.y() + 1.0) / 2.0;
+            pixel.color = pixel.color + throughput * lerp(Vec3(1, 1, 1) * exposure, Vec3(0.5, 0.7, 1) * exposure, t);
+            return false;
+        }
 
-            rec.mat->fall(r, rec, attenuation, albedo, scattered, didScatter, didEmit);
+        const CompactMaterial& mat = material_table[rec.mat_id];
+        Scattering scattering;
+        // The two discrete decisions of the bounce share a pair of dimensions.
+        Vec3 u = sampler.Get2D(sample_dim::Bounce(bounce, sample_dim::bsdf));
+        Vec3 u_choices = sampler.Get2D(sample_dim::Bounce(bounce, sample_dim::choices));
+        u[2] = u_choices.x();
+        mat.Scatter(r, rec, u, scattering);
 
-            pixel.albedo = albedo;
+        if (bounce == 0) {
+            pixel.albedo = scattering.albedo;
             pixel.normal = rec.normal;
             pixel.depth = rec.t;
+        }
 
-            if (didEmit)
-                emitted = attenuation; // attenuation is emission color
+        if (scattering.emit) {
+            double weight = 1;
+            if (sample_lights && !prev.specular) {
+                double light_pdf = lightPdf(rec.object_id, prev.point, prev.normal, normalize(r.direction()));
+                weight = power_heuristic(prev.pdf, light_pdf);
+            }
+            pixel.color = pixel.color + weight * throughput * scattering.attenuation; // attenuation is emission color
+        }
 
-            if (didScatter) {
-                PixelInfo pixel2;
-                getRayHit(scattered, bounce_depth - 1, pixel2);
-                pixel.color = emitted + attenuation * pixel2.color;
+        if (sample_lights && !lights.empty()) {
+            // An absorbed sample may leave no direction to evaluate; the path ends there, so
+            // only whether to take a light sample matters.
+            Color f_cos;
+            if (scattering.scatter)
+                prev.specular = !mat.Evaluate(r, rec, normalize(scattering.scattered.direction()), f_cos, prev.pdf);
+            else
+                prev.specular = mat.IsSpecular(r, rec);
+            prev.point = rec.hitPoint;
+            prev.normal = rec.normal;
+            if (!prev.specular)
+                sampleLight(r, rec, mat, sampler, bounce, throughput, shadow);
+        }
+
+        // Only now: the MIS weights count on every non-delta hit taking a light sample,
+        // including hits whose BSDF sample was absorbed (a fuzzy metal reflecting below the
+        // surface).
+        if (!scattering.scatter)
+            return false;
+
+        throughput = throughput * scattering.attenuation;
+
+        // Russian roulette: end low-contribution paths at random and boost the survivors
+        // by 1 / survival_probability, which keeps the estimate unbiased.
+        if (russian_roulette && bounce + 1 >= rr_min_bounces) {
+            double survival = std::fmin(std::fmax(throughput.x(), std::fmax(throughput.y(), throughput.z())), rr_max_survival);
+            if (u_choices.y() >= survival)
+                return false;
+            throughput = throughput / survival;
+        }
+
+        r = scattering.scattered;
+        return true;
+    }
+
+    // Next-event estimation: picks one light at random and a direction towards it, and
+    // leaves the shadow ray that decides whether it contributes in shadow, its radiance
+    // MIS-weighted against the material's own sampling of the same direction.
+    void sampleLight(const Ray& r_in, const HitRecord& rec, const CompactMaterial& mat, Sampler& sampler,
+        int bounce, const Color& throughput, ShadowRay& shadow) {
+        int light;
+        double selection_pdf;
+        double u_choice = sampler.Get1D(sample_dim::Bounce(bounce, sample_dim::light_choice));
+        if (light_selection == LightSelection::Importance) {
+            light = light_bvh.Sample(rec.hitPoint, rec.normal, u_choice, selection_pdf);
+            if (light < 0)
                 return;
-            }
-            else {
-                pixel.color = emitted;  // Emission color
-            }
-            return;
         }
+        else {
+            light = std::min(int(u_choice * lights.size()), int(lights.size()) - 1);
+            selection_pdf = 1.0 / lights.size();
+        }
+        int light_object = lights[light];
 
-        Vec3 unit_direction = normalize(r.direction());
-        double t = (unit_direction.y() + 1.0) / 2.0;
-        pixel.color = lerp(Vec3(1, 1, 1) * exposure, Vec3(0.5, 0.7, 1) * exposure, t);
-        pixel.albedo = Vec3();
-        pixel.normal = Vec3();
-        pixel.depth = clip_interval.max;
-        return;
+        Vec3 direction;
+        double light_pdf;
+        Vec3 u = sampler.Get2D(sample_dim::Bounce(bounce, sample_dim::light));
+        if (!objects[light_object]->SampleDirection(rec.hitPoint, u, direction, light_pdf))
+            return;
+        light_pdf *= selection_pdf;
+
+        Color f_cos;
+        double bsdf_pdf;
+        if (!mat.Evaluate(r_in, rec, direction, f_cos, bsdf_pdf) || bsdf_pdf <= 0)
+            return;
+
+        double weight = power_heuristic(light_pdf, bsdf_pdf);
+        shadow.pending = true;
+        shadow.ray = Ray(offset_ray_origin(rec, direction), direction);
+        shadow.light_object = light_object;
+        shadow.factor = (weight / light_pdf) * f_cos;
+        shadow.throughput = throughput;
     }
 
+    // The light is visible if it is the first thing the shadow ray hits.
+    void traceShadowRay(const ShadowRay& shadow, PixelInfo& pixel, RenderStats& stats) const {
+        stats.rays++;
+        stats.shadow_rays++;
+        HitRecord light_rec;
+        if (!Intersect(shadow.ray, clip_interval, light_rec) || light_rec.object_id != shadow.light_object)
+            return;
+        pixel.color = pixel.color + shadow.throughput * (shadow.factor * material_table[light_rec.mat_id].Emitted());
+    }
 
-    Ray getRay(int i, int j) const {
+    // Density with which sampleLight, called at origin with the given surface normal,
+    // would pick direction towards object_id.
+    double lightPdf(int object_id, const Point3& origin, const Vec3& normal, const Vec3& direction) const {
+        int light = object_light[object_id];
+        if (light < 0)
+            return 0;
+
+        double selection_pdf;
+        if (light_selection == LightSelection::Importance)
+            selection_pdf = light_bvh.Pdf(origin, normal, light);
+        else
+            selection_pdf = 1.0 / lights.size();
+        return selection_pdf * objects[object_id]->DirectionPdf(origin, direction);
+    }
+
+
+    Ray getRay(int i, int j, Sampler& sampler) const {
         // Construct a camera ray originating from the origin and directed at randomly sampled
         // point around the pixel location i, j.
 
-        auto offset = sampleSquare();
+        auto offset = sampleSquare(sampler);
         auto pixel_sample = pixel00_loc
             + ((i + offset.x()) * pixel_delta_u)
             + ((j + offset.y()) * pixel_delta_v);
 
-        auto ray_origin = (defocus_angle <= 0) ? camera_center : defocus_disk_sample();
+        auto ray_origin = (defocus_angle <= 0) ? camera_center : defocus_disk_sample(sampler);
         auto ray_direction = pixel_sample - ray_origin;
 
         return Ray(ray_origin, ray_direction);
     }
 
-    Vec3 sampleSquare() const {
-        // Returns the vector to a random point in the [-.5,-.5]-[+.5,+.5] unit square.
-        return Vec3(random_double() - 0.5, random_double() - 0.5, 0);
+    Vec3 sampleSquare(Sampler& sampler) const {
+        // Returns the vector to a sampled point in the [-.5,-.5]-[+.5,+.5] unit square.
+        return sampler.Get2D(sample_dim::pixel) - Vec3(0.5, 0.5, 0);
+    }
+
+    // Each mode plans a pass by setting pass_target, under plan_mutex, and then renders it.
+    // A resumed render first finishes the pass its checkpoint was taken in, as planned then.
+
+    void renderFixed(bool resuming) {
+        if (!resuming) {
+            std::lock_guard<std::mutex> lock(plan_mutex);
+            std::fill(pass_target.begin(), pass_target.end(), samples_per_pixel);
+            current_pass = 1;
+        }
+        renderPass("");
+    }
+
+    void renderAdaptive(bool resuming) {
+        int pixel_count = canvas_height * canvas_width;
+
+        // Every pixel first gets enough samples to estimate its error. After that, each
+        // pass gives the pixels that are still too noisy the samples they should need,
+        // scaled down once the remaining budget cannot cover that. Converged pixels take
+        // no more, which leaves the budget to the noisy ones.
+        int min_samples = std::clamp(adaptive_min_samples, 1, samples_per_pixel);
+        int max_samples = adaptive_max_samples > 0 ? adaptive_max_samples : 8 * samples_per_pixel;
+        uint64_t budget = uint64_t(samples_per_pixel) * pixel_count;
+
+        std::vector<double> error;
+        for (int pass = resuming ? current_pass : 1; ; pass++) {
+            if (!resuming || pass != current_pass) {
+                std::lock_guard<std::mutex> lock(plan_mutex);
+                if (pass == 1) {
+                    std::fill(pass_target.begin(), pass_target.end(), min_samples);
+                }
+                else {
+                    uint64_t spent = 0;
+                    for (const PixelSums& sums : pixel_sums)
+                        spent += sums.samples;
+                    if (spent >= budget)
+                        break;
+
+                    pixelErrors(error);
+                    uint64_t wanted = 0;
+                    for (int p = 0; p < pixel_count; p++) {
+                        // Error falls with sqrt(samples): ask for what should reach the threshold,
+                        // but at most double per pass so the estimate is refreshed on the way.
+                        int samples = pixel_sums[p].samples;
+                        int needed = 0;
+                        if (error[p] > adaptive_threshold && samples < max_samples) {
+                            double ratio = error[p] / adaptive_threshold;
+                            needed = int(std::min(double(samples), std::ceil(samples * (ratio * ratio - 1))));
+                            needed = std::clamp(needed, 1, max_samples - samples);
+                        }
+                        pass_target[p] = needed;
+                        wanted += needed;
+                    }
+                    double scale = wanted > budget - spent ? double(budget - spent) / wanted : 1.0;
+                    wanted = 0;
+                    for (int p = 0; p < pixel_count; p++) {
+                        if (scale < 1.0)
+                            pass_target[p] = int(pass_target[p] * scale);
+                        wanted += pass_target[p];
+                        pass_target[p] += pixel_sums[p].samples;
+                    }
+                    if (wanted == 0)
+                        break;
+                }
+                current_pass = pass;
+            }
+            renderPass("Pass " + std::to_string(pass) + ": ");
+        }
+    }
+
+    void renderProgressive(std::chrono::steady_clock::time_point start_time, bool resuming) {
+        // The time limit covers the whole render, including the time before a resume.
+        auto deadline = std::chrono::steady_clock::time_point::max();
+        if (time_limit > 0)
+            deadline = start_time + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                std::chrono::duration<double>(time_limit - prior_seconds));
+
+        int pass_samples = std::max(1, progressive_pass_samples);
+        std::vector<double> error;
+        for (int pass = resuming ? current_pass : 1; ; pass++) {
+            if (!resuming || pass != current_pass) {
+                std::lock_guard<std::mutex> lock(plan_mutex);
+                bool skip_converged = adaptive_sampling && pass > 1;
+                if (skip_converged)
+                    pixelErrors(error);
+                bool any_samples = false;
+                for (size_t p = 0; p < pixel_sums.size(); p++) {
+                    int samples = pixel_sums[p].samples;
+                    if (skip_converged && samples >= adaptive_min_samples && error[p] <= adaptive_threshold)
+                        pass_target[p] = samples;
+                    else
+                        pass_target[p] = std::min(samples + pass_samples, samples_per_pixel);
+                    any_samples = any_samples || pass_target[p] > samples;
+                }
+                // Every pixel converged before reaching samples_per_pixel
+                if (!any_samples)
+                    break;
+                current_pass = pass;
+            }
+
+            renderPass("Pass " + std::to_string(pass) + ": ", deadline);
+
+            if (on_pass_complete) {
+                resolveMaps();
+                on_pass_complete(pass);
+            }
+
+            if (std::chrono::steady_clock::now() >= deadline)
+                break;
+            bool done = true;
+            double error_sum = 0;
+            for (const PixelSums& sums : pixel_sums) {
+                if (sums.samples < samples_per_pixel)
+                    done = false;
+                error_sum += sums.error();
+            }
+            if (done || (target_error > 0 && error_sum / pixel_sums.size() <= target_error))
+                break;
+        }
+    }
+
+    // Turns the sums into the per-pixel means the get_*_map accessors return.
+    void resolveMaps() {
+        size_t pixel_count = pixel_sums.size();
+        color_map.assign(pixel_count, Color(0, 0, 0));
+        albedo_map.assign(pixel_count, Color(0, 0, 0));
+        normal_map.assign(pixel_count, Vec3(0, 0, 0));
+        depth_map.assign(pixel_count, 0.0);
+        for (size_t p = 0; p < pixel_count; p++) {
+            const PixelSums& sums = pixel_sums[p];
+            if (sums.samples == 0) continue;
+            double scale = 1.0 / sums.samples;
+            color_map[p] = Color(scale * sums.color);
+            albedo_map[p] = Color(scale * sums.albedo);
+            normal_map[p] = Vec3(scale * sums.normal);
+            depth_map[p] = scale * sums.depth;
+        }
+    }
+
+    // Estimated error of every pixel. A handful of samples easily miss a rare bright path,
+    // so each pixel is judged by the worst error around it.
+    void pixelErrors(std::vector<double>& error) const {
+        std::vector<double> own(pixel_sums.size());
+        for (size_t p = 0; p < pixel_sums.size(); p++)
+            own[p] = pixel_sums[p].error();
+
+        error.resize(pixel_sums.size());
+        for (int j = 0; j < canvas_height; j++) {
+            for (int i = 0; i < canvas_width; i++) {
+                double worst = 0;
+                for (int y = std::max(j - 1, 0); y <= std::min(j + 1, canvas_height - 1); y++)
+                    for (int x = std::max(i - 1, 0); x <= std::min(i + 1, canvas_width - 1); x++)
+                        worst = std::max(worst, own[y * canvas_width + x]);
+                error[j * canvas_width + i] = worst;
+            }
+        }
+    }
+
+    // Renders one pass over the frame, sampling each pixel up to its pass_target.
+    // Tiles not started by the deadline are left as they were.
+    void renderPass(const std::string& progress_label,
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+        unsigned int thread_count = this->thread_count;
+        if (thread_count == 0) thread_count = std::thread::hardware_concurrency();
+        if (thread_count == 0) thread_count = 4;
+
+        // Threads pull tiles from a shared counter until none are left, so no core idles
+        // while another still has a long queue of expensive pixels.
+        std::vector<Tile> tiles = MakeTiles(canvas_width, canvas_height, tile_size, tile_order);
+        int tile_count = int(tiles.size());
+        std::atomic<int> next_tile(0);
+        std::atomic<int> tiles_done(0);
+
+        int block_width, block_height;
+        packetBlock(packet_size, block_width, block_height);
+
+        auto render_tiles = [&]() {
+            RenderStats tile_stats;
+            std::vector<BlockPixel> block;
+            WavefrontBuffers wavefront_buffers;
+            while (true) {
+                int t = next_tile.fetch_add(1);
+                if (t >= tile_count) break;
+                if (std::chrono::steady_clock::now() >= deadline) break;
+
+                const Tile& tile = tiles[t];
+                if (wavefront) {
+                    renderTileWavefront(tile, wavefront_buffers, tile_stats);
+                }
+                else if (block_width * block_height > 1) {
+                    for (int y = tile.y0; y < tile.y1; y += block_height) {
+                        for (int x = tile.x0; x < tile.x1; x += block_width) {
+                            block.clear();
+                            for (int j = y; j < std::min(y + block_height, tile.y1); j++) {
+                                for (int i = x; i < std::min(x + block_width, tile.x1); i++) {
+                                    int index = j * canvas_width + i;
+                                    int count = pass_target[index] - pixel_sums[index].samples;
+                                    if (count > 0)
+                                        block.push_back(BlockPixel{ i, j, count, pixel_sums[index], Pcg32() });
+                                }
+                            }
+                            samplePixelBlock(block, tile_stats);
+                            for (const BlockPixel& pixel : block) {
+                                std::lock_guard<std::mutex> lock(row_locks[pixel.j % row_lock_count]);
+                                pixel_sums[pixel.j * canvas_width + pixel.i] = pixel.sums;
+                            }
+                        }
+                    }
+                }
+                else {
+                    for (int j = tile.y0; j < tile.y1; j++) {
+                        for (int i = tile.x0; i < tile.x1; i++) {
+                            int index = j * canvas_width + i;
+                            int count = pass_target[index] - pixel_sums[index].samples;
+                            if (count <= 0) continue;
+
+                            // Sample into a copy, so a checkpoint never sees a pixel half done.
+                            PixelSums sums = pixel_sums[index];
+                            samplePixel(i, j, count, sums, tile_stats);
+                            std::lock_guard<std::mutex> lock(row_locks[j % row_lock_count]);
+                            pixel_sums[index] = sums;
+                        }
+                    }
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(stats_mutex);
+                    render_stats.Merge(tile_stats);
+                }
+                tile_stats = RenderStats();
+
+                int completed = tiles_done.fetch_add(1) + 1;
+
+                // Show progress every N tiles
+                if (show_progress && (completed % 10 == 0 || completed == tile_count)) {
+                    std::lock_guard<std::mutex> lock(console_mutex);
+                    double percent = (double)completed / tile_count * 100.0;
+                    std::clog << "\rProgress: " << progress_label << std::fixed << std::setprecision(1)
+                        << percent << "% (" << completed << "/" << tile_count << " tiles)"
+                        << std::flush;
+                }
+            }
+            };
+
+        std::vector<std::thread> threads;
+        for (unsigned int t = 0; t < thread_count; ++t) {
+            threads.emplace_back(render_tiles);
+        }
+
+        for (auto& t : threads) {
+            t.join();
+        }
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        render_stats.passes++;
+    }
+
+    // Hash of every setting that decides which samples a render takes, so a checkpoint is
+    // only resumed by a render that would have taken the same ones.
+    uint64_t settingsFingerprint() const {
+        uint64_t hash = 0;
+        auto add = [&](uint64_t value) { hash = mix_bits(hash ^ value); };
+        auto add_double = [&](double value) {
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            add(bits);
+        };
+        add(uint64_t(canvas_width));
+        add(uint64_t(canvas_height));
+        add(uint64_t(samples_per_pixel));
+        add(uint64_t(max_bouces));
+        add(seed);
+        add(sizeof(real));      // Float and double builds take different paths
+        add(objects.size());
+        add_double(vfov);
+        add_double(defocus_angle);
+        add_double(focus_dist);
+        add_double(exposure);
+        for (int c = 0; c < 3; c++) {
+            add_double(lookfrom[c]);
+            add_double(lookat[c]);
+            add_double(vup[c]);
+        }
+        add(uint64_t(russian_roulette) | uint64_t(sample_lights) << 1 | uint64_t(adaptive_sampling) << 2
+            | uint64_t(progressive) << 3 | uint64_t(light_selection) << 4 | uint64_t(sampler) << 5);
+        add(uint64_t(rr_min_bounces));
+        add_double(rr_max_survival);
+        if (adaptive_sampling) {
+            add(uint64_t(adaptive_min_samples));
+            add(uint64_t(adaptive_max_samples));
+            add_double(adaptive_threshold);
+        }
+        if (progressive)
+            add(uint64_t(progressive_pass_samples));
+        return hash;
+    }
+
+    // Takes samples_per_pixel samples for every pixel of one tile, spread over the threads
+    // pixel by pixel. sums is in row order within the tile.
+    void renderTile(const Tile& tile, std::vector<PixelSums>& sums, RenderStats& stats) {
+        unsigned int thread_count = this->thread_count;
+        if (thread_count == 0) thread_count = std::thread::hardware_concurrency();
+        if (thread_count == 0) thread_count = 4;
+
+        int width = tile.x1 - tile.x0;
+        int pixel_count = tile.pixel_count();
+        std::atomic<int> next_pixel(0);
+        std::mutex tile_stats_mutex;
+
+        auto render_pixels = [&]() {
+            RenderStats thread_stats;
+            for (int p = next_pixel.fetch_add(1); p < pixel_count; p = next_pixel.fetch_add(1))
+                samplePixel(tile.x0 + p % width, tile.y0 + p / width, samples_per_pixel, sums[p], thread_stats);
+            std::lock_guard<std::mutex> lock(tile_stats_mutex);
+            stats.Merge(thread_stats);
+            };
+
+        std::vector<std::thread> threads;
+        for (unsigned int t = 1; t < std::min(thread_count, unsigned(pixel_count)); ++t)
+            threads.emplace_back(render_pixels);
+        render_pixels();
+        for (auto& t : threads)
+            t.join();
     }
 
-    void samplePixel(int i, int j, PixelInfo& pixel) {
-        PixelInfo pixel1;
-        pixel1.depth = 0.0; // Ensure depth is initialized
+    void samplePixel(int i, int j, int count, PixelSums& sums, RenderStats& stats) {
+        // Every pixel gets its own random stream, independent of the thread rendering it.
+        // Later batches of the same pixel continue on a stream of their own, picked by the
+        // index of their first sample.
+        // The stream serves the independent sampler and custom materials; the other samplers
+        // derive every sample from the pixel and its index within the pixel.
+        uint64_t pixel_index = uint64_t(j) * canvas_width + i;
+        seed_thread_rng(seed, pixel_index + (uint64_t(sums.samples) << 32));
+        Sampler pixel_sampler(sampler, seed, canvas_width, canvas_height, samples_per_pixel);
+        uint64_t first_sample = uint64_t(sums.samples);
+
+        for (int sample = 0; sample < count; sample++) {
+            pixel_sampler.StartPixelSample(i, j, pixel_index, first_sample + sample);
+            Ray r = getRay(i, j, pixel_sampler);
+            PixelInfo pixel;
+            getRayHit(r, pixel_sampler, pixel, stats);
+            sums.Add(pixel);
+        }
+    }
 
-        for (int sample = 0; sample < samples_per_pixel; sample++) {
-            Ray r = getRay(i, j);
-            PixelInfo pixel2;
-            getRayHit(r, max_bouces, pixel2);
-            pixel1.color = pixel1.color + pixel2.color;
-            pixel1.albedo = pixel1.albedo + pixel2.albedo;
-            pixel1.normal = pixel1.normal + pixel2.normal;
-            pixel1.depth += pixel2.depth;
+    // Path states of the wavefront mode, one array per field. Path k takes the samples of
+    // pixel k of the tile one after another, so the arrays are indexed by pixel too.
+    class WavefrontBuffers {
+    public:
+        static constexpr int queue_count = 6;   // Rays that missed, then one per MaterialType
+
+        // Per pixel
+        std::vector<int> pixel_i, pixel_j;
+        std::vector<int> remaining;         // Samples still to start
+        std::vector<PixelSums> sums;
+        std::vector<Pcg32> rng;
+        std::vector<Sampler> samplers;
+        // Per path
+        std::vector<unsigned char> active;
+        std::vector<int> bounce;
+        std::vector<Ray> ray;
+        std::vector<Color> throughput;
+        std::vector<PathVertex> prev;
+        std::vector<PixelInfo> pixel;
+        std::vector<unsigned char> found;
+        std::vector<HitRecord> hit;
+        std::vector<ShadowRay> shadow;
+        std::vector<unsigned char> ended;
+        // Paths with a ray in flight, and the same sorted by what their rays hit
+        std::vector<int> live;
+        std::vector<int> queue;
+        std::vector<unsigned char> queue_key;
+
+        void resize(size_t n) {
+            remaining.resize(n);
+            sums.resize(n);
+            rng.resize(n);
+            active.assign(n, 0);
+            bounce.resize(n);
+            ray.resize(n);
+            throughput.resize(n);
+            prev.resize(n);
+            pixel.resize(n);
+            found.resize(n);
+            hit.resize(n);
+            shadow.resize(n);
+            ended.resize(n);
+            queue_key.resize(n);
         }
+    };
+
+    // Renders the samples a tile still needs in wavefront order. Each path keeps the
+    // sampler and random stream of its pixel, switched in around every stage that draws
+    // numbers, and shades through the same shadeHit as getRayHit, so the image is the one
+    // the per-path loop gives.
+    void renderTileWavefront(const Tile& tile, WavefrontBuffers& b, RenderStats& stats) {
+        b.pixel_i.clear();
+        b.pixel_j.clear();
+        for (int j = tile.y0; j < tile.y1; j++) {
+            for (int i = tile.x0; i < tile.x1; i++) {
+                int index = j * canvas_width + i;
+                if (pass_target[index] > pixel_sums[index].samples) {
+                    b.pixel_i.push_back(i);
+                    b.pixel_j.push_back(j);
+                }
+            }
+        }
+        size_t n = b.pixel_i.size();
+        b.resize(n);
+        b.samplers.clear();
+        for (size_t k = 0; k < n; k++) {
+            int index = b.pixel_j[k] * canvas_width + b.pixel_i[k];
+            // Sample into copies, so a checkpoint never sees a pixel half done.
+            b.sums[k] = pixel_sums[index];
+            b.remaining[k] = pass_target[index] - b.sums[k].samples;
+            seed_thread_rng(seed, uint64_t(index) + (uint64_t(b.sums[k].samples) << 32));
+            b.rng[k] = thread_rng();
+            b.samplers.emplace_back(sampler, seed, canvas_width, canvas_height, samples_per_pixel);
+        }
+
+        auto finish_path = [&](size_t k) {
+            b.sums[k].Add(b.pixel[k]);
+            b.remaining[k]--;
+            b.active[k] = 0;
+        };
+
+        while (true) {
+            // Generate: pixels between samples start their next camera ray.
+            b.live.clear();
+            for (size_t k = 0; k < n; k++) {
+                while (!b.active[k] && b.remaining[k] > 0) {
+                    int i = b.pixel_i[k], j = b.pixel_j[k];
+                    uint64_t pixel_index = uint64_t(j) * canvas_width + i;
+                    thread_rng() = b.rng[k];
+                    b.samplers[k].StartPixelSample(i, j, pixel_index, uint64_t(b.sums[k].samples));
+                    b.ray[k] = getRay(i, j, b.samplers[k]);
+                    b.rng[k] = thread_rng();
+                    b.throughput[k] = Color(1, 1, 1);
+                    b.prev[k] = PathVertex();
+                    startPath(b.pixel[k]);
+                    b.bounce[k] = 0;
+                    b.active[k] = 1;
+                    stats.paths++;
+                    if (max_bouces <= 0)
+                        finish_path(k);
+                }
+                if (b.active[k])
+                    b.live.push_back(int(k));
+            }
+            if (b.live.empty())
+                break;
+
+            // Extend: the next ray of every path.
+            for (int k : b.live) {
+                stats.rays++;
+                b.found[k] = Intersect(b.ray[k], clip_interval, b.hit[k]);
+            }
 
-        pixel.color = pixel_samples_scale * pixel1.color;
-        pixel.albedo = pixel_samples_scale * pixel1.albedo;
-        pixel.normal = pixel_samples_scale * pixel1.normal;
-        pixel.depth = pixel_samples_scale * pixel1.depth;
-        return;
+            // Sort the paths by what they hit, a counting sort over the queues.
+            int queue_start[WavefrontBuffers::queue_count + 1] = {};
+            for (int k : b.live) {
+                b.queue_key[k] = b.found[k] ? 1 + int(material_table[b.hit[k].mat_id].type) : 0;
+                queue_start[b.queue_key[k] + 1]++;
+            }
+            for (int q = 0; q < WavefrontBuffers::queue_count; q++)
+                queue_start[q + 1] += queue_start[q];
+            b.queue.resize(b.live.size());
+            for (int k : b.live)
+                b.queue[queue_start[b.queue_key[k]]++] = k;
+
+            // Shade: one queue after the other, so each runs one material's code in a loop.
+            for (int k : b.queue) {
+                thread_rng() = b.rng[k];
+                b.shadow[k].pending = false;
+                bool more = shadeHit(b.found[k], b.hit[k], b.bounce[k], b.ray[k], b.throughput[k], b.prev[k],
+                    b.pixel[k], b.samplers[k], b.shadow[k]);
+                b.rng[k] = thread_rng();
+                b.ended[k] = !more || ++b.bounce[k] >= max_bouces;
+            }
+
+            // Shadow rays of the light samples taken while shading
+            for (int k : b.live) {
+                if (b.shadow[k].pending)
+                    traceShadowRay(b.shadow[k], b.pixel[k], stats);
+            }
+
+            for (int k : b.live) {
+                if (b.ended[k])
+                    finish_path(k);
+            }
+        }
+
+        for (size_t k = 0; k < n; k++) {
+            std::lock_guard<std::mutex> lock(row_locks[b.pixel_j[k] % row_lock_count]);
+            pixel_sums[b.pixel_j[k] * canvas_width + b.pixel_i[k]] = b.sums[k];
+        }
     }
 
-    Point3 defocus_disk_sample() const {
-        // Returns a random point in the camera defocus disk.
-        Vec3 p = random_in_unit_disk();
+    // A pixel of a block sampled by samplePixelBlock, with the samples it is to take, its
+    // sums and its random stream.
+    class BlockPixel {
+    public:
+        int i, j;
+        int count;
+        PixelSums sums;
+        Pcg32 rng;
+    };
+
+    // Pixels per block whose camera rays make up one packet of size rays, 1 x 1 without
+    // packets.
+    static void packetBlock(int size, int& width, int& height) {
+        width = size >= 8 ? 4 : size >= 4 ? 2 : 1;
+        height = size >= 16 ? 4 : size >= 4 ? 2 : 1;
+    }
+
+    // samplePixel for a block of up to RayPacket::max_size neighbouring pixels. Sample by
+    // sample, the camera rays of the pixels that still want one are intersected as a
+    // packet, then each path goes on alone. Every pixel keeps a sampler and a random stream
+    // of its own, switched in around its turn, so it draws the numbers samplePixel would
+    // have given it and comes out the same.
+    void samplePixelBlock(std::vector<BlockPixel>& block, RenderStats& stats) {
+        std::vector<Sampler> samplers;
+        samplers.reserve(block.size());
+        int max_count = 0;
+        for (BlockPixel& pixel : block) {
+            uint64_t pixel_index = uint64_t(pixel.j) * canvas_width + pixel.i;
+            seed_thread_rng(seed, pixel_index + (uint64_t(pixel.sums.samples) << 32));
+            pixel.rng = thread_rng();
+            samplers.emplace_back(sampler, seed, canvas_width, canvas_height, samples_per_pixel);
+            max_count = std::max(max_count, pixel.count);
+        }
+
+        RayPacket packet;
+        Ray rays[RayPacket::max_size];
+        PrimaryHit hits[RayPacket::max_size];
+        int lane_pixel[RayPacket::max_size];
+        for (int sample = 0; sample < max_count; sample++) {
+            packet.Clear();
+            for (size_t p = 0; p < block.size(); p++) {
+                BlockPixel& pixel = block[p];
+                if (sample >= pixel.count)
+                    continue;
+                // sums.samples counts the samples taken so far, which makes it the index of this one.
+                uint64_t pixel_index = uint64_t(pixel.j) * canvas_width + pixel.i;
+                thread_rng() = pixel.rng;
+                samplers[p].StartPixelSample(pixel.i, pixel.j, pixel_index, uint64_t(pixel.sums.samples));
+                Ray r = getRay(pixel.i, pixel.j, samplers[p]);
+                int lane = packet.Add(r, clip_interval.max);
+                rays[lane] = r;
+                lane_pixel[lane] = int(p);
+                pixel.rng = thread_rng();
+            }
+
+            intersectPacket(packet, rays, hits);
+
+            for (int lane = 0; lane < packet.size; lane++) {
+                int p = lane_pixel[lane];
+                BlockPixel& pixel = block[p];
+                thread_rng() = pixel.rng;
+                PixelInfo info;
+                getRayHit(rays[lane], samplers[p], info, stats, &hits[lane]);
+                pixel.sums.Add(info);
+                pixel.rng = thread_rng();
+            }
+        }
+    }
+
+    Point3 defocus_disk_sample(Sampler& sampler) const {
+        // Returns a sampled point in the camera defocus disk.
+        Vec3 p = sample_unit_disk(sampler.Get2D(sample_dim::lens));
         return camera_center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 public:
-    std::vector<Color> get_color_map() const {
+    const std::vector<Color>& get_color_map() const {
         return color_map;
     }
 
-    std::vector<Color> get_albedo_map() const {
+    const std::vector<Color>& get_albedo_map() const {
         return albedo_map;
     }
 
-    std::vector<Vec3> get_normal_map() const {
+    const std::vector<Vec3>& get_normal_map() const {
         return normal_map;
     }
 
-    std::vector<double> get_depth_map() const {
+    const std::vector<double>& get_depth_map() const {
         return depth_map;
     }
+
+    // Samples each pixel received; with adaptive sampling this shows where the budget went.
+    std::vector<double> get_sample_map() const {
+        std::vector<double> samples(pixel_sums.size());
+        for (size_t i = 0; i < pixel_sums.size(); i++)
+            samples[i] = pixel_sums[i].samples;
+        return samples;
+    }
+
+    const RenderStats& get_render_stats() const {
+        return render_stats;
+    }
+
+    size_t object_count() const {
+        return objects.size();
+    }
+
+    size_t bvh_node_count() const {
+        return bvh.node_count();
+    }
+
+    size_t bvh_memory_usage() const {
+        return bvh.memory_usage();
+    }
+
+    // Valid once the light list has been built, i.e. after Render or BuildLightList.
+    size_t light_count() const {
+        return lights.size();
+    }
+
+    // Intersects one camera ray through every pixel on the calling thread, in packets of
+    // packet_size rays as the setting of that name would, and returns how many of them hit
+    // something. Measures the cost of camera rays apart from shading; the BVH must be built.
+    uint64_t TraceCameraRays(int packet_size) {
+        int block_width, block_height;
+        packetBlock(packet_size, block_width, block_height);
+        Sampler pixel_sampler(sampler, seed, canvas_width, canvas_height, 1);
+        RayPacket packet;
+        Ray rays[RayPacket::max_size];
+        PrimaryHit hits[RayPacket::max_size];
+        uint64_t hit_count = 0;
+        for (int y = 0; y < canvas_height; y += block_height) {
+            for (int x = 0; x < canvas_width; x += block_width) {
+                packet.Clear();
+                for (int j = y; j < std::min(y + block_height, canvas_height); j++) {
+                    for (int i = x; i < std::min(x + block_width, canvas_width); i++) {
+                        uint64_t pixel_index = uint64_t(j) * canvas_width + i;
+                        seed_thread_rng(seed, pixel_index);
+                        pixel_sampler.StartPixelSample(i, j, pixel_index, 0);
+                        Ray r = getRay(i, j, pixel_sampler);
+                        rays[packet.Add(r, clip_interval.max)] = r;
+                    }
+                }
+                if (packet.size == 1)
+                    hits[0].found = Intersect(rays[0], clip_interval, hits[0].rec);
+                else
+                    intersectPacket(packet, rays, hits);
+                for (int k = 0; k < packet.size; k++)
+                    hit_count += hits[k].found ? 1 : 0;
+            }
+        }
+        return hit_count;
+    }
 };
 
 
@@ -0,0 +1,445 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <climits>
+#include <unordered_map>
+#include <filesystem>
+
+#include "Scene.h"
+#include "Object.h"
+#include "Material.h"
+#include "MeshLoader.h"
+#include "MappedFile.h"
+
+namespace fs = std::filesystem;
+
+// Scene files, so scenes can change without a recompile.
+//
+// The text form has one statement per line; '#' starts a comment:
+//   width 1280                  image size, sampling and camera settings, each optional:
+//   height 720                  width, height, samples, max_bounces, seed, exposure, vfov,
+//   samples 150                 lookfrom X Y Z, lookat X Y Z, vup X Y Z, defocus_angle,
+//   lookfrom 13 2 3             focus_dist
+//   material NAME lambertian R G B
+//   material NAME metal R G B FUZZ
+//   material NAME dielectric IOR
+//   material NAME emission R G B INTENSITY
+//   sphere X Y Z RADIUS MATERIAL
+//   mesh PATH MATERIAL          OBJ or PLY, relative to the scene file
+//
+// The binary form holds the same scene as fixed size records behind a header and is used
+// straight from a memory mapping, so even millions of spheres cost no parsing. Write one
+// with WriteBinaryScene; LoadSceneFile accepts either form.
+
+enum class SceneMaterialType : uint32_t {
+    Lambertian,
+    Metal,
+    Dielectric,
+    Emission
+};
+
+// Record layouts of the binary form. Every one is a multiple of 8 bytes, so records stay
+// aligned within the file.
+class SceneMaterialRecord {
+public:
+    uint32_t type;
+    uint32_t reserved = 0;
+    double color[3];
+    double value;           // Fuzz, refractive index or intensity
+};
+
+class SceneSphereRecord {
+public:
+    double center[3];
+    double radius;
+    uint32_t material;
+    uint32_t reserved = 0;
+};
+
+class SceneHeader {
+public:
+    char magic[8];
+    uint32_t byte_order_mark;
+    uint32_t version;
+    int32_t width, height;
+    int32_t samples_per_pixel, max_bounces;
+    uint64_t seed;
+    double vfov, defocus_angle, focus_dist, exposure;
+    double lookfrom[3], lookat[3], vup[3];
+    uint64_t material_count, sphere_count, mesh_count;
+};
+
+static_assert(sizeof(SceneMaterialRecord) == 40 && sizeof(SceneSphereRecord) == 40, "scene record layout");
+static_assert(sizeof(SceneHeader) == 168, "scene header layout");
+
+// A parsed scene, before it is added to a Scene.
+class SceneDescription {
+public:
+    class Mesh {
+    public:
+        fs::path path;
+        uint32_t material;
+    };
+
+    int width = 1280;
+    int height = 720;
+    int samples_per_pixel = 150;
+    int max_bounces = 100;
+    uint64_t seed = 0;
+    double vfov = 90;
+    Point3 lookfrom = Point3(0, 0, 0);
+    Point3 lookat = Point3(0, 0, -1);
+    Vec3 vup = Vec3(0, 1, 0);
+    double defocus_angle = 0;
+    double focus_dist = 10;
+    double exposure = 1;
+
+    std::vector<SceneMaterialRecord> materials;
+    std::vector<SceneSphereRecord> spheres;
+    std::vector<Mesh> meshes;   // Paths as given, resolved against the scene file's directory
+};
+
+namespace scene_file {
+
+    constexpr char binary_magic[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+    constexpr uint32_t byte_order_mark = 0x01020304;
+    constexpr uint32_t binary_version = 1;
+
+    inline std::shared_ptr<Material> make_material(const SceneMaterialRecord& record) {
+        Color color(record.color[0], record.color[1], record.color[2]);
+        switch (SceneMaterialType(record.type)) {
+        case SceneMaterialType::Lambertian: return MakeLambertian(color);
+        case SceneMaterialType::Metal: return MakeMetal(color, record.value);
+        case SceneMaterialType::Dielectric: return MakeDielectric(record.value);
+        case SceneMaterialType::Emission: return MakeEmission(color, record.value);
+        default: return nullptr;
+        }
+    }
+
+    inline void apply_settings(Scene& scene, const SceneHeader& header) {
+        scene.canvas_width = header.width;
+        scene.canvas_height = header.height;
+        scene.samples_per_pixel = header.samples_per_pixel;
+        scene.max_bouces = header.max_bounces;
+        scene.seed = header.seed;
+        scene.vfov = header.vfov;
+        scene.defocus_angle = header.defocus_angle;
+        scene.focus_dist = header.focus_dist;
+        scene.exposure = header.exposure;
+        scene.lookfrom = Point3(header.lookfrom[0], header.lookfrom[1], header.lookfrom[2]);
+        scene.lookat = Point3(header.lookat[0], header.lookat[1], header.lookat[2]);
+        scene.vup = Vec3(header.vup[0], header.vup[1], header.vup[2]);
+    }
+
+    inline SceneHeader make_header(const SceneDescription& desc) {
+        SceneHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, binary_magic, sizeof(binary_magic));
+        header.byte_order_mark = byte_order_mark;
+        header.version = binary_version;
+        header.width = desc.width;
+        header.height = desc.height;
+        header.samples_per_pixel = desc.samples_per_pixel;
+        header.max_bounces = desc.max_bounces;
+        header.seed = desc.seed;
+        header.vfov = desc.vfov;
+        header.defocus_angle = desc.defocus_angle;
+        header.focus_dist = desc.focus_dist;
+        header.exposure = desc.exposure;
+        for (int c = 0; c < 3; c++) {
+            header.lookfrom[c] = desc.lookfrom[c];
+            header.lookat[c] = desc.lookat[c];
+            header.vup[c] = desc.vup[c];
+        }
+        header.material_count = desc.materials.size();
+        header.sphere_count = desc.spheres.size();
+        header.mesh_count = desc.meshes.size();
+        return header;
+    }
+
+    // Adds spheres and meshes, which refer to the materials by index.
+    inline bool add_objects(Scene& scene, const std::vector<std::shared_ptr<Material>>& materials,
+        const SceneSphereRecord* spheres, size_t sphere_count, const std::vector<SceneDescription::Mesh>& meshes,
+        const fs::path& path) {
+        scene.ReserveObjects(sphere_count + meshes.size());
+        for (size_t s = 0; s < sphere_count; s++) {
+            SceneSphereRecord sphere;
+            std::memcpy(&sphere, &spheres[s], sizeof(sphere));
+            if (sphere.material >= materials.size()) {
+                std::cerr << path.string() << ": sphere " << s << " has no material" << std::endl;
+                return false;
+            }
+            scene.AddObject(MakeSphere(Point3(sphere.center[0], sphere.center[1], sphere.center[2]),
+                sphere.radius, materials[sphere.material]));
+        }
+        for (const SceneDescription::Mesh& mesh : meshes) {
+            if (mesh.material >= materials.size()) {
+                std::cerr << path.string() << ": mesh " << mesh.path.string() << " has no material" << std::endl;
+                return false;
+            }
+            auto object = LoadMesh(mesh.path, materials[mesh.material]);
+            if (!object)
+                return false;
+            scene.AddObject(object);
+        }
+        return true;
+    }
+
+    inline const char* read_word(const char*& p, const char* end, size_t& length) {
+        using namespace mesh_loader;
+        p = skip_spaces(p, end);
+        const char* word = p;
+        while (p < end && !is_space(*p) && *p != '\n' && *p != '#') p++;
+        length = size_t(p - word);
+        return word;
+    }
+}
+
+// Parses the text form. Reports the first error with its line and returns false.
+inline bool ParseSceneText(const fs::path& path, SceneDescription& desc) {
+    using namespace mesh_loader;
+    using namespace scene_file;
+
+    MappedFile file;
+    if (!file.Open(path)) {
+        std::cerr << "Failed to open " << path.string() << std::endl;
+        return false;
+    }
+    const char* begin = file.data();
+    const char* end = begin + file.size();
+
+    std::unordered_map<std::string, uint32_t> material_names;
+    fs::path base = path.parent_path();
+    size_t line_number = 0;
+    for (const char* line = begin, *line_end; line < end; line = line_end) {
+        line_number++;
+        line_end = next_line(line, end);
+        const char* p = line;
+        auto fail = [&](const std::string& message) {
+            std::cerr << path.string() << ":" << line_number << ": " << message << std::endl;
+            return false;
+        };
+        auto numbers = [&](double* values, int count) {
+            for (int k = 0; k < count; k++)
+                if (!parse_double(p, line_end, values[k])) return false;
+            return true;
+        };
+        auto word = [&]() {
+            size_t length;
+            const char* w = read_word(p, line_end, length);
+            return std::string(w, length);
+        };
+
+        size_t length;
+        const char* keyword = read_word(p, line_end, length);
+        if (length == 0)
+            continue;
+        auto is = [&](const char* name) { return std::strlen(name) == length && std::memcmp(keyword, name, length) == 0; };
+
+        double v[4];
+        if (is("sphere")) {
+            if (!numbers(v, 4))
+                return fail("expected sphere X Y Z RADIUS MATERIAL");
+            std::string name = word();
+            auto found = material_names.find(name);
+            if (found == material_names.end())
+                return fail("unknown material '" + name + "'");
+            SceneSphereRecord sphere;
+            sphere.center[0] = v[0];
+            sphere.center[1] = v[1];
+            sphere.center[2] = v[2];
+            sphere.radius = v[3];
+            sphere.material = found->second;
+            desc.spheres.push_back(sphere);
+        }
+        else if (is("material")) {
+            std::string name = word();
+            std::string type = word();
+            SceneMaterialRecord material;
+            material.color[0] = material.color[1] = material.color[2] = 0;
+            material.value = 0;
+            bool ok;
+            if (type == "lambertian") {
+                material.type = uint32_t(SceneMaterialType::Lambertian);
+                ok = numbers(material.color, 3);
+            }
+            else if (type == "metal") {
+                material.type = uint32_t(SceneMaterialType::Metal);
+                ok = numbers(material.color, 3) && numbers(&material.value, 1);
+            }
+            else if (type == "dielectric") {
+                material.type = uint32_t(SceneMaterialType::Dielectric);
+                ok = numbers(&material.value, 1);
+            }
+            else if (type == "emission") {
+                material.type = uint32_t(SceneMaterialType::Emission);
+                ok = numbers(material.color, 3) && numbers(&material.value, 1);
+            }
+            else {
+                return fail("unknown material type '" + type + "'");
+            }
+            if (name.empty() || !ok)
+                return fail("malformed " + type + " material");
+            if (!material_names.emplace(name, uint32_t(desc.materials.size())).second)
+                return fail("material '" + name + "' defined twice");
+            desc.materials.push_back(material);
+        }
+        else if (is("mesh")) {
+            std::string mesh_path = word();
+            std::string name = word();
+            auto found = material_names.find(name);
+            if (mesh_path.empty() || found == material_names.end())
+                return fail("expected mesh PATH MATERIAL with a known material");
+            desc.meshes.push_back({ base / mesh_path, found->second });
+        }
+        else if (is("lookfrom") || is("lookat") || is("vup")) {
+            if (!numbers(v, 3))
+                return fail("expected three numbers");
+            Vec3 value(v[0], v[1], v[2]);
+            if (is("lookfrom")) desc.lookfrom = value;
+            else if (is("lookat")) desc.lookat = value;
+            else desc.vup = value;
+        }
+        else if (is("width") || is("height") || is("samples") || is("max_bounces") || is("seed")) {
+            long long value;
+            p = skip_spaces(p, line_end);
+            if (!parse_int(p, line_end, value) || value < 0 || (!is("seed") && (value == 0 || value > INT_MAX)))
+                return fail("expected a positive integer");
+            if (is("width")) desc.width = int(value);
+            else if (is("height")) desc.height = int(value);
+            else if (is("samples")) desc.samples_per_pixel = int(value);
+            else if (is("max_bounces")) desc.max_bounces = int(value);
+            else desc.seed = uint64_t(value);
+        }
+        else if (is("vfov") || is("defocus_angle") || is("focus_dist") || is("exposure")) {
+            if (!numbers(v, 1))
+                return fail("expected a number");
+            if (is("vfov")) desc.vfov = v[0];
+            else if (is("defocus_angle")) desc.defocus_angle = v[0];
+            else if (is("focus_dist")) desc.focus_dist = v[0];
+            else desc.exposure = v[0];
+        }
+        else {
+            return fail("unknown statement '" + std::string(keyword, length) + "'");
+        }
+
+        size_t rest;
+        const char* extra = read_word(p, line_end, rest);
+        if (rest != 0)
+            return fail("unexpected '" + std::string(extra, rest) + "'");
+    }
+    return true;
+}
+
+// Sets up scene as described: settings first, then the objects. Call Init afterwards.
+inline bool BuildScene(Scene& scene, const SceneDescription& desc, const fs::path& path) {
+    using namespace scene_file;
+    apply_settings(scene, make_header(desc));
+    std::vector<std::shared_ptr<Material>> materials;
+    for (const SceneMaterialRecord& record : desc.materials)
+        materials.push_back(make_material(record));
+    return add_objects(scene, materials, desc.spheres.data(), desc.spheres.size(), desc.meshes, path);
+}
+
+inline bool WriteBinaryScene(const SceneDescription& desc, const fs::path& path) {
+    using namespace scene_file;
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        std::cerr << "Failed to create " << path.string() << std::endl;
+        return false;
+    }
+    SceneHeader header = make_header(desc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(desc.materials.data()), std::streamsize(desc.materials.size() * sizeof(SceneMaterialRecord)));
+    file.write(reinterpret_cast<const char*>(desc.spheres.data()), std::streamsize(desc.spheres.size() * sizeof(SceneSphereRecord)));
+
+    // Meshes: material and path length as uint32s, then the path padded to 8 bytes. Paths are
+    // stored relative to the binary file where possible.
+    fs::path base = fs::absolute(path).parent_path();
+    for (const SceneDescription::Mesh& mesh : desc.meshes) {
+        std::string mesh_path = fs::proximate(fs::absolute(mesh.path), base).generic_string();
+        uint32_t fields[2] = { mesh.material, uint32_t(mesh_path.size()) };
+        file.write(reinterpret_cast<const char*>(fields), sizeof(fields));
+        file.write(mesh_path.data(), std::streamsize(mesh_path.size()));
+        static const char padding[8] = {};
+        file.write(padding, std::streamsize((8 - mesh_path.size() % 8) % 8));
+    }
+    if (!file.flush()) {
+        std::cerr << "Failed to write " << path.string() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Loads the text or the binary form, told apart by the binary header.
+inline bool LoadSceneFile(Scene& scene, const fs::path& path) {
+    using namespace scene_file;
+
+    MappedFile file;
+    if (!file.Open(path)) {
+        std::cerr << "Failed to open " << path.string() << std::endl;
+        return false;
+    }
+    if (file.size() < sizeof(binary_magic) || std::memcmp(file.data(), binary_magic, sizeof(binary_magic)) != 0) {
+        file.Close();
+        SceneDescription desc;
+        return ParseSceneText(path, desc) && BuildScene(scene, desc, path);
+    }
+
+    auto fail = [&](const char* message) {
+        std::cerr << path.string() << ": " << message << std::endl;
+        return false;
+    };
+    if (file.size() < sizeof(SceneHeader))
+        return fail("truncated scene");
+    SceneHeader header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (header.byte_order_mark != byte_order_mark || header.version != binary_version)
+        return fail("scene written by an incompatible build");
+
+    size_t size = file.size();
+    size_t offset = sizeof(SceneHeader);
+    if (header.material_count > (size - offset) / sizeof(SceneMaterialRecord))
+        return fail("truncated scene");
+    const char* material_data = file.data() + offset;
+    offset += header.material_count * sizeof(SceneMaterialRecord);
+    if (header.sphere_count > (size - offset) / sizeof(SceneSphereRecord))
+        return fail("truncated scene");
+    const SceneSphereRecord* spheres = reinterpret_cast<const SceneSphereRecord*>(file.data() + offset);
+    offset += header.sphere_count * sizeof(SceneSphereRecord);
+
+    std::vector<SceneDescription::Mesh> meshes;
+    fs::path base = path.parent_path();
+    for (uint64_t m = 0; m < header.mesh_count; m++) {
+        uint32_t fields[2];
+        if (size - offset < sizeof(fields))
+            return fail("truncated scene");
+        std::memcpy(fields, file.data() + offset, sizeof(fields));
+        offset += sizeof(fields);
+        if (size - offset < fields[1])
+            return fail("truncated scene");
+        meshes.push_back({ base / std::string(file.data() + offset, fields[1]), fields[0] });
+        offset += (fields[1] + 7) / 8 * 8;
+    }
+
+    std::vector<std::shared_ptr<Material>> materials;
+    for (uint64_t m = 0; m < header.material_count; m++) {
+        SceneMaterialRecord record;
+        std::memcpy(&record, material_data + m * sizeof(SceneMaterialRecord), sizeof(record));
+        materials.push_back(make_material(record));
+        if (!materials.back())
+            return fail("unknown material type");
+    }
+
+    apply_settings(scene, header);
+    return add_objects(scene, materials, spheres, header.sphere_count, meshes, path);
+}
+
+#endif
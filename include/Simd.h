@@ -0,0 +1,87 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstdint>
+
+// Runtime selection of SIMD code paths. Kernels are compiled for every instruction set
+// the target architecture can have and the best one the running CPU supports is picked,
+// so the program itself can still be built for the baseline architecture.
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define RT_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+#else
+#define RT_SIMD_X86 0
+#endif
+
+// Allows a single function to use AVX instructions without building everything for AVX.
+#if RT_SIMD_X86 && (defined(__GNUC__) || defined(__clang__))
+#define RT_TARGET_AVX __attribute__((target("avx")))
+#else
+#define RT_TARGET_AVX
+#endif
+
+// Forces a generic kernel inline, so an RT_TARGET_AVX function that calls it gets a copy
+// compiled (and vectorized) for AVX rather than a call to the baseline version.
+#if defined(__GNUC__) || defined(__clang__)
+#define RT_FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define RT_FORCE_INLINE __forceinline
+#else
+#define RT_FORCE_INLINE inline
+#endif
+
+// Promises the compiler that a pointer's data is reached through no other pointer in
+// scope, which spares loops the run-time overlap checks that can stop them vectorising.
+#if defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER)
+#define RT_RESTRICT __restrict
+#else
+#define RT_RESTRICT
+#endif
+
+// Position of the lowest set bit of a non-zero lane mask.
+inline int lowest_set_bit(uint32_t mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return int(index);
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+enum class SimdLevel {
+    Scalar,
+    SSE2,   // 2 doubles or 4 floats per register, always present on x86-64
+    AVX     // 4 doubles or 8 floats per register
+};
+
+inline SimdLevel DetectSimdLevel() {
+#if RT_SIMD_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+    if (os_saves_ymm && (info[2] & (1 << 28)))
+        return SimdLevel::AVX;
+#else
+    if (__builtin_cpu_supports("avx"))
+        return SimdLevel::AVX;
+#endif
+    return SimdLevel::SSE2;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+// The level kernels dispatch on. Detected once, and may be lowered (for example to
+// compare against the scalar code) but must not be raised above what the CPU supports.
+inline SimdLevel& simd_level() {
+    static SimdLevel level = DetectSimdLevel();
+    return level;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,303 @@
+#ifndef SOCKET_H
+#define SOCKET_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// Blocking stream socket carrying length-prefixed messages, for distributed rendering.
+// Addresses are "unix:/path/to/socket" for a Unix domain socket or "host:port" for TCP.
+// POSIX only; on Windows every call fails.
+class Socket {
+public:
+    Socket() {}
+    explicit Socket(int fd) : fd(fd) {}
+    ~Socket() { Close(); }
+
+    Socket(Socket&& other) noexcept : fd(other.fd) { other.fd = -1; }
+    Socket& operator=(Socket&& other) noexcept {
+        if (this != &other) {
+            Close();
+            fd = other.fd;
+            other.fd = -1;
+        }
+        return *this;
+    }
+    Socket(const Socket&) = delete;
+    Socket& operator=(const Socket&) = delete;
+
+    bool is_open() const { return fd >= 0; }
+    int handle() const { return fd; }
+
+    void Close() {
+#ifndef _WIN32
+        if (fd >= 0) ::close(fd);
+#endif
+        fd = -1;
+    }
+
+    static Socket Listen(const std::string& address) {
+#ifdef _WIN32
+        std::cerr << "Distributed rendering is not supported on Windows" << std::endl;
+        return Socket();
+#else
+        std::string path;
+        if (unixPath(address, path)) {
+            sockaddr_un addr;
+            if (!makeUnixAddress(path, addr))
+                return Socket();
+            // A socket left behind by an earlier coordinator is removed, but nothing else,
+            // and not one a running coordinator still answers on.
+            struct stat existing;
+            if (::lstat(path.c_str(), &existing) == 0) {
+                if (!S_ISSOCK(existing.st_mode)) {
+                    std::cerr << "Failed to listen on " << address << ": " << path << " exists and is not a socket" << std::endl;
+                    return Socket();
+                }
+                Socket probe(::socket(AF_UNIX, SOCK_STREAM, 0));
+                if (probe.is_open() && ::connect(probe.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+                    std::cerr << "Failed to listen on " << address << ": another process is listening on it" << std::endl;
+                    return Socket();
+                }
+                ::unlink(path.c_str());
+            }
+            Socket socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+            if (!socket.is_open() || ::bind(socket.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+                || ::listen(socket.fd, 64) != 0) {
+                std::cerr << "Failed to listen on " << address << ": " << std::strerror(errno) << std::endl;
+                return Socket();
+            }
+            return socket;
+        }
+
+        addrinfo* found = resolve(address, true);
+        if (!found)
+            return Socket();
+        Socket socket;
+        for (addrinfo* info = found; info && !socket.is_open(); info = info->ai_next) {
+            Socket candidate(::socket(info->ai_family, info->ai_socktype, info->ai_protocol));
+            if (!candidate.is_open()) continue;
+            int yes = 1;
+            setsockopt(candidate.fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+            if (::bind(candidate.fd, info->ai_addr, info->ai_addrlen) == 0 && ::listen(candidate.fd, 64) == 0)
+                socket = std::move(candidate);
+        }
+        freeaddrinfo(found);
+        if (!socket.is_open())
+            std::cerr << "Failed to listen on " << address << ": " << std::strerror(errno) << std::endl;
+        return socket;
+#endif
+    }
+
+    static Socket Connect(const std::string& address) {
+#ifdef _WIN32
+        std::cerr << "Distributed rendering is not supported on Windows" << std::endl;
+        return Socket();
+#else
+        std::string path;
+        if (unixPath(address, path)) {
+            sockaddr_un addr;
+            if (!makeUnixAddress(path, addr))
+                return Socket();
+            Socket socket(::socket(AF_UNIX, SOCK_STREAM, 0));
+            if (!socket.is_open() || ::connect(socket.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+                return Socket();
+            return socket;
+        }
+
+        addrinfo* found = resolve(address, false);
+        if (!found)
+            return Socket();
+        Socket socket;
+        for (addrinfo* info = found; info && !socket.is_open(); info = info->ai_next) {
+            Socket candidate(::socket(info->ai_family, info->ai_socktype, info->ai_protocol));
+            if (candidate.is_open() && ::connect(candidate.fd, info->ai_addr, info->ai_addrlen) == 0)
+                socket = std::move(candidate);
+        }
+        freeaddrinfo(found);
+        if (socket.is_open()) {
+            // Tile results are single large messages; do not hold back their tails.
+            int yes = 1;
+            setsockopt(socket.fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        }
+        return socket;
+#endif
+    }
+
+    Socket Accept() {
+#ifdef _WIN32
+        return Socket();
+#else
+        Socket socket(::accept(fd, nullptr, nullptr));
+        if (socket.is_open()) {
+            int yes = 1;
+            setsockopt(socket.fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));   // Fails harmlessly on Unix sockets
+        }
+        return socket;
+#endif
+    }
+
+    // A message is its type and payload size as two uint32s, then the payload.
+    bool SendMessage(uint32_t type, const std::vector<char>& payload) {
+        uint32_t header[2] = { type, uint32_t(payload.size()) };
+        return sendAll(header, sizeof(header)) && sendAll(payload.data(), payload.size());
+    }
+
+    // Fails on a closed or broken connection and on payloads over max_size.
+    bool ReceiveMessage(uint32_t& type, std::vector<char>& payload, size_t max_size) {
+        uint32_t header[2];
+        if (!receiveAll(header, sizeof(header)) || header[1] > max_size)
+            return false;
+        type = header[0];
+        payload.resize(header[1]);
+        return receiveAll(payload.data(), payload.size());
+    }
+
+private:
+    int fd = -1;
+
+    bool sendAll(const void* data, size_t size) {
+#ifdef _WIN32
+        return false;
+#else
+        const char* bytes = static_cast<const char*>(data);
+        while (size > 0) {
+            // A peer that died must show up as an error, not as SIGPIPE.
+#ifdef MSG_NOSIGNAL
+            ssize_t sent = ::send(fd, bytes, size, MSG_NOSIGNAL);
+#else
+            ssize_t sent = ::send(fd, bytes, size, 0);
+#endif
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) return false;
+            bytes += sent;
+            size -= size_t(sent);
+        }
+        return true;
+#endif
+    }
+
+    bool receiveAll(void* data, size_t size) {
+#ifdef _WIN32
+        return false;
+#else
+        char* bytes = static_cast<char*>(data);
+        while (size > 0) {
+            ssize_t received = ::recv(fd, bytes, size, 0);
+            if (received < 0 && errno == EINTR) continue;
+            if (received <= 0) return false;
+            bytes += received;
+            size -= size_t(received);
+        }
+        return true;
+#endif
+    }
+
+#ifndef _WIN32
+    static bool unixPath(const std::string& address, std::string& path) {
+        if (address.compare(0, 5, "unix:") != 0)
+            return false;
+        path = address.substr(5);
+        return true;
+    }
+
+    static bool makeUnixAddress(const std::string& path, sockaddr_un& addr) {
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            std::cerr << "Bad Unix socket path " << path << std::endl;
+            return false;
+        }
+        std::memcpy(addr.sun_path, path.c_str(), path.size());
+        return true;
+    }
+
+    // "host:port", where an empty host means every interface when listening.
+    static addrinfo* resolve(const std::string& address, bool passive) {
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos) {
+            std::cerr << "Address " << address << " is neither host:port nor unix:path" << std::endl;
+            return nullptr;
+        }
+        std::string host = address.substr(0, colon);
+        std::string port = address.substr(colon + 1);
+
+        addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (passive) hints.ai_flags = AI_PASSIVE;
+        addrinfo* found = nullptr;
+        int error = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &found);
+        if (error != 0) {
+            std::cerr << "Cannot resolve " << address << ": " << gai_strerror(error) << std::endl;
+            return nullptr;
+        }
+        return found;
+    }
+#endif
+};
+
+// Builds a message payload from plain values, in native byte order: the processes on both
+// ends run the same build.
+class MessageWriter {
+public:
+    std::vector<char> bytes;
+
+    template <typename T>
+    void Put(const T& value) {
+        const char* p = reinterpret_cast<const char*>(&value);
+        bytes.insert(bytes.end(), p, p + sizeof(T));
+    }
+
+    void PutBytes(const void* data, size_t size) {
+        const char* p = static_cast<const char*>(data);
+        bytes.insert(bytes.end(), p, p + size);
+    }
+};
+
+// Reads values back in the order they were put. Reading past the end fails and leaves
+// ok() false for good.
+class MessageReader {
+public:
+    explicit MessageReader(const std::vector<char>& bytes) : bytes(bytes) {}
+
+    template <typename T>
+    bool Get(T& value) {
+        return GetBytes(&value, sizeof(T));
+    }
+
+    bool GetBytes(void* data, size_t size) {
+        if (!valid || bytes.size() - offset < size) {
+            valid = false;
+            return false;
+        }
+        std::memcpy(data, bytes.data() + offset, size);
+        offset += size;
+        return true;
+    }
+
+    bool ok() const { return valid; }
+    size_t remaining() const { return bytes.size() - offset; }
+
+private:
+    const std::vector<char>& bytes;
+    size_t offset = 0;
+    bool valid = true;
+};
+
+#endif
@@ -0,0 +1,368 @@
+#ifndef SPHERE_SOA_H
+#define SPHERE_SOA_H
+
+#include <vector>
+#include <limits>
+
+#include "Vec3.h"
+#include "Ray.h"
+#include "Interval.h"
+#include "Simd.h"
+
+// Ray/sphere test shared by Sphere::RayHit and the SphereSoA kernels, which repeat its
+// operations in the same order so that all of them find bit-identical roots. Sets t_hit
+// to the nearest root inside ray_t.
+//
+// The textbook quadratic subtracts nearly equal numbers twice: |oc|^2 - r^2 for a large or
+// distant sphere, and h - sqrt(discriminant) for the near root. In double that costs
+// digits nobody sees; in float it leaves holes and acne on the ground sphere. The float
+// build therefore takes the discriminant from the distance of the centre to the ray's
+// line and the smaller root from the product of the roots (Haines et al., "Precision
+// Improvements for Ray/Sphere Intersection", Ray Tracing Gems 2019).
+template <typename T>
+inline bool intersect_sphere(const Vec3T<T>& center, T radius, const RayT<T>& r, const IntervalT<T>& ray_t, T& t_hit) {
+    const Vec3T<T>& d = r.direction();
+    Vec3T<T> oc = center - r.origin();
+    T a = d.length_squared();
+    T h = dot(d, oc);
+
+    if constexpr (sizeof(T) >= sizeof(double)) {
+        T c = dot(oc, oc) - radius * radius;
+        T discriminant = h * h - a * c;
+        if (!(discriminant >= 0))
+            return false;
+        T sqrtd = std::sqrt(discriminant);
+
+        T root = (h - sqrtd) / a;
+        if (!ray_t.surrounds(root)) {
+            root = (h + sqrtd) / a;
+            if (!ray_t.surrounds(root))
+                return false;
+        }
+        t_hit = root;
+        return true;
+    }
+    else {
+        T inv_a = 1 / a;
+        Vec3T<T> l = oc - (h * inv_a) * d;
+        T discriminant = a * (radius * radius - l.length_squared());
+        if (!(discriminant >= 0))
+            return false;
+        T sqrtd = std::sqrt(discriminant);
+
+        T c = oc.length_squared() - radius * radius;
+        T q = h + std::copysign(sqrtd, h);
+        T t0 = q * inv_a;
+        T t1 = c / q;
+        T near_t = t0 < t1 ? t0 : t1;
+        T far_t = t0 > t1 ? t0 : t1;
+        if (ray_t.surrounds(near_t))
+            t_hit = near_t;
+        else if (ray_t.surrounds(far_t))
+            t_hit = far_t;
+        else
+            return false;
+        return true;
+    }
+}
+
+// Spheres stored as separate arrays of centre coordinates and radii, so one ray can be
+// tested against several spheres per instruction. Used as the leaf storage of the scene
+// BVH, but works just as well on its own as a flat list.
+class SphereSoA {
+public:
+    SphereSoA() { clear(); }
+
+    void clear() {
+        count = 0;
+        cx.assign(padding, nan);
+        cy.assign(padding, nan);
+        cz.assign(padding, nan);
+        radius.assign(padding, nan);
+    }
+
+    void reserve(int n) {
+        cx.reserve(n + padding);
+        cy.reserve(n + padding);
+        cz.reserve(n + padding);
+        radius.reserve(n + padding);
+    }
+
+    void Add(const Point3& center, real r) {
+        cx[count] = center.x();
+        cy[count] = center.y();
+        cz[count] = center.z();
+        radius[count] = r;
+        count++;
+        cx.push_back(nan);
+        cy.push_back(nan);
+        cz.push_back(nan);
+        radius.push_back(nan);
+    }
+
+    // Placeholder slot, for keeping indices aligned with a list that also holds other objects.
+    // It is never hit.
+    void AddEmpty() {
+        Add(Point3(nan, nan, nan), nan);
+    }
+
+    int size() const {
+        return count;
+    }
+
+    // Finds the nearest sphere in [begin, end) that r hits inside ray_t, using the same
+    // arithmetic as intersect_sphere. Returns its index and sets t_hit, or returns -1.
+    int Intersect(const Ray& r, Interval ray_t, int begin, int end, real& t_hit) const {
+        switch (simd_level()) {
+#if RT_SIMD_X86
+        case SimdLevel::AVX:
+            return intersectAVX(r, ray_t, begin, end, t_hit);
+        case SimdLevel::SSE2:
+            return intersectSSE2(r, ray_t, begin, end, t_hit);
+#endif
+        default:
+            return intersectScalar(r, ray_t, begin, end, t_hit);
+        }
+    }
+
+private:
+    // Vector loads may run up to one register width, less one element, past the last sphere.
+    static constexpr int padding = 32 / sizeof(real) - 1;
+    static constexpr real nan = std::numeric_limits<real>::quiet_NaN();
+
+    int count;
+    std::vector<real> cx, cy, cz;
+    std::vector<real> radius;
+
+    int intersectScalar(const Ray& r, Interval ray_t, int begin, int end, real& t_hit) const {
+        int best = -1;
+        real best_t = ray_t.max;
+        for (int i = begin; i < end; i++) {
+            real t;
+            if (intersect_sphere(Point3(cx[i], cy[i], cz[i]), radius[i], r, ray_t, t) && t < best_t) {
+                best_t = t;
+                best = i;
+            }
+        }
+        t_hit = best_t;
+        return best;
+    }
+
+#if RT_SIMD_X86
+#ifndef RT_SINGLE_PRECISION
+    int intersectSSE2(const Ray& r, Interval ray_t, int begin, int end, real& t_hit) const {
+        const Vec3& d = r.direction();
+        const Point3& o = r.origin();
+        __m128d ox = _mm_set1_pd(o.x()), oy = _mm_set1_pd(o.y()), oz = _mm_set1_pd(o.z());
+        __m128d dx = _mm_set1_pd(d.x()), dy = _mm_set1_pd(d.y()), dz = _mm_set1_pd(d.z());
+        __m128d a = _mm_set1_pd(d.length_squared());
+        __m128d t_min = _mm_set1_pd(ray_t.min);
+        __m128d t_max = _mm_set1_pd(ray_t.max);
+        __m128d inf = _mm_set1_pd(infinity);
+
+        int best = -1;
+        double best_t = ray_t.max;
+        for (int i = begin; i < end; i += 2) {
+            __m128d ocx = _mm_sub_pd(_mm_loadu_pd(&cx[i]), ox);
+            __m128d ocy = _mm_sub_pd(_mm_loadu_pd(&cy[i]), oy);
+            __m128d ocz = _mm_sub_pd(_mm_loadu_pd(&cz[i]), oz);
+            __m128d rad = _mm_loadu_pd(&radius[i]);
+
+            __m128d h = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, ocx), _mm_mul_pd(dy, ocy)), _mm_mul_pd(dz, ocz));
+            __m128d oc2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)), _mm_mul_pd(ocz, ocz));
+            __m128d c = _mm_sub_pd(oc2, _mm_mul_pd(rad, rad));
+            __m128d discriminant = _mm_sub_pd(_mm_mul_pd(h, h), _mm_mul_pd(a, c));
+            __m128d valid = _mm_cmpge_pd(discriminant, _mm_setzero_pd());
+            if (_mm_movemask_pd(valid) == 0)
+                continue;
+            __m128d sqrtd = _mm_sqrt_pd(_mm_and_pd(discriminant, valid));
+
+            __m128d near_t = _mm_div_pd(_mm_sub_pd(h, sqrtd), a);
+            __m128d far_t = _mm_div_pd(_mm_add_pd(h, sqrtd), a);
+            __m128d near_ok = _mm_and_pd(_mm_cmpgt_pd(near_t, t_min), _mm_cmplt_pd(near_t, t_max));
+            __m128d far_ok = _mm_and_pd(_mm_cmpgt_pd(far_t, t_min), _mm_cmplt_pd(far_t, t_max));
+            __m128d t = _mm_or_pd(_mm_and_pd(near_ok, near_t), _mm_andnot_pd(near_ok, _mm_or_pd(_mm_and_pd(far_ok, far_t), _mm_andnot_pd(far_ok, inf))));
+            t = _mm_or_pd(_mm_and_pd(valid, t), _mm_andnot_pd(valid, inf));
+
+            alignas(16) double lanes[2];
+            _mm_store_pd(lanes, t);
+            for (int lane = 0; lane < 2 && i + lane < end; lane++) {
+                if (lanes[lane] < best_t) {
+                    best_t = lanes[lane];
+                    best = i + lane;
+                }
+            }
+        }
+        t_hit = best_t;
+        return best;
+    }
+
+    RT_TARGET_AVX int intersectAVX(const Ray& r, Interval ray_t, int begin, int end, real& t_hit) const {
+        const Vec3& d = r.direction();
+        const Point3& o = r.origin();
+        __m256d ox = _mm256_set1_pd(o.x()), oy = _mm256_set1_pd(o.y()), oz = _mm256_set1_pd(o.z());
+        __m256d dx = _mm256_set1_pd(d.x()), dy = _mm256_set1_pd(d.y()), dz = _mm256_set1_pd(d.z());
+        __m256d a = _mm256_set1_pd(d.length_squared());
+        __m256d t_min = _mm256_set1_pd(ray_t.min);
+        __m256d t_max = _mm256_set1_pd(ray_t.max);
+        __m256d inf = _mm256_set1_pd(infinity);
+
+        int best = -1;
+        double best_t = ray_t.max;
+        for (int i = begin; i < end; i += 4) {
+            __m256d ocx = _mm256_sub_pd(_mm256_loadu_pd(&cx[i]), ox);
+            __m256d ocy = _mm256_sub_pd(_mm256_loadu_pd(&cy[i]), oy);
+            __m256d ocz = _mm256_sub_pd(_mm256_loadu_pd(&cz[i]), oz);
+            __m256d rad = _mm256_loadu_pd(&radius[i]);
+
+            __m256d h = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, ocx), _mm256_mul_pd(dy, ocy)), _mm256_mul_pd(dz, ocz));
+            __m256d oc2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz));
+            __m256d c = _mm256_sub_pd(oc2, _mm256_mul_pd(rad, rad));
+            __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(h, h), _mm256_mul_pd(a, c));
+            __m256d valid = _mm256_cmp_pd(discriminant, _mm256_setzero_pd(), _CMP_GE_OQ);
+            if (_mm256_movemask_pd(valid) == 0)
+                continue;
+            __m256d sqrtd = _mm256_sqrt_pd(_mm256_and_pd(discriminant, valid));
+
+            __m256d near_t = _mm256_div_pd(_mm256_sub_pd(h, sqrtd), a);
+            __m256d far_t = _mm256_div_pd(_mm256_add_pd(h, sqrtd), a);
+            __m256d near_ok = _mm256_and_pd(_mm256_cmp_pd(near_t, t_min, _CMP_GT_OQ), _mm256_cmp_pd(near_t, t_max, _CMP_LT_OQ));
+            __m256d far_ok = _mm256_and_pd(_mm256_cmp_pd(far_t, t_min, _CMP_GT_OQ), _mm256_cmp_pd(far_t, t_max, _CMP_LT_OQ));
+            __m256d t = _mm256_blendv_pd(_mm256_blendv_pd(inf, far_t, far_ok), near_t, near_ok);
+            t = _mm256_blendv_pd(inf, t, valid);
+
+            alignas(32) double lanes[4];
+            _mm256_store_pd(lanes, t);
+            for (int lane = 0; lane < 4 && i + lane < end; lane++) {
+                if (lanes[lane] < best_t) {
+                    best_t = lanes[lane];
+                    best = i + lane;
+                }
+            }
+        }
+        t_hit = best_t;
+        return best;
+    }
+#else
+    // Single precision: 4 and 8 floats per register, in the cancellation free form of
+    // intersect_sphere.
+    int intersectSSE2(const Ray& r, Interval ray_t, int begin, int end, real& t_hit) const {
+        const Vec3& d = r.direction();
+        const Point3& o = r.origin();
+        __m128 ox = _mm_set1_ps(o.x()), oy = _mm_set1_ps(o.y()), oz = _mm_set1_ps(o.z());
+        __m128 dx = _mm_set1_ps(d.x()), dy = _mm_set1_ps(d.y()), dz = _mm_set1_ps(d.z());
+        __m128 a = _mm_set1_ps(d.length_squared());
+        __m128 inv_a = _mm_set1_ps(1 / d.length_squared());
+        __m128 t_min = _mm_set1_ps(ray_t.min);
+        __m128 t_max = _mm_set1_ps(ray_t.max);
+        __m128 inf = _mm_set1_ps(std::numeric_limits<float>::infinity());
+        __m128 sign = _mm_set1_ps(-0.0f);
+
+        int best = -1;
+        float best_t = ray_t.max;
+        for (int i = begin; i < end; i += 4) {
+            __m128 ocx = _mm_sub_ps(_mm_loadu_ps(&cx[i]), ox);
+            __m128 ocy = _mm_sub_ps(_mm_loadu_ps(&cy[i]), oy);
+            __m128 ocz = _mm_sub_ps(_mm_loadu_ps(&cz[i]), oz);
+            __m128 rad = _mm_loadu_ps(&radius[i]);
+            __m128 rad2 = _mm_mul_ps(rad, rad);
+
+            __m128 h = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, ocx), _mm_mul_ps(dy, ocy)), _mm_mul_ps(dz, ocz));
+            __m128 s = _mm_mul_ps(h, inv_a);
+            __m128 lx = _mm_sub_ps(ocx, _mm_mul_ps(s, dx));
+            __m128 ly = _mm_sub_ps(ocy, _mm_mul_ps(s, dy));
+            __m128 lz = _mm_sub_ps(ocz, _mm_mul_ps(s, dz));
+            __m128 l2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz));
+            __m128 discriminant = _mm_mul_ps(a, _mm_sub_ps(rad2, l2));
+            __m128 valid = _mm_cmpge_ps(discriminant, _mm_setzero_ps());
+            if (_mm_movemask_ps(valid) == 0)
+                continue;
+            __m128 sqrtd = _mm_sqrt_ps(_mm_and_ps(discriminant, valid));
+
+            __m128 oc2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz));
+            __m128 c = _mm_sub_ps(oc2, rad2);
+            __m128 q = _mm_add_ps(h, _mm_or_ps(sqrtd, _mm_and_ps(h, sign)));
+            __m128 t0 = _mm_mul_ps(q, inv_a);
+            __m128 t1 = _mm_div_ps(c, q);
+            __m128 near_t = _mm_min_ps(t0, t1);
+            __m128 far_t = _mm_max_ps(t0, t1);
+            __m128 near_ok = _mm_and_ps(_mm_cmpgt_ps(near_t, t_min), _mm_cmplt_ps(near_t, t_max));
+            __m128 far_ok = _mm_and_ps(_mm_cmpgt_ps(far_t, t_min), _mm_cmplt_ps(far_t, t_max));
+            __m128 t = _mm_or_ps(_mm_and_ps(near_ok, near_t), _mm_andnot_ps(near_ok, _mm_or_ps(_mm_and_ps(far_ok, far_t), _mm_andnot_ps(far_ok, inf))));
+            t = _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, inf));
+
+            alignas(16) float lanes[4];
+            _mm_store_ps(lanes, t);
+            for (int lane = 0; lane < 4 && i + lane < end; lane++) {
+                if (lanes[lane] < best_t) {
+                    best_t = lanes[lane];
+                    best = i + lane;
+                }
+            }
+        }
+        t_hit = best_t;
+        return best;
+    }
+
+    RT_TARGET_AVX int intersectAVX(const Ray& r, Interval ray_t, int begin, int end, real& t_hit) const {
+        const Vec3& d = r.direction();
+        const Point3& o = r.origin();
+        __m256 ox = _mm256_set1_ps(o.x()), oy = _mm256_set1_ps(o.y()), oz = _mm256_set1_ps(o.z());
+        __m256 dx = _mm256_set1_ps(d.x()), dy = _mm256_set1_ps(d.y()), dz = _mm256_set1_ps(d.z());
+        __m256 a = _mm256_set1_ps(d.length_squared());
+        __m256 inv_a = _mm256_set1_ps(1 / d.length_squared());
+        __m256 t_min = _mm256_set1_ps(ray_t.min);
+        __m256 t_max = _mm256_set1_ps(ray_t.max);
+        __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+        __m256 sign = _mm256_set1_ps(-0.0f);
+
+        int best = -1;
+        float best_t = ray_t.max;
+        for (int i = begin; i < end; i += 8) {
+            __m256 ocx = _mm256_sub_ps(_mm256_loadu_ps(&cx[i]), ox);
+            __m256 ocy = _mm256_sub_ps(_mm256_loadu_ps(&cy[i]), oy);
+            __m256 ocz = _mm256_sub_ps(_mm256_loadu_ps(&cz[i]), oz);
+            __m256 rad = _mm256_loadu_ps(&radius[i]);
+            __m256 rad2 = _mm256_mul_ps(rad, rad);
+
+            __m256 h = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, ocx), _mm256_mul_ps(dy, ocy)), _mm256_mul_ps(dz, ocz));
+            __m256 s = _mm256_mul_ps(h, inv_a);
+            __m256 lx = _mm256_sub_ps(ocx, _mm256_mul_ps(s, dx));
+            __m256 ly = _mm256_sub_ps(ocy, _mm256_mul_ps(s, dy));
+            __m256 lz = _mm256_sub_ps(ocz, _mm256_mul_ps(s, dz));
+            __m256 l2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_mul_ps(ly, ly)), _mm256_mul_ps(lz, lz));
+            __m256 discriminant = _mm256_mul_ps(a, _mm256_sub_ps(rad2, l2));
+            __m256 valid = _mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GE_OQ);
+            if (_mm256_movemask_ps(valid) == 0)
+                continue;
+            __m256 sqrtd = _mm256_sqrt_ps(_mm256_and_ps(discriminant, valid));
+
+            __m256 oc2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz));
+            __m256 c = _mm256_sub_ps(oc2, rad2);
+            __m256 q = _mm256_add_ps(h, _mm256_or_ps(sqrtd, _mm256_and_ps(h, sign)));
+            __m256 t0 = _mm256_mul_ps(q, inv_a);
+            __m256 t1 = _mm256_div_ps(c, q);
+            __m256 near_t = _mm256_min_ps(t0, t1);
+            __m256 far_t = _mm256_max_ps(t0, t1);
+            __m256 near_ok = _mm256_and_ps(_mm256_cmp_ps(near_t, t_min, _CMP_GT_OQ), _mm256_cmp_ps(near_t, t_max, _CMP_LT_OQ));
+            __m256 far_ok = _mm256_and_ps(_mm256_cmp_ps(far_t, t_min, _CMP_GT_OQ), _mm256_cmp_ps(far_t, t_max, _CMP_LT_OQ));
+            __m256 t = _mm256_blendv_ps(_mm256_blendv_ps(inf, far_t, far_ok), near_t, near_ok);
+            t = _mm256_blendv_ps(inf, t, valid);
+
+            alignas(32) float lanes[8];
+            _mm256_store_ps(lanes, t);
+            for (int lane = 0; lane < 8 && i + lane < end; lane++) {
+                if (lanes[lane] < best_t) {
+                    best_t = lanes[lane];
+                    best = i + lane;
+                }
+            }
+        }
+        t_hit = best_t;
+        return best;
+    }
+#endif
+#endif
+};
+
+#endif
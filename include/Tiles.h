@@ -0,0 +1,87 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+// Rectangular block of pixels [x0, x1) x [y0, y1).
+class Tile {
+public:
+    int x0, y0;
+    int x1, y1;
+
+    int pixel_count() const {
+        return (x1 - x0) * (y1 - y0);
+    }
+};
+
+enum class TileOrder {
+    Scanline,   // Row by row, top to bottom
+    Morton,     // Z-order curve over the tile grid, keeps neighbouring tiles close in time
+    Spiral      // Centre outwards, so the usually busier middle of the frame is started first
+};
+
+inline uint32_t morton_spread_bits(uint32_t v) {
+    // Inserts a zero bit between each of the low 16 bits of v.
+    v &= 0x0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+inline uint32_t morton_encode(uint32_t x, uint32_t y) {
+    return morton_spread_bits(x) | (morton_spread_bits(y) << 1);
+}
+
+// Splits a width x height frame into tile_size squares (clipped at the borders),
+// listed in the order they should be handed out to render threads.
+inline std::vector<Tile> MakeTiles(int width, int height, int tile_size, TileOrder order) {
+    tile_size = std::max(tile_size, 1);
+    int tiles_x = (width + tile_size - 1) / tile_size;
+    int tiles_y = (height + tile_size - 1) / tile_size;
+
+    std::vector<Tile> tiles;
+    tiles.reserve(size_t(tiles_x) * tiles_y);
+    for (int ty = 0; ty < tiles_y; ty++) {
+        for (int tx = 0; tx < tiles_x; tx++) {
+            Tile tile;
+            tile.x0 = tx * tile_size;
+            tile.y0 = ty * tile_size;
+            tile.x1 = std::min(tile.x0 + tile_size, width);
+            tile.y1 = std::min(tile.y0 + tile_size, height);
+            tiles.push_back(tile);
+        }
+    }
+
+    auto tile_x = [tile_size](const Tile& t) { return t.x0 / tile_size; };
+    auto tile_y = [tile_size](const Tile& t) { return t.y0 / tile_size; };
+
+    if (order == TileOrder::Morton) {
+        std::stable_sort(tiles.begin(), tiles.end(), [&](const Tile& a, const Tile& b) {
+            return morton_encode(tile_x(a), tile_y(a)) < morton_encode(tile_x(b), tile_y(b));
+            });
+    }
+    else if (order == TileOrder::Spiral) {
+        // Sort by square ring around the centre tile, then by angle within the ring.
+        double cx = (tiles_x - 1) / 2.0;
+        double cy = (tiles_y - 1) / 2.0;
+        auto ring = [&](const Tile& t) {
+            return std::max(std::fabs(tile_x(t) - cx), std::fabs(tile_y(t) - cy));
+        };
+        auto angle = [&](const Tile& t) {
+            return std::atan2(tile_y(t) - cy, tile_x(t) - cx);
+        };
+        std::stable_sort(tiles.begin(), tiles.end(), [&](const Tile& a, const Tile& b) {
+            double ra = ring(a), rb = ring(b);
+            if (ra != rb) return ra < rb;
+            return angle(a) < angle(b);
+            });
+    }
+    return tiles;
+}
+
+#endif
\ No newline at end of file
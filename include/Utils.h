@@ -6,6 +6,31 @@
 #include <memory>
 #include <cstdlib>
 
+#include "Random.h"
+
+// Scalar type of the geometry: positions, directions and ray parameters. The
+// RT_SINGLE_PRECISION build option makes it float, which halves the memory traffic of
+// vectors, BVH and framebuffers; sample accumulation stays in double either way.
+#ifdef RT_SINGLE_PRECISION
+using real = float;
+#else
+using real = double;
+#endif
+
+// Makes a parameter take no part in template argument deduction, so "2.0 * v" works for a
+// vector of any scalar type.
+template <typename T>
+struct non_deduced {
+    using type = T;
+};
+
+// Bound on the relative error of n successive rounded operations in T (Higham's gamma_n).
+template <typename T>
+constexpr T error_gamma(int n) {
+    constexpr T half_epsilon = std::numeric_limits<T>::epsilon() / 2;
+    return (n * half_epsilon) / (1 - n * half_epsilon);
+}
+
 // Constants
 
 const double infinity = std::numeric_limits<double>::infinity();
@@ -23,8 +48,8 @@ inline double radians_to_degrees(double radians) {
 
 
 inline double random_double() {
-    // Returns a random real in [0,1).
-    return std::rand() / (RAND_MAX + 1.0);
+    // Returns a random real in [0,1) from the calling thread's generator.
+    return thread_rng().next_double();
 }
 
 inline double random_double(double min, double max) {
@@ -32,6 +57,13 @@ inline double random_double(double min, double max) {
     return min + (max - min) * random_double();
 }
 
+inline double power_heuristic(double pdf_a, double pdf_b) {
+    // Multiple importance sampling weight for a sample drawn from strategy a.
+    double a2 = pdf_a * pdf_a;
+    double b2 = pdf_b * pdf_b;
+    return a2 + b2 > 0 ? a2 / (a2 + b2) : 0;
+}
+
 inline double linear_to_gamma(double linear_component) {
     if (linear_component > 0)
         return std::sqrt(linear_component);
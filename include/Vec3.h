@@ -6,37 +6,42 @@
 
 #include "Utils.h"
 
-class Vec3 {
+template <typename T>
+class Vec3T {
 public:
-    double e[3];
+    T e[3];
 
-    Vec3() : e{ 0,0,0 } {}
-    Vec3(double e0, double e1, double e2) : e{ e0, e1, e2 } {}
+    Vec3T() : e{ 0,0,0 } {}
+    Vec3T(T e0, T e1, T e2) : e{ e0, e1, e2 } {}
 
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
+    // Between precisions only on request, so a float path never silently widens.
+    template <typename U>
+    explicit Vec3T(const Vec3T<U>& v) : e{ T(v.e[0]), T(v.e[1]), T(v.e[2]) } {}
 
-    Vec3 operator-() const { return Vec3(-e[0], -e[1], -e[2]); }
-    double operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
+    T x() const { return e[0]; }
+    T y() const { return e[1]; }
+    T z() const { return e[2]; }
 
-    Vec3& operator*=(double t) {
+    Vec3T operator-() const { return Vec3T(-e[0], -e[1], -e[2]); }
+    T operator[](int i) const { return e[i]; }
+    T& operator[](int i) { return e[i]; }
+
+    Vec3T& operator*=(T t) {
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
         return *this;
     }
 
-    Vec3& operator/=(double t) {
+    Vec3T& operator/=(T t) {
         return *this *= 1 / t;
     }
 
-    double length() const {
+    T length() const {
         return std::sqrt(length_squared());
     }
 
-    double length_squared() const {
+    T length_squared() const {
         return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
     }
 
@@ -46,116 +51,118 @@ public:
         return (std::fabs(e[0]) < s) && (std::fabs(e[1]) < s) && (std::fabs(e[2]) < s);
     }
 
-    static Vec3 random() {
-        return Vec3(random_double(), random_double(), random_double());
+    static Vec3T random() {
+        return Vec3T(random_double(), random_double(), random_double());
     }
 
-    static Vec3 random(double min, double max) {
-        return Vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+    static Vec3T random(double min, double max) {
+        return Vec3T(random_double(min, max), random_double(min, max), random_double(min, max));
     }
 
 
 };
 
 
+using Vec3 = Vec3T<real>;
+using Vec3d = Vec3T<double>;
 using Point3 = Vec3;
 
+template <typename T>
+using scalar_of = typename non_deduced<T>::type;
+
 
-inline std::ostream& operator<<(std::ostream& out, const Vec3& v) {
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, const Vec3T<T>& v) {
     return out << "Vec3(x=" << v.e[0] << ", y=" << v.e[1] << ", z=" << v.e[2] << ")";
 }
 
-inline Vec3 operator+(const Vec3& u, const Vec3& v) {
-    return Vec3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+template <typename T>
+inline Vec3T<T> operator+(const Vec3T<T>& u, const Vec3T<T>& v) {
+    return Vec3T<T>(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
 }
 
-inline Vec3 operator+(double t, const Vec3& v) {
-    return Vec3(t + v.e[0], t + v.e[1], t + v.e[2]);
+template <typename T>
+inline Vec3T<T> operator+(scalar_of<T> t, const Vec3T<T>& v) {
+    return Vec3T<T>(t + v.e[0], t + v.e[1], t + v.e[2]);
 }
 
-inline Vec3 operator+(const Vec3& v, double t) {
+template <typename T>
+inline Vec3T<T> operator+(const Vec3T<T>& v, scalar_of<T> t) {
     return t + v;
 }
 
-inline Vec3 operator-(const Vec3& u, const Vec3& v) {
-    return Vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+template <typename T>
+inline Vec3T<T> operator-(const Vec3T<T>& u, const Vec3T<T>& v) {
+    return Vec3T<T>(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
 }
 
-inline Vec3 operator-(const Vec3& v, double t) {
-    return Vec3(v.e[0] - t, v.e[1] - t, v.e[2] - t);
+template <typename T>
+inline Vec3T<T> operator-(const Vec3T<T>& v, scalar_of<T> t) {
+    return Vec3T<T>(v.e[0] - t, v.e[1] - t, v.e[2] - t);
 }
 
-inline Vec3 operator*(const Vec3& u, const Vec3& v) {
-    return Vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+template <typename T>
+inline Vec3T<T> operator*(const Vec3T<T>& u, const Vec3T<T>& v) {
+    return Vec3T<T>(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline Vec3 operator*(double t, const Vec3& v) {
-    return Vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
+template <typename T>
+inline Vec3T<T> operator*(scalar_of<T> t, const Vec3T<T>& v) {
+    return Vec3T<T>(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
 
-inline Vec3 operator*(const Vec3& v, double t) {
+template <typename T>
+inline Vec3T<T> operator*(const Vec3T<T>& v, scalar_of<T> t) {
     return t * v;
 }
 
-inline Vec3 operator/(const Vec3& v, double t) {
+template <typename T>
+inline Vec3T<T> operator/(const Vec3T<T>& v, scalar_of<T> t) {
     return (1 / t) * v;
 }
 
-inline double dot(const Vec3& u, const Vec3& v) {
+template <typename T>
+inline T dot(const Vec3T<T>& u, const Vec3T<T>& v) {
     // Dot Product (Multiply each component)
     return u.e[0] * v.e[0]
         + u.e[1] * v.e[1]
         + u.e[2] * v.e[2];
 }
 
-inline Vec3 cross(const Vec3& u, const Vec3& v) {
+template <typename T>
+inline Vec3T<T> cross(const Vec3T<T>& u, const Vec3T<T>& v) {
     // Cross Product (Use matrix determinant)
-    return Vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+    return Vec3T<T>(u.e[1] * v.e[2] - u.e[2] * v.e[1],
         u.e[2] * v.e[0] - u.e[0] * v.e[2],
         u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
-inline Vec3 normalize(const Vec3& v) {
+template <typename T>
+inline Vec3T<T> normalize(const Vec3T<T>& v) {
     return v / v.length();
 }
 
-inline Vec3 random_unit_vector() {
-    while (true) {
-        auto p = Vec3::random(-1, 1);
-        auto lensq = p.length_squared();
-        if (1e-160 < lensq && lensq <= 1)
-            return p / sqrt(lensq);
-    }
+template <typename T>
+inline Vec3T<T> component_abs(const Vec3T<T>& v) {
+    return Vec3T<T>(std::fabs(v.e[0]), std::fabs(v.e[1]), std::fabs(v.e[2]));
 }
 
-inline Vec3 random_on_hemisphere(const Vec3& normal) {
-    Vec3 on_unit_sphere = random_unit_vector();
-    if (dot(on_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
-        return on_unit_sphere;
-    else
-        return -on_unit_sphere;
-}
-Vec3 lerp(Vec3 a, Vec3 b, double t) {
+template <typename T>
+inline Vec3T<T> lerp(const Vec3T<T>& a, const Vec3T<T>& b, scalar_of<T> t) {
     return (1 - t) * a + t * b;
 }
 
-inline Vec3 reflect(const Vec3& v, const Vec3& n) {
+template <typename T>
+inline Vec3T<T> reflect(const Vec3T<T>& v, const Vec3T<T>& n) {
     return v - 2 * dot(v, n) * n;
 }
 
-inline Vec3 refract(const Vec3& uv, const Vec3& n, double etai_over_etat) {
-    auto cos_theta = std::fmin(dot(-uv, n), 1.0);
-    Vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
-    Vec3 r_out_parallel = -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())) * n;
+template <typename T>
+inline Vec3T<T> refract(const Vec3T<T>& uv, const Vec3T<T>& n, scalar_of<T> etai_over_etat) {
+    T cos_theta = std::fmin(dot(-uv, n), T(1));
+    Vec3T<T> r_out_perp = etai_over_etat * (uv + cos_theta * n);
+    Vec3T<T> r_out_parallel = -std::sqrt(std::fabs(1 - r_out_perp.length_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
 
-inline Vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = Vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() < 1)
-            return p;
-    }
-}
-
 #endif
@@ -0,0 +1,260 @@
+#ifndef WARP_H
+#define WARP_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#include "Vec3.h"
+#include "Simd.h"
+
+// Warps from points u in [0, 1)^2 (u.x, u.y) to directions and disk positions. All of them
+// are closed-form and branch-free: each output takes exactly one input point, so a
+// stratified sampler stays stratified, the number of random draws is fixed, and there is
+// no rejection loop for the branch predictor to guess at.
+//
+// The scalar functions and the batched ones below are the same kernels, so a direction
+// comes out bit for bit the same either way. The batched ones take and return structures
+// of arrays and compile to vector code, with an AVX copy picked at run time.
+
+namespace warp_detail {
+    // sin and cos of d for |d| <= pi/4, by Taylor series to the order where the next term
+    // drops below double precision.
+    RT_FORCE_INLINE void sincos_octant(double d, double& s, double& c) {
+        double d2 = d * d;
+        s = d * (1 + d2 * (-1.0 / 6 + d2 * (1.0 / 120 + d2 * (-1.0 / 5040 + d2 * (1.0 / 362880
+            + d2 * (-1.0 / 39916800 + d2 * (1.0 / 6227020800.0 + d2 * (-1.0 / 1307674368000.0))))))));
+        c = 1 + d2 * (-1.0 / 2 + d2 * (1.0 / 24 + d2 * (-1.0 / 720 + d2 * (1.0 / 40320 + d2 * (-1.0 / 3628800
+            + d2 * (1.0 / 479001600 + d2 * (-1.0 / 87178291200.0 + d2 * (1.0 / 20922789888000.0))))))));
+    }
+
+    // sin and cos of 2 pi t for t >= 0. The quarter turn t falls in comes from an integer
+    // conversion and is applied with arithmetic rather than branches, so loops over this
+    // vectorise.
+    RT_FORCE_INLINE void sincos_turns(double t, double& s, double& c) {
+        const double sqrt_half = 0.70710678118654752440;
+        double quarters = t * 4;
+        int q = int(quarters);
+        double d = (quarters - q - 0.5) * (pi / 2);
+        double sd, cd;
+        sincos_octant(d, sd, cd);
+        // The angle within the quarter is pi/4 + d.
+        double sq = (cd + sd) * sqrt_half;
+        double cq = (cd - sd) * sqrt_half;
+        // Quarter turns: q = 1 maps (c, s) to (-s, c), q = 2 to (-c, -s), q = 3 to (s, -c).
+        // A product with an exact 0 or 1 selects exactly.
+        double odd = double(q & 1);
+        double cos_sign = double(1 - 2 * (((q + 1) >> 1) & 1));
+        double sin_sign = double(1 - 2 * ((q >> 1) & 1));
+        c = cos_sign * ((1 - odd) * cq + odd * sq);
+        s = sin_sign * ((1 - odd) * sq + odd * cq);
+    }
+
+    RT_FORCE_INLINE void unit_vector(double u0, double u1, double& x, double& y, double& z) {
+        // Uniform in z, then the circle at that height; r from u0 directly avoids the
+        // cancellation of sqrt(1 - z^2) near the poles.
+        z = 1 - 2 * u0;
+        double r = 2 * std::sqrt(u0 * (1 - u0));
+        double s, c;
+        sincos_turns(u1, s, c);
+        x = r * c;
+        y = r * s;
+    }
+
+    // Shirley and Chiu's concentric mapping of the square to the disk. Also returns the
+    // radius, which the cosine warp needs.
+    RT_FORCE_INLINE void concentric_disk(double u0, double u1, double& x, double& y, double& r) {
+        double a = 2 * u0 - 1;
+        double b = 2 * u1 - 1;
+        // Which of |a| and |b| is larger picks the wedge. The two formulas agree on the
+        // diagonal, so comparing in single precision is good enough, and as integers the
+        // comparison vectorises where a floating point select would not.
+        float fa = float(std::fabs(a)), fb = float(std::fabs(b));
+        int32_t ia, ib;
+        std::memcpy(&ia, &fa, sizeof(ia));
+        std::memcpy(&ib, &fb, sizeof(ib));
+        double m = double(ia > ib);
+        double big = m * a + (1 - m) * b;
+        double small = m * b + (1 - m) * a;
+        // |big| is 0 or at least 2^-53, so the offset only matters at the centre, 0 / 0.
+        double t = small / (big + 1e-300);
+        double s, c;
+        sincos_octant((pi / 4) * t, s, c);
+        x = big * (m * c + (1 - m) * s);
+        y = big * (m * s + (1 - m) * c);
+        r = std::fabs(big);
+    }
+
+    // Cosine-weighted direction around +z, by projecting the disk up to the hemisphere
+    // (Malley's method).
+    RT_FORCE_INLINE void cosine_hemisphere(double u0, double u1, double& x, double& y, double& z) {
+        double r;
+        concentric_disk(u0, u1, x, y, r);
+        z = std::sqrt(1 - r * r);
+    }
+
+    // Tangents b1, b2 completing the unit vector n to a right-handed orthonormal basis,
+    // without a branch or normalisation (Duff et al. 2017).
+    RT_FORCE_INLINE void basis(double nx, double ny, double nz, double& b1x, double& b1y, double& b1z,
+        double& b2x, double& b2y, double& b2z) {
+        double sign = std::copysign(1.0, nz);
+        double a = -1 / (sign + nz);
+        double b = nx * ny * a;
+        b1x = 1 + sign * nx * nx * a;
+        b1y = sign * b;
+        b1z = -sign * nx;
+        b2x = b;
+        b2y = sign + ny * ny * a;
+        b2z = -ny;
+    }
+
+    RT_FORCE_INLINE void cosine_direction(double nx, double ny, double nz, double u0, double u1,
+        double& x, double& y, double& z) {
+        double lx, ly, lz, b1x, b1y, b1z, b2x, b2y, b2z;
+        cosine_hemisphere(u0, u1, lx, ly, lz);
+        basis(nx, ny, nz, b1x, b1y, b1z, b2x, b2y, b2z);
+        x = lx * b1x + ly * b2x + lz * nx;
+        y = lx * b1y + ly * b2y + lz * ny;
+        z = lx * b1z + ly * b2z + lz * nz;
+    }
+}
+
+// Uniform on the unit sphere.
+inline Vec3 sample_unit_vector(const Vec3& u) {
+    double x, y, z;
+    warp_detail::unit_vector(u.x(), u.y(), x, y, z);
+    return Vec3(x, y, z);
+}
+
+// Uniform on the unit disk in the xy plane.
+inline Vec3 sample_unit_disk(const Vec3& u) {
+    double x, y, r;
+    warp_detail::concentric_disk(u.x(), u.y(), x, y, r);
+    return Vec3(x, y, 0);
+}
+
+// Cosine-weighted around the unit normal n, with density cos(theta) / pi.
+inline Vec3 sample_cosine_direction(const Vec3& n, const Vec3& u) {
+    double x, y, z;
+    warp_detail::cosine_direction(n.x(), n.y(), n.z(), u.x(), u.y(), x, y, z);
+    return Vec3(x, y, z);
+}
+
+// Tangents that complete the unit vector n to an orthonormal basis.
+inline void make_basis(const Vec3& n, Vec3& b1, Vec3& b2) {
+    double b1x, b1y, b1z, b2x, b2y, b2z;
+    warp_detail::basis(n.x(), n.y(), n.z(), b1x, b1y, b1z, b2x, b2y, b2z);
+    b1 = Vec3(b1x, b1y, b1z);
+    b2 = Vec3(b2x, b2y, b2z);
+}
+
+inline Vec3 random_unit_vector() {
+    double u0 = random_double();
+    return sample_unit_vector(Vec3(u0, random_double(), 0));
+}
+
+inline Vec3 random_on_hemisphere(const Vec3& normal) {
+    Vec3 on_unit_sphere = random_unit_vector();
+    if (dot(on_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
+        return on_unit_sphere;
+    else
+        return -on_unit_sphere;
+}
+
+inline Vec3 random_in_unit_disk() {
+    double u0 = random_double();
+    return sample_unit_disk(Vec3(u0, random_double(), 0));
+}
+
+// Batched warps over structures of arrays: count points (u0[i], u1[i]) in, count results
+// out.
+
+namespace warp_detail {
+    RT_FORCE_INLINE void unit_vectors(size_t count, const double* u0, const double* u1, real* RT_RESTRICT x, real* RT_RESTRICT y, real* RT_RESTRICT z) {
+        for (size_t i = 0; i < count; i++) {
+            double vx, vy, vz;
+            unit_vector(u0[i], u1[i], vx, vy, vz);
+            x[i] = real(vx);
+            y[i] = real(vy);
+            z[i] = real(vz);
+        }
+    }
+
+    RT_FORCE_INLINE void unit_disks(size_t count, const double* u0, const double* u1, real* RT_RESTRICT x, real* RT_RESTRICT y) {
+        for (size_t i = 0; i < count; i++) {
+            double vx, vy, r;
+            concentric_disk(u0[i], u1[i], vx, vy, r);
+            x[i] = real(vx);
+            y[i] = real(vy);
+        }
+    }
+
+    RT_FORCE_INLINE void cosine_directions(size_t count, const real* nx, const real* ny, const real* nz,
+        const double* u0, const double* u1, real* RT_RESTRICT x, real* RT_RESTRICT y, real* RT_RESTRICT z) {
+        for (size_t i = 0; i < count; i++) {
+            double vx, vy, vz;
+            cosine_direction(nx[i], ny[i], nz[i], u0[i], u1[i], vx, vy, vz);
+            x[i] = real(vx);
+            y[i] = real(vy);
+            z[i] = real(vz);
+        }
+    }
+
+#if RT_SIMD_X86
+    RT_TARGET_AVX inline void unit_vectors_avx(size_t count, const double* u0, const double* u1, real* RT_RESTRICT x, real* RT_RESTRICT y, real* RT_RESTRICT z) {
+        unit_vectors(count, u0, u1, x, y, z);
+    }
+
+    RT_TARGET_AVX inline void unit_disks_avx(size_t count, const double* u0, const double* u1, real* RT_RESTRICT x, real* RT_RESTRICT y) {
+        unit_disks(count, u0, u1, x, y);
+    }
+
+    RT_TARGET_AVX inline void cosine_directions_avx(size_t count, const real* nx, const real* ny, const real* nz,
+        const double* u0, const double* u1, real* RT_RESTRICT x, real* RT_RESTRICT y, real* RT_RESTRICT z) {
+        cosine_directions(count, nx, ny, nz, u0, u1, x, y, z);
+    }
+#endif
+}
+
+inline void SampleUnitVectors(size_t count, const double* u0, const double* u1, real* RT_RESTRICT x, real* RT_RESTRICT y, real* RT_RESTRICT z) {
+    switch (simd_level()) {
+#if RT_SIMD_X86
+    case SimdLevel::AVX:
+        warp_detail::unit_vectors_avx(count, u0, u1, x, y, z);
+        return;
+#endif
+    default:
+        warp_detail::unit_vectors(count, u0, u1, x, y, z);
+        return;
+    }
+}
+
+inline void SampleUnitDisks(size_t count, const double* u0, const double* u1, real* RT_RESTRICT x, real* RT_RESTRICT y) {
+    switch (simd_level()) {
+#if RT_SIMD_X86
+    case SimdLevel::AVX:
+        warp_detail::unit_disks_avx(count, u0, u1, x, y);
+        return;
+#endif
+    default:
+        warp_detail::unit_disks(count, u0, u1, x, y);
+        return;
+    }
+}
+
+// Cosine-weighted directions around the unit normals (nx[i], ny[i], nz[i]).
+inline void SampleCosineDirections(size_t count, const real* nx, const real* ny, const real* nz,
+    const double* u0, const double* u1, real* RT_RESTRICT x, real* RT_RESTRICT y, real* RT_RESTRICT z) {
+    switch (simd_level()) {
+#if RT_SIMD_X86
+    case SimdLevel::AVX:
+        warp_detail::cosine_directions_avx(count, nx, ny, nz, u0, u1, x, y, z);
+        return;
+#endif
+    default:
+        warp_detail::cosine_directions(count, nx, ny, nz, u0, u1, x, y, z);
+        return;
+    }
+}
+
+#endif
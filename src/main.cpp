@@ -1,10 +1,53 @@
 #include <iostream>
+#include <string>
+#include <cstdlib>
 
 #include "Scene.h"
 #include "Object.h"
 #include "Material.h"
-
-int main() {
+#include "DemoScenes.h"
+#include "SceneFile.h"
+
+int main(int argc, char** argv) {
+
+    // --scene FILE renders a scene file (text or binary) instead of the built-in scene, and
+    // --write-scene OUT converts a text scene file to the binary form and exits.
+    // --coordinator ADDRESS renders with worker processes started with --worker ADDRESS,
+    // where ADDRESS is host:port or unix:/path/to/socket.
+    // --samples N overrides the samples per pixel, and --denoise N filters the image with N
+    // iterations of the denoiser (5 is the usual choice) before it is written.
+    // --exr FILE also writes every buffer, linear and unquantised, as one OpenEXR file, and
+    // --pfm FILE the colour alone as PFM.
+    // --sampler independent|sobol|zsobol picks where the samples come from (see Sampler.h);
+    // workers must be started with the same choice as their coordinator.
+    // --packets 4|8|16 traces the camera rays of 2x2, 4x2 or 4x4 pixel blocks as packets.
+    // --wavefront 1 renders in wavefront order (see Scene::wavefront).
+    // --bvh-width 2|4|8 sets the children per BVH node (see Scene::bvh_width).
+    std::string scene_path, binary_scene_path, coordinator_address, worker_address, exr_path, pfm_path, sampler_name;
+    int samples = 0, denoise_iterations = 0, packet_size = 0, wavefront = 0, bvh_width = 0;
+    for (int i = 1; i < argc; i += 2) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return 1;
+        }
+        if (arg == "--scene") scene_path = argv[i + 1];
+        else if (arg == "--write-scene") binary_scene_path = argv[i + 1];
+        else if (arg == "--coordinator") coordinator_address = argv[i + 1];
+        else if (arg == "--worker") worker_address = argv[i + 1];
+        else if (arg == "--samples") samples = std::atoi(argv[i + 1]);
+        else if (arg == "--denoise") denoise_iterations = std::atoi(argv[i + 1]);
+        else if (arg == "--exr") exr_path = argv[i + 1];
+        else if (arg == "--pfm") pfm_path = argv[i + 1];
+        else if (arg == "--sampler") sampler_name = argv[i + 1];
+        else if (arg == "--packets") packet_size = std::atoi(argv[i + 1]);
+        else if (arg == "--wavefront") wavefront = std::atoi(argv[i + 1]);
+        else if (arg == "--bvh-width") bvh_width = std::atoi(argv[i + 1]);
+        else {
+            std::cerr << "Unknown option " << arg << std::endl;
+            return 1;
+        }
+    }
 
     // Image
     auto aspect_ratio = 16.0 / 9.0;
@@ -23,84 +66,60 @@ int main() {
     scene.samples_per_pixel = 150;
     scene.max_bouces = 100;
 
-    scene.vfov = 20;
-    scene.lookfrom = Point3(13, 2, 3);
-    scene.lookat = Point3(0, 0, 0);
-
-    scene.defocus_angle = 0.6;
-    scene.focus_dist = 10.0;
-    scene.exposure = 0.05;
-
-    scene.Init();
-
-
-    auto ground_material = MakeLambertian(Color(0.5, 0.5, 0.5));
-    scene.AddObject(MakeSphere(Point3(0, -1000, 0), 1000, ground_material));
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            Point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
-
-            if ((center - Point3(4, 0.2, 0)).length() > 0.9) {
-                std::shared_ptr<Material> sphere_material;
-
-                if (choose_mat < 0.3) {
-                    // diffuse
-                    auto albedo = Color::random() * Color::random();
-                    sphere_material = MakeLambertian(albedo);
-                    scene.AddObject(MakeSphere(center, 0.2, sphere_material));
-                }
-                else if (choose_mat < 0.8) {
-                    // emission
-                    auto emit_color = from_hsv(random_double(0.2, 0.95), 0.7, 1);
-                    emit_color = emit_color * emit_color;
-                    sphere_material = MakeEmission(emit_color, random_double(6, 15));
-                    scene.AddObject(MakeSphere(center, 0.2, sphere_material));
-                }
-                else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = Color::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = MakeMetal(albedo, fuzz);
-                    scene.AddObject(MakeSphere(center, 0.2, sphere_material));
-                }
-                else {
-                    // glass
-                    sphere_material = MakeDielectric(1.5);
-                    scene.AddObject(MakeSphere(center, 0.2, sphere_material));
-                }
-            }
+    if (!binary_scene_path.empty()) {
+        SceneDescription desc;
+        if (scene_path.empty() || !ParseSceneText(scene_path, desc) || !WriteBinaryScene(desc, binary_scene_path))
+            return 1;
+        std::cout << "Saved " << binary_scene_path << std::endl;
+        return 0;
+    }
+    if (!scene_path.empty()) {
+        if (!LoadSceneFile(scene, scene_path))
+            return 1;
+    }
+    else {
+        BuildSpheresScene(scene);
+    }
+    if (samples > 0)
+        scene.samples_per_pixel = samples;
+    if (sampler_name == "independent") scene.sampler = SamplerType::Independent;
+    else if (sampler_name == "sobol") scene.sampler = SamplerType::Sobol;
+    else if (sampler_name == "zsobol") scene.sampler = SamplerType::ZSobol;
+    else if (!sampler_name.empty()) {
+        std::cerr << "Unknown sampler " << sampler_name << std::endl;
+        return 1;
+    }
+    scene.packet_size = packet_size;
+    scene.wavefront = wavefront != 0;
+    if (bvh_width != 0) {
+        if (bvh_width != 2 && bvh_width != 4 && bvh_width != 8) {
+            std::cerr << "BVH width must be 2, 4 or 8, not " << bvh_width << std::endl;
+            return 1;
         }
+        scene.bvh_width = bvh_width;
     }
+    if (denoise_iterations > 0) {
+        scene.denoise = true;
+        scene.denoise_settings.iterations = denoise_iterations;
+    }
+    scene.Init();
 
-    auto material1 = MakeDielectric(1.5);
-    scene.AddObject(MakeSphere(Point3(0, 1, 0), 1.0, material1));
-
-    auto material2 = MakeLambertian(Color(0.4, 0.2, 0.1));
-    scene.AddObject(MakeSphere(Point3(-4, 1, 0), 1.0, material2));
-
-    auto material3 = MakeMetal(Color(0.7, 0.6, 0.5), 0.0);
-    scene.AddObject(MakeSphere(Point3(4, 1, 0), 1.0, material3));
-
-
-
-    auto material_ground = MakeLambertian(Color(0.1, 0.2, 0.5));
-    auto material_center = MakeLambertian(Color(0.1, 0.2, 0.5));
-    auto material_left = MakeDielectric(1.5);
-    auto material_bubble = MakeDielectric(1.0 / 1.5);
-    auto material_right = MakeMetal(Color(0.8, 0.6, 0.2), 1.0);
-
-    scene.AddObject(MakeSphere(Point3(0.0, -100.5, -1.0), 100.0, material_ground));
-    scene.AddObject(MakeSphere(Point3(0.0, 0.0, -1.2), 0.5, material_center));
-    scene.AddObject(MakeSphere(Point3(-1.0, 0.0, -1.0), 0.5, material_left));
-    scene.AddObject(MakeSphere(Point3(-1.0, 0.0, -1.0), 0.4, material_bubble));
-    scene.AddObject(MakeSphere(Point3(1.0, 0.0, -1.0), 0.5, material_right));
-
-    scene.Render();
+    if (!worker_address.empty())
+        return scene.RunWorker(worker_address) ? 0 : 1;
+    if (!coordinator_address.empty()) {
+        if (!scene.RenderCoordinator(coordinator_address))
+            return 1;
+    }
+    else if (!scene.Render()) {
+        return 1;
+    }
     scene.Write("output/image_albedo.png", scene.get_albedo_map());
     scene.Write("output/image_normal.png", scene.get_normal_map());
     scene.Write("output/image_depth.png", scene.get_depth_map());
     scene.Write("output/image.png", scene.get_color_map());
-    return 0;
+    if (!exr_path.empty() && !scene.WriteEXR(exr_path))
+        return 1;
+    if (!pfm_path.empty() && !scene.WritePFM(pfm_path, scene.get_color_map()))
+        return 1;
+    return scene.FinishWrites() ? 0 : 1;
 }
\ No newline at end of file